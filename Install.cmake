@@ -26,6 +26,10 @@ pr_install_binary(openimagedenoise_device_sycl WIN "OpenImageDenoise_device_sycl
 # assets
 pr_install_directory("${CMAKE_CURRENT_LIST_DIR}/assets/" INSTALL_DIR "modules/")
 
+if(PR_UNIRENDER_WITH_WORKER)
+	pr_install_targets(pr_unirender_worker INSTALL_DIR "${INSTALL_PATH}")
+endif()
+
 if(PR_UNIRENDER_WITH_CYCLES)
 	# render_raytracing tool
 	pr_install_targets(render_raytracing render_raytracing_lib)
@@ -0,0 +1,175 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <pragma/c_engine.h>
+#include <pragma/entities/baseentity_handle.h>
+#include <pragma/entities/baseentity.h>
+#include <pragma/model/model.h>
+#include <util_image_buffer.hpp>
+#include <sharedutils/util_parallel_job.hpp>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+
+module pragma.modules.scenekit;
+
+import pragma.scenekit;
+import :scene;
+
+using namespace pragma::modules;
+
+class AOBakeBatchWorker : public util::ParallelWorker<uimg::ImageLayerSet> {
+  public:
+	// Geometry shared by all targets of a model. The shaders are created on the main thread, the meshes by the worker.
+	struct ModelGeometry {
+		std::shared_ptr<Model> model = nullptr;
+		std::shared_ptr<scenekit::Cache> cache = nullptr;
+		std::vector<scenekit::Cache::AOBakeSubMesh> subMeshes;
+		std::unordered_map<uint32_t, scenekit::Cache::AOBakeMesh> meshes;
+		bool built = false;
+	};
+	struct Bake {
+		uint32_t targetIndex = 0;
+		uint32_t materialIndex = 0;
+		std::shared_ptr<ModelGeometry> geometry = nullptr;
+	};
+	AOBakeBatchWorker(std::vector<Bake> &&bakes, const std::function<std::shared_ptr<scenekit::Scene>()> &createScene, const std::string &renderer);
+	using util::ParallelWorker<uimg::ImageLayerSet>::Cancel;
+	virtual uimg::ImageLayerSet GetResult() override;
+  private:
+	util::ParallelJob<uimg::ImageLayerSet> StartBake(const Bake &bake, std::shared_ptr<scenekit::Scene> &outScene, std::shared_ptr<pragma::scenekit::Renderer> &outRenderer, std::string &outErr);
+	std::vector<Bake> m_bakes;
+	std::function<std::shared_ptr<scenekit::Scene>()> m_createScene;
+	std::string m_renderer;
+	uimg::ImageLayerSet m_result {};
+	template<typename TJob, typename... TARGS>
+	friend util::ParallelJob<typename TJob::RESULT_TYPE> util::create_parallel_job(TARGS &&...args);
+};
+
+AOBakeBatchWorker::AOBakeBatchWorker(std::vector<Bake> &&bakes, const std::function<std::shared_ptr<scenekit::Scene>()> &createScene, const std::string &renderer) : m_bakes {std::move(bakes)}, m_createScene {createScene}, m_renderer {renderer}
+{
+	// Targets of the same model are baked back to back, so the geometry of a model can be released as soon as its last target is done
+	std::stable_sort(m_bakes.begin(), m_bakes.end(), [](const Bake &a, const Bake &b) { return a.geometry.get() < b.geometry.get(); });
+	AddThread([this]() {
+		auto numBakes = m_bakes.size();
+		for(auto i = decltype(numBakes) {0u}; i < numBakes; ++i) {
+			auto &bake = m_bakes[i];
+			auto &geometry = *bake.geometry;
+			if(geometry.built == false) {
+				geometry.meshes = geometry.cache->BuildAOBakeMeshes(*geometry.model, geometry.subMeshes);
+				geometry.built = true;
+			}
+			// Every target gets its own scene and renderer (with the occluders of the model added again), since the renderer can't swap the
+			// bake target of an existing scene. They are only created once the previous bake has been released, so only one of them is alive at a time.
+			std::shared_ptr<scenekit::Scene> scene = nullptr;
+			std::shared_ptr<pragma::scenekit::Renderer> renderer = nullptr;
+			std::string err;
+			auto job = StartBake(bake, scene, renderer, err);
+			if(job.IsValid() == false) {
+				SetStatus(util::JobStatus::Failed, "Unable to start ambient occlusion bake for target " + std::to_string(bake.targetIndex) + ": " + err);
+				return;
+			}
+			job.Start();
+			while(job.IsComplete() == false) {
+				if(IsCancelled()) {
+					job.Cancel();
+					job.Wait();
+					return;
+				}
+				UpdateProgress((i + job.GetProgress()) / static_cast<float>(numBakes));
+				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			}
+			if(job.IsSuccessful() == false) {
+				SetStatus(util::JobStatus::Failed);
+				return;
+			}
+			auto result = job.GetResult();
+			auto it = std::find_if(result.images.begin(), result.images.end(), [](const auto &pair) { return pair.second != nullptr; });
+			if(it != result.images.end())
+				m_result.images[scenekit::get_ao_bake_batch_layer_name(bake.targetIndex)] = it->second;
+			if(i + 1 == numBakes || m_bakes[i + 1].geometry != bake.geometry)
+				geometry = {};
+		}
+		m_bakes.clear();
+		UpdateProgress(1.f);
+		SetStatus(util::JobStatus::Successful);
+	});
+}
+
+util::ParallelJob<uimg::ImageLayerSet> AOBakeBatchWorker::StartBake(const Bake &bake, std::shared_ptr<scenekit::Scene> &outScene, std::shared_ptr<pragma::scenekit::Renderer> &outRenderer, std::string &outErr)
+{
+	auto &geometry = *bake.geometry;
+	auto itTarget = geometry.meshes.find(bake.materialIndex);
+	if(itTarget == geometry.meshes.end()) {
+		outErr = "No mesh for material index " + std::to_string(bake.materialIndex);
+		return {};
+	}
+	// Meshes with other materials are still required as occluders
+	std::vector<pragma::scenekit::PMesh> occluders;
+	occluders.reserve(geometry.meshes.size() - 1);
+	for(auto &[matIdx, aoMesh] : geometry.meshes) {
+		if(matIdx != bake.materialIndex)
+			occluders.push_back(aoMesh.mesh);
+	}
+
+	outScene = m_createScene();
+	if(outScene == nullptr) {
+		outErr = "Unable to create scene";
+		return {};
+	}
+	outScene->SetAOBakeTarget(*geometry.cache, itTarget->second, occluders);
+	outScene->Finalize();
+	outRenderer = pragma::scenekit::Renderer::Create(**outScene, m_renderer, outErr, pragma::scenekit::Renderer::Flags::None);
+	if(outRenderer == nullptr)
+		return {};
+	return outRenderer->StartRender();
+}
+
+uimg::ImageLayerSet AOBakeBatchWorker::GetResult() { return m_result; }
+
+std::string pragma::modules::scenekit::get_ao_bake_batch_layer_name(uint32_t targetIndex) { return "AO" + std::to_string(targetIndex); }
+
+util::ParallelJob<uimg::ImageLayerSet> pragma::modules::scenekit::bake_ambient_occlusion(const std::vector<AOBakeTarget> &targets, const std::function<std::shared_ptr<Scene>()> &createScene, const std::string &renderer)
+{
+	// All targets that share a model (or entity) also share its geometry, so the mesh data and shaders only have to be built once per model.
+	// Only the shaders are created here, the geometry, scenes and renderers are built by the worker.
+	std::unordered_map<const void *, std::shared_ptr<AOBakeBatchWorker::ModelGeometry>> modelGeometry;
+	std::vector<AOBakeBatchWorker::Bake> bakes;
+	bakes.reserve(targets.size());
+	for(auto i = decltype(targets.size()) {0u}; i < targets.size(); ++i) {
+		auto &target = targets[i];
+		auto *ent = target.entity.get();
+		auto mdl = ent ? ent->GetModel() : target.model;
+		if(mdl == nullptr) {
+			Con::cwar << "Unable to bake ambient occlusion for target " << i << ": Invalid model!" << Con::endl;
+			continue;
+		}
+		auto *key = ent ? static_cast<const void *>(ent) : static_cast<const void *>(mdl.get());
+		auto it = modelGeometry.find(key);
+		if(it == modelGeometry.end()) {
+			auto geometry = std::make_shared<AOBakeBatchWorker::ModelGeometry>();
+			geometry->model = mdl;
+			geometry->cache = std::make_shared<Cache>(pragma::scenekit::Scene::RenderMode::BakeAmbientOcclusion);
+			geometry->subMeshes = geometry->cache->PrepareAOBakeMeshes(ent, *mdl);
+			it = modelGeometry.insert(std::make_pair(key, std::move(geometry))).first;
+		}
+		auto &geometry = it->second;
+		auto hasMaterial = std::find_if(geometry->subMeshes.begin(), geometry->subMeshes.end(), [&target](const Cache::AOBakeSubMesh &subMesh) { return subMesh.materialIndex == target.materialIndex; }) != geometry->subMeshes.end();
+		if(hasMaterial == false) {
+			Con::cwar << "Unable to bake ambient occlusion for target " << i << ": Model has no meshes with material index " << target.materialIndex << "!" << Con::endl;
+			continue;
+		}
+		bakes.push_back({static_cast<uint32_t>(i), target.materialIndex, geometry});
+	}
+	if(bakes.empty())
+		return {};
+	// createScene is called from the job's thread, the node manager is created lazily and has to exist before then
+	get_node_manager();
+	return util::create_parallel_job<AOBakeBatchWorker>(std::move(bakes), createScene, renderer);
+}
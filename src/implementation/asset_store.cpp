@@ -0,0 +1,234 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <sharedutils/util_file.h>
+#include <mathutil/umath.h>
+#include <udm.hpp>
+#include <filesystem>
+#include <fstream>
+#include <cstring>
+#include <cinttypes>
+#include <array>
+#include <unordered_set>
+
+module pragma.modules.scenekit;
+
+import :asset_store;
+import :serialization;
+
+using namespace pragma::modules::scenekit;
+
+static_assert(sizeof(AssetStore::ChunkRef) == 24);
+
+static constexpr uint64_t mix64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+	return x;
+}
+
+// Not a cryptographic hash, but two independent 64-bit lanes make accidental collisions between blobs practically impossible.
+// The stored size is validated on read as well.
+AssetStore::Hash AssetStore::CalcHash(const void *data, size_t size)
+{
+	auto *bytes = static_cast<const uint8_t *>(data);
+	uint64_t a = 0xcbf29ce484222325ull ^ size;
+	uint64_t b = 0x9e3779b97f4a7c15ull + size;
+	auto process = [&a, &b](uint64_t w) {
+		a = (a ^ w) * 0x100000001b3ull;
+		a = (a << 29) | (a >> 35);
+		b = mix64(b ^ w) + 0x9e3779b97f4a7c15ull;
+	};
+	size_t i = 0;
+	for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t w;
+		memcpy(&w, bytes + i, sizeof(w));
+		process(w);
+	}
+	if(i < size) {
+		uint64_t w = 0;
+		memcpy(&w, bytes + i, size - i);
+		process(w);
+	}
+	return {mix64(a), mix64(b ^ a)};
+}
+
+std::string AssetStore::Hash::ToString() const
+{
+	std::array<char, 33> str;
+	snprintf(str.data(), str.size(), "%016" PRIx64 "%016" PRIx64, a, b);
+	return str.data();
+}
+
+static const std::array<uint64_t, 256> &get_gear_table()
+{
+	static auto table = []() {
+		std::array<uint64_t, 256> table;
+		uint64_t state = 0x2545f4914f6cdd1dull;
+		for(auto &v : table) {
+			state += 0x9e3779b97f4a7c15ull;
+			v = mix64(state);
+		}
+		return table;
+	}();
+	return table;
+}
+
+std::vector<std::pair<size_t, size_t>> AssetStore::SplitIntoChunks(const void *data, size_t size)
+{
+	constexpr size_t MIN_CHUNK_SIZE = 16 * 1'024;
+	constexpr size_t MAX_CHUNK_SIZE = 256 * 1'024;
+	// Average chunk size of ~64 KiB
+	constexpr uint64_t BOUNDARY_MASK = 0xFFFF'0000'0000'0000ull;
+	auto &gear = get_gear_table();
+	auto *bytes = static_cast<const uint8_t *>(data);
+	std::vector<std::pair<size_t, size_t>> chunks;
+	size_t start = 0;
+	while(start < size) {
+		auto remaining = size - start;
+		auto len = remaining;
+		if(remaining > MIN_CHUNK_SIZE) {
+			auto end = umath::min(remaining, MAX_CHUNK_SIZE);
+			uint64_t h = 0;
+			len = end;
+			for(auto i = MIN_CHUNK_SIZE; i < end; ++i) {
+				h = (h << 1) + gear[bytes[start + i]];
+				if((h & BOUNDARY_MASK) == 0) {
+					len = i + 1;
+					break;
+				}
+			}
+		}
+		chunks.push_back({start, len});
+		start += len;
+	}
+	return chunks;
+}
+
+AssetStore::AssetStore(const std::string &absRootPath) : m_rootPath {absRootPath}
+{
+	if(!m_rootPath.empty() && m_rootPath.back() != '/' && m_rootPath.back() != '\\')
+		m_rootPath += '/';
+}
+
+std::string AssetStore::GetBlobPath(const Hash &hash) const
+{
+	auto str = hash.ToString();
+	return m_rootPath + str.substr(0, 2) + '/' + str + ".blob";
+}
+
+bool AssetStore::HasBlob(const Hash &hash) const
+{
+	std::error_code ec;
+	return std::filesystem::exists(GetBlobPath(hash), ec);
+}
+
+bool AssetStore::PutBlob(const Hash &hash, const void *data, size_t size) const
+{
+	if(HasBlob(hash))
+		return true;
+	auto blob = udm::compress_lz4_blob(data, size);
+	// If the same blob is written concurrently, each writer uses its own temporary file and both produce identical files,
+	// so it doesn't matter which rename wins. If ours failed because of the other writer, the blob exists anyway.
+	auto writer = StreamingFileWriter::Open(GetBlobPath(hash));
+	if(writer == nullptr)
+		return HasBlob(hash);
+	writer->Write(blob.compressedData.data(), blob.compressedData.size());
+	return writer->Close() || HasBlob(hash);
+}
+
+bool AssetStore::ReadBlob(const Hash &hash, void *outData, size_t size) const
+{
+	std::ifstream f {GetBlobPath(hash), std::ios::binary | std::ios::ate};
+	if(!f)
+		return false;
+	std::vector<uint8_t> compressedData(static_cast<size_t>(f.tellg()));
+	f.seekg(0, std::ios::beg);
+	if(!f.read(reinterpret_cast<char *>(compressedData.data()), compressedData.size()))
+		return false;
+	return udm::decompress_lz4_blob(compressedData.data(), compressedData.size(), size, outData);
+}
+
+std::optional<uint32_t> AssetStore::RemoveUnreferencedBlobs(const std::vector<Hash> &referencedBlobs, std::chrono::seconds minAge, std::string &outErr) const
+{
+	std::unordered_set<std::string> referenced;
+	referenced.reserve(referencedBlobs.size());
+	for(auto &hash : referencedBlobs)
+		referenced.insert(hash.ToString());
+	std::error_code ec;
+	if(!std::filesystem::exists(m_rootPath, ec))
+		return 0u;
+	auto now = std::filesystem::file_time_type::clock::now();
+	uint32_t numRemoved = 0;
+	for(auto it = std::filesystem::recursive_directory_iterator {m_rootPath, ec}; !ec && it != std::filesystem::recursive_directory_iterator {}; it.increment(ec)) {
+		if(!it->is_regular_file(ec))
+			continue;
+		auto &path = it->path();
+		auto ext = path.extension().string();
+		// Leftover temporary files of writers that didn't finish are removed as well
+		auto isBlob = (ext == ".blob");
+		if((isBlob == false && ext != ".tmp") || (isBlob && referenced.contains(path.stem().string())))
+			continue;
+		// Blobs may have been written for a render job file that hasn't been completed yet, so recent files are kept
+		auto writeTime = std::filesystem::last_write_time(path, ec);
+		if(ec || now - writeTime < minAge) {
+			ec.clear();
+			continue;
+		}
+		if(std::filesystem::remove(path, ec) && isBlob)
+			++numRemoved;
+		ec.clear();
+	}
+	if(ec) {
+		outErr = "Unable to iterate asset store '" + m_rootPath + "': " + ec.message();
+		return {};
+	}
+	return numRemoved;
+}
+
+std::optional<std::vector<AssetStore::ChunkRef>> AssetStore::Put(const void *data, size_t size) const
+{
+	auto *bytes = static_cast<const uint8_t *>(data);
+	auto chunks = SplitIntoChunks(data, size);
+	std::vector<ChunkRef> refs;
+	refs.reserve(chunks.size());
+	for(auto &[offset, len] : chunks) {
+		ChunkRef ref {};
+		ref.hash = CalcHash(bytes + offset, len);
+		ref.size = static_cast<uint32_t>(len);
+		if(!PutBlob(ref.hash, bytes + offset, len))
+			return {};
+		refs.push_back(ref);
+	}
+	return refs;
+}
+
+std::optional<std::vector<uint8_t>> AssetStore::Get(const std::vector<ChunkRef> &chunks, std::string &outErr) const
+{
+	size_t size = 0;
+	for(auto &chunk : chunks)
+		size += chunk.size;
+	std::vector<uint8_t> data(size);
+	size_t offset = 0;
+	for(auto &chunk : chunks) {
+		if(!ReadBlob(chunk.hash, data.data() + offset, chunk.size)) {
+			outErr = "Missing or unreadable asset store blob '" + GetBlobPath(chunk.hash) + "'";
+			return {};
+		}
+		if(CalcHash(data.data() + offset, chunk.size) != chunk.hash) {
+			outErr = "Asset store blob '" + GetBlobPath(chunk.hash) + "' is corrupt";
+			return {};
+		}
+		offset += chunk.size;
+	}
+	return data;
+}
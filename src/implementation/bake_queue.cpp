@@ -0,0 +1,323 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <pragma/c_engine.h>
+#include <pragma/game/c_game.h>
+#include <pragma/model/model.h>
+#include <pragma/entities/baseentity_handle.h>
+#include <pragma/entities/baseentity.h>
+#include <sharedutils/util_file.h>
+#include <sharedutils/util_path.hpp>
+#include <sharedutils/util_string.h>
+#include <sharedutils/util_parallel_job.hpp>
+#include <util_image_buffer.hpp>
+#include <util_image.hpp>
+#include <sharedutils/util_ifile.hpp>
+#include <future>
+#include <fstream>
+#include <chrono>
+#include <deque>
+
+module pragma.modules.scenekit;
+
+import pragma.scenekit;
+import :scene;
+import :bake_queue;
+
+extern DLLCLIENT CEngine *c_engine;
+extern DLLCLIENT CGame *c_game;
+
+using namespace pragma::modules::scenekit;
+
+// Resolves the absolute output path and creates its directory. Uses the file manager, so it has to be called on the main thread.
+static std::string prepare_ao_output_path(std::string path)
+{
+	ufile::remove_extension_from_filename(path);
+	path += ".png";
+	FileManager::CreatePath(ufile::get_path_from_filename(path).c_str());
+	auto absPath = util::Path::CreatePath(FileManager::GetProgramPath()).GetString() + path;
+	ustring::replace(absPath, "\\", "/");
+	return absPath;
+}
+
+// Only uses the absolute path, so it can be called from any thread
+static bool write_ao_image(const std::string &absPath, const std::shared_ptr<uimg::ImageBuffer> &img)
+{
+	if(img == nullptr)
+		return false;
+	auto imgBuf = (img->GetFormat() == uimg::Format::RGBA8) ? img : img->Copy(uimg::Format::RGBA8);
+	ufile::VectorFile f {};
+	if(uimg::save_image(f, *imgBuf, uimg::ImageFormat::PNG) == false)
+		return false;
+	std::ofstream out {absPath, std::ios::binary | std::ios::trunc};
+	if(out.is_open() == false)
+		return false;
+	auto &data = f.GetVector();
+	out.write(reinterpret_cast<const char *>(data.data()), data.size());
+	return out.good();
+}
+
+AOBakeQueue::AOBakeQueue(const SceneFactory &sceneFactory, uint32_t maxConcurrentBatches) : m_sceneFactory {sceneFactory}
+{
+	// The renderer already uses all cores for a single bake, concurrent batches would only compete for them
+	if(maxConcurrentBatches == 0)
+		maxConcurrentBatches = 1;
+	m_maxConcurrentBatches = maxConcurrentBatches;
+	m_cbThink = c_engine->AddCallback("Think", FunctionCallback<void>::Create([this]() { Update(); }));
+}
+
+AOBakeQueue::~AOBakeQueue()
+{
+	if(m_cbThink.IsValid())
+		m_cbThink.Remove();
+	for(auto &batch : m_batches) {
+		if(batch->bakeJob.IsValid()) {
+			batch->bakeJob.Cancel();
+			batch->bakeJob.Wait();
+		}
+		if(batch->writeResult.valid())
+			batch->writeResult.wait();
+	}
+}
+
+AOBakeQueue::JobId AOBakeQueue::AddJob(const JobInfo &jobInfo)
+{
+	auto jobId = m_nextJobId++;
+	m_jobs[jobId] = {jobInfo};
+	m_pendingJobs.push_back(jobId);
+	return jobId;
+}
+
+AOBakeQueue::Job *AOBakeQueue::FindJob(JobId jobId)
+{
+	auto it = m_jobs.find(jobId);
+	return (it != m_jobs.end()) ? &it->second : nullptr;
+}
+const AOBakeQueue::Job *AOBakeQueue::FindJob(JobId jobId) const { return const_cast<AOBakeQueue *>(this)->FindJob(jobId); }
+
+void AOBakeQueue::SetJobState(Job &job, JobState state)
+{
+	job.state = state;
+	switch(state) {
+	case JobState::Complete:
+		job.progress = 1.f;
+		++m_numCompleted;
+		break;
+	case JobState::Failed:
+		++m_numFailed;
+		break;
+	}
+}
+
+void AOBakeQueue::Cancel(JobId jobId)
+{
+	auto *job = FindJob(jobId);
+	if(job == nullptr || (job->state != JobState::Pending && job->state != JobState::Baking))
+		return;
+	if(job->state == JobState::Pending) {
+		auto it = std::find(m_pendingJobs.begin(), m_pendingJobs.end(), jobId);
+		if(it != m_pendingJobs.end())
+			m_pendingJobs.erase(it);
+	}
+	SetJobState(*job, JobState::Cancelled);
+
+	// The bake itself can only be cancelled if no other job of the batch still needs it
+	for(auto &batch : m_batches) {
+		if(std::find(batch->jobs.begin(), batch->jobs.end(), jobId) == batch->jobs.end())
+			continue;
+		auto allCancelled = std::all_of(batch->jobs.begin(), batch->jobs.end(), [this](JobId id) { return FindJob(id)->state == JobState::Cancelled; });
+		if(allCancelled && batch->bakeJob.IsValid())
+			batch->bakeJob.Cancel();
+		break;
+	}
+}
+
+void AOBakeQueue::CancelAll()
+{
+	std::vector<JobId> jobIds;
+	jobIds.reserve(m_jobs.size());
+	for(auto &[jobId, job] : m_jobs)
+		jobIds.push_back(jobId);
+	for(auto jobId : jobIds)
+		Cancel(jobId);
+}
+
+bool AOBakeQueue::StartNextBatch()
+{
+	if(m_pendingJobs.empty())
+		return false;
+	auto &first = FindJob(m_pendingJobs.front())->info;
+	auto mdl = first.model;
+	if(mdl == nullptr)
+		mdl = c_game->LoadModel(first.modelName);
+
+	// Merge all pending jobs for the same model and the same bake settings into one batch
+	auto batch = std::make_unique<Batch>();
+	auto isSameBatch = [&first](const JobInfo &other) {
+		auto sameModel = first.model ? (first.model == other.model) : (other.model == nullptr && first.modelName == other.modelName);
+		return sameModel && first.width == other.width && first.height == other.height && first.samples == other.samples && first.deviceType == other.deviceType && first.denoise == other.denoise;
+	};
+	for(auto it = m_pendingJobs.begin(); it != m_pendingJobs.end();) {
+		auto &job = *FindJob(*it);
+		if(isSameBatch(job.info) == false) {
+			++it;
+			continue;
+		}
+		batch->jobs.push_back(*it);
+		it = m_pendingJobs.erase(it);
+	}
+
+	if(mdl == nullptr) {
+		Con::cwar << "Unable to bake ambient occlusion for model '" << first.modelName << "': Model could not be loaded!" << Con::endl;
+		for(auto jobId : batch->jobs)
+			SetJobState(*FindJob(jobId), JobState::Failed);
+		return true;
+	}
+
+	std::vector<AOBakeTarget> targets;
+	targets.reserve(batch->jobs.size());
+	for(auto jobId : batch->jobs)
+		targets.push_back({mdl, {}, FindJob(jobId)->info.materialIndex});
+	// The scenes are created on the bake thread, so the factory and job info are captured by value
+	batch->bakeJob = bake_ambient_occlusion(targets, [sceneFactory = m_sceneFactory, info = first]() { return sceneFactory(info); });
+	if(batch->bakeJob.IsValid() == false) {
+		for(auto jobId : batch->jobs)
+			SetJobState(*FindJob(jobId), JobState::Failed);
+		return true;
+	}
+	for(auto jobId : batch->jobs)
+		SetJobState(*FindJob(jobId), JobState::Baking);
+	batch->bakeJob.Start();
+	m_batches.push_back(std::move(batch));
+	return true;
+}
+
+void AOBakeQueue::FinalizeBake(Batch &batch)
+{
+	if(batch.bakeJob.IsSuccessful() == false) {
+		for(auto jobId : batch.jobs) {
+			auto &job = *FindJob(jobId);
+			if(job.state == JobState::Baking)
+				SetJobState(job, JobState::Failed);
+		}
+		batch.bakeJob = {};
+		return;
+	}
+	auto result = batch.bakeJob.GetResult();
+	batch.bakeJob = {};
+
+	std::vector<std::pair<std::string, std::shared_ptr<uimg::ImageBuffer>>> outputs;
+	outputs.reserve(batch.jobs.size());
+	for(auto i = decltype(batch.jobs.size()) {0u}; i < batch.jobs.size(); ++i) {
+		auto &job = *FindJob(batch.jobs[i]);
+		if(job.state != JobState::Baking) {
+			outputs.push_back({});
+			continue;
+		}
+		auto it = result.images.find(get_ao_bake_batch_layer_name(i));
+		outputs.push_back({prepare_ao_output_path(job.info.outputPath), (it != result.images.end()) ? it->second : nullptr});
+		job.state = JobState::Writing;
+	}
+	// Image encoding is slow, so it's moved off the main thread. The paths have already been resolved above.
+	batch.writeResult = std::async(std::launch::async, [outputs = std::move(outputs)]() {
+		std::vector<bool> results;
+		results.reserve(outputs.size());
+		for(auto &[path, img] : outputs)
+			results.push_back(img && write_ao_image(path, img));
+		return results;
+	});
+}
+
+void AOBakeQueue::FinalizeWrite(Batch &batch)
+{
+	auto results = batch.writeResult.get();
+	auto anyComplete = false;
+	for(auto i = decltype(batch.jobs.size()) {0u}; i < batch.jobs.size(); ++i) {
+		auto &job = *FindJob(batch.jobs[i]);
+		if(job.state != JobState::Writing)
+			continue;
+		auto success = (i < results.size() && results[i]);
+		if(success == false)
+			Con::cwar << "Unable to write ambient occlusion image '" << job.info.outputPath << "'!" << Con::endl;
+		SetJobState(job, success ? JobState::Complete : JobState::Failed);
+		anyComplete = anyComplete || success;
+	}
+	// All jobs of a batch belong to the same model
+	if(anyComplete)
+		++m_numCompletedModels;
+}
+
+void AOBakeQueue::Update()
+{
+	auto t = std::chrono::steady_clock::now();
+	if(m_lastUpdateTime.has_value() && m_batches.empty() == false)
+		m_activeTime += t - *m_lastUpdateTime;
+	m_lastUpdateTime = t;
+
+	for(auto it = m_batches.begin(); it != m_batches.end();) {
+		auto &batch = **it;
+		if(batch.writeResult.valid()) {
+			if(batch.writeResult.wait_for(std::chrono::seconds {0}) != std::future_status::ready) {
+				++it;
+				continue;
+			}
+			FinalizeWrite(batch);
+			it = m_batches.erase(it);
+			continue;
+		}
+		if(batch.bakeJob.IsComplete() == false) {
+			auto progress = batch.bakeJob.GetProgress();
+			for(auto jobId : batch.jobs) {
+				auto &job = *FindJob(jobId);
+				if(job.state == JobState::Baking)
+					job.progress = progress;
+			}
+			++it;
+			continue;
+		}
+		FinalizeBake(batch);
+		if(batch.writeResult.valid() == false) {
+			it = m_batches.erase(it);
+			continue;
+		}
+		++it;
+	}
+	while(m_batches.size() < m_maxConcurrentBatches && StartNextBatch())
+		;
+}
+
+AOBakeQueue::JobState AOBakeQueue::GetJobState(JobId jobId) const
+{
+	auto *job = FindJob(jobId);
+	return job ? job->state : JobState::Failed;
+}
+float AOBakeQueue::GetJobProgress(JobId jobId) const
+{
+	auto *job = FindJob(jobId);
+	return job ? job->progress : 0.f;
+}
+uint32_t AOBakeQueue::GetPendingJobCount() const { return m_pendingJobs.size(); }
+uint32_t AOBakeQueue::GetActiveJobCount() const
+{
+	uint32_t count = 0;
+	for(auto &batch : m_batches)
+		count += batch->jobs.size();
+	return count;
+}
+uint32_t AOBakeQueue::GetCompletedJobCount() const { return m_numCompleted; }
+uint32_t AOBakeQueue::GetFailedJobCount() const { return m_numFailed; }
+bool AOBakeQueue::IsComplete() const { return m_pendingJobs.empty() && m_batches.empty(); }
+float AOBakeQueue::GetThroughput() const
+{
+	auto t = std::chrono::duration_cast<std::chrono::duration<float, std::ratio<60>>>(m_activeTime).count();
+	return (t > 0.f) ? (m_numCompletedModels / t) : 0.f;
+}
+
+void AOBakeQueue::SetMaxConcurrentBatches(uint32_t maxConcurrentBatches) { m_maxConcurrentBatches = umath::max(maxConcurrentBatches, 1u); }
+uint32_t AOBakeQueue::GetMaxConcurrentBatches() const { return m_maxConcurrentBatches; }
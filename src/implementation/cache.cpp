@@ -43,214 +43,12 @@ import pragma.scenekit;
 
 import :scene;
 import :subdivision;
+import :texture;
 
 extern DLLCLIENT CEngine *c_engine;
 extern DLLCLIENT ClientState *client;
 extern DLLCLIENT CGame *c_game;
 
-enum class PreparedTextureInputFlags : uint8_t { None = 0u, CanBeEnvMap = 1u };
-REGISTER_BASIC_BITWISE_OPERATORS(PreparedTextureInputFlags)
-enum class PreparedTextureOutputFlags : uint8_t { None = 0u, Envmap = 1u };
-REGISTER_BASIC_BITWISE_OPERATORS(PreparedTextureOutputFlags)
-
-static std::optional<std::string> get_abs_error_texture_path()
-{
-	std::string errTexPath = "materials\\error.dds";
-	std::string absPath;
-	if(FileManager::FindAbsolutePath(errTexPath, absPath) == false)
-		return absPath;
-	return {};
-}
-
-static std::optional<std::string> prepare_texture(TextureInfo *texInfo, bool &outSuccess, bool &outConverted, PreparedTextureInputFlags inFlags, PreparedTextureOutputFlags *optOutFlags = nullptr, const std::optional<std::string> &defaultTexture = {})
-{
-	if(optOutFlags)
-		*optOutFlags = PreparedTextureOutputFlags::None;
-
-	outSuccess = false;
-	outConverted = false;
-	if(texInfo == nullptr)
-		return {};
-	auto tex = texInfo ? std::static_pointer_cast<Texture>(texInfo->texture) : nullptr;
-	std::string texName {};
-	// Make sure texture has been fully loaded!
-	if(tex == nullptr || tex->IsLoaded() == false) {
-		tex = nullptr;
-		if(defaultTexture.has_value()) {
-			auto &texManager = static_cast<msys::CMaterialManager &>(client->GetMaterialManager()).GetTextureManager();
-			auto ptrTex = texManager.LoadAsset(*defaultTexture);
-			if(ptrTex != nullptr) {
-				texName = *defaultTexture;
-				tex = ptrTex;
-				if(tex->IsLoaded() == false)
-					tex = nullptr;
-			}
-		}
-	}
-	else
-		texName = texInfo->name;
-	if(tex == nullptr || tex->IsError() || tex->HasValidVkTexture() == false)
-		return get_abs_error_texture_path();
-
-	/*if(tex->IsLoaded() == false)
-	{
-	TextureManager::LoadInfo loadInfo {};
-	loadInfo.flags = TextureLoadFlags::LoadInstantly;
-	static_cast<CMaterialManager&>(client->GetMaterialManager()).GetTextureManager().Load(*c_engine,texInfo->name,loadInfo);
-	if(tex->IsLoaded() == false)
-	return get_abs_error_texture_path();
-	}
-	*/
-	ufile::remove_extension_from_filename(texName); // DDS-writer will add the extension for us
-
-	auto vkTex = tex->GetVkTexture();
-	auto *img = &vkTex->GetImage();
-	auto isCubemap = img->IsCubemap();
-	if(isCubemap) {
-		if(umath::is_flag_set(inFlags, PreparedTextureInputFlags::CanBeEnvMap) == false)
-			return {};
-		// Image is a cubemap, which Cycles doesn't support! We'll have to convert it to a equirectangular image and use that instead.
-		auto &shader = static_cast<pragma::ShaderCubemapToEquirectangular &>(*c_engine->GetShader("cubemap_to_equirectangular"));
-		auto equiRectMap = shader.CubemapToEquirectangularTexture(*vkTex);
-		vkTex = equiRectMap;
-		img = &vkTex->GetImage();
-		texName += "_equirect";
-
-		if(optOutFlags)
-			*optOutFlags |= PreparedTextureOutputFlags::Envmap;
-	}
-
-	auto texPath = "materials\\" + texName;
-	texPath += ".dds";
-	// Check if DDS version of the texture already exists, in which case we can just use it directly!
-	std::string absPath;
-	if(FileManager::FindAbsolutePath(texPath, absPath)) {
-		outSuccess = true;
-		return absPath;
-	}
-
-	// Texture does not have the right format to begin with or does not exist on the local hard drive.
-	// We will have to create the texture file in the right format (if the texture object is valid).
-	if(tex == nullptr)
-		return get_abs_error_texture_path(); // Texture is not valid! Return error texture.
-
-	// Output path for the DDS-file we're about to create
-	auto ddsPath = "addons/converted/materials/" + texName;
-	uimg::TextureInfo imgWriteInfo {};
-	imgWriteInfo.containerFormat = uimg::TextureInfo::ContainerFormat::DDS; // Cycles doesn't support KTX
-	if(tex->HasFlag(Texture::Flags::SRGB))
-		imgWriteInfo.flags |= uimg::TextureInfo::Flags::SRGB;
-
-	// Try to determine appropriate formats
-	if(tex->HasFlag(Texture::Flags::NormalMap)) {
-		imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R32G32B32A32_Float;
-		imgWriteInfo.SetNormalMap();
-	}
-	else {
-		auto format = img->GetFormat();
-		if(prosper::util::is_16bit_format(format)) {
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R16G16B16A16_Float;
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::HDRColorMap;
-		}
-		else if(prosper::util::is_32bit_format(format) || prosper::util::is_64bit_format(format)) {
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R32G32B32A32_Float;
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::HDRColorMap;
-		}
-		else {
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R8G8B8A8_UInt;
-			// TODO: Check the alpha channel values to determine whether we actually need a full alpha channel?
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::ColorMapSmoothAlpha;
-		}
-		switch(format) {
-		case prosper::Format::BC1_RGBA_SRGB_Block:
-		case prosper::Format::BC1_RGBA_UNorm_Block:
-		case prosper::Format::BC1_RGB_SRGB_Block:
-		case prosper::Format::BC1_RGB_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC1;
-			break;
-		case prosper::Format::BC2_SRGB_Block:
-		case prosper::Format::BC2_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC2;
-			break;
-		case prosper::Format::BC3_SRGB_Block:
-		case prosper::Format::BC3_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC3;
-			break;
-		case prosper::Format::BC4_SNorm_Block:
-		case prosper::Format::BC4_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC4;
-			break;
-		case prosper::Format::BC5_SNorm_Block:
-		case prosper::Format::BC5_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC5;
-			break;
-		case prosper::Format::BC6H_SFloat_Block:
-		case prosper::Format::BC6H_UFloat_Block:
-			// TODO: As of 20-03-26, Cycles (/oiio) does not have support for BC6, so we'll
-			// fall back to a different format
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R16G16B16A16_Float;
-			// imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC6;
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::DXT5;
-			break;
-		case prosper::Format::BC7_SRGB_Block:
-		case prosper::Format::BC7_UNorm_Block:
-			// TODO: As of 20-03-26, Cycles (/oiio) does not have support for BC7, so we'll
-			// fall back to a different format
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R16G16B16A16_Float;
-			// imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC7;
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::DXT1;
-			break;
-		}
-	}
-	absPath = "";
-	// Save the DDS image and make sure the file exists
-	if(c_game->SaveImage(*img, ddsPath, imgWriteInfo) && FileManager::FindAbsolutePath(ddsPath + ".dds", absPath)) {
-		outSuccess = true;
-		outConverted = true;
-		return absPath;
-	}
-	// Something went wrong, fall back to error texture!
-	return get_abs_error_texture_path();
-}
-
-static std::optional<std::string> prepare_texture(TextureInfo *texInfo, PreparedTextureInputFlags inFlags, PreparedTextureOutputFlags *optOutFlags = nullptr, const std::optional<std::string> &defaultTexture = {})
-{
-	if(optOutFlags)
-		*optOutFlags = PreparedTextureOutputFlags::None;
-	if(texInfo == nullptr)
-		return {};
-	auto success = false;
-	auto converted = false;
-	auto result = prepare_texture(texInfo, success, converted, inFlags, optOutFlags, defaultTexture);
-	if(success == false) {
-		Con::cwar << "WARNING: Unable to prepare texture '";
-		if(texInfo)
-			Con::cwar << texInfo->name;
-		else
-			Con::cwar << "Unknown";
-		Con::cwar << "'! Using error texture instead..." << Con::endl;
-	}
-	else {
-		if(converted)
-			Con::cout << "Converted texture '" << texInfo->name << "' to DDS!" << Con::endl;
-#if 0
-		ccl::ImageMetaData metaData;
-		if(scene.image_manager->get_image_metadata(*result,nullptr,ccl::u_colorspace_raw,metaData) == false)
-		{
-			Con::cwar<<"WARNING: Texture '"<<texInfo->name<<"' has format which is incompatible with cycles! Falling back to error texture..."<<Con::endl;
-			result = get_abs_error_texture_path();
-			if(scene.image_manager->get_image_metadata(*result,nullptr,ccl::u_colorspace_raw,metaData) == false)
-			{
-				Con::cwar<<"WARNING: Error texture also not compatible! Falling back to untextured!"<<Con::endl;
-				result = {};
-			}
-		}
-#endif
-	}
-
-	return result;
-}
-
 pragma::modules::scenekit::Cache::Cache(pragma::scenekit::Scene::RenderMode renderMode) : m_renderMode {renderMode}
 {
 	m_shaderCache = pragma::scenekit::ShaderCache::Create();
@@ -367,9 +165,11 @@ std::vector<std::shared_ptr<pragma::modules::scenekit::Cache::MeshData>> pragma:
 				auto vkTex = tex ? std::static_pointer_cast<Texture>(tex)->GetVkTexture() : nullptr;
 				if(vkTex == nullptr || vkTex->GetImage().IsCubemap() == false)
 					continue;
-				PreparedTextureOutputFlags flags;
-				auto diffuseTexPath = prepare_texture(diffuseMap, PreparedTextureInputFlags::CanBeEnvMap, &flags);
-				if(diffuseTexPath.has_value() == false || umath::is_flag_set(flags, PreparedTextureOutputFlags::Envmap) == false)
+				// The texture is a cubemap, so it will be converted to an equirectangular environment map.
+				// The resolution of the conversion is limited by the max texture dimension of the scene.
+				MaxTextureDimensionScope maxTexDimensionScope {m_maxTextureDimension};
+				auto diffuseTexPath = prepare_texture(diffuseMap->name);
+				if(diffuseTexPath.has_value() == false)
 					continue;
 				skyboxTexture = diffuseTexPath;
 			}
@@ -727,6 +527,41 @@ void pragma::modules::scenekit::Cache::AddAOBakeTarget(BaseEntity *optEnt, Model
 	m_mdlCache->GetChunks().front().AddObject(*oEnv);
 }
 
+std::vector<pragma::modules::scenekit::Cache::AOBakeSubMesh> pragma::modules::scenekit::Cache::PrepareAOBakeMeshes(BaseEntity *optEnt, Model &mdl)
+{
+	// Same as AddAOBakeTarget, but the shaders of every sub-mesh are only created once, so that all materials of the model can be baked
+	// from the same geometry. The geometry itself is built later by BuildAOBakeMeshes.
+	std::vector<AOBakeSubMesh> subMeshes;
+	auto fFilterMeshes = [this, &subMeshes, &mdl](ModelSubMesh &mesh, const umath::ScaledTransform &pose) -> bool {
+		auto texIdx = mdl.GetMaterialIndex(mesh);
+		subMeshes.push_back({&mesh, CreateShader(GetUniqueName(), mdl, mesh), texIdx.has_value() ? *texIdx : std::numeric_limits<uint32_t>::max()});
+		return false;
+	};
+	if(optEnt)
+		AddEntityMesh(*optEnt, nullptr, nullptr, fFilterMeshes);
+	else
+		AddModel(mdl, "ao_mesh", nullptr, {}, 0 /* skin */, nullptr, nullptr, nullptr, fFilterMeshes);
+	return subMeshes;
+}
+
+std::unordered_map<uint32_t, pragma::modules::scenekit::Cache::AOBakeMesh> pragma::modules::scenekit::Cache::BuildAOBakeMeshes(Model &mdl, const std::vector<AOBakeSubMesh> &subMeshes)
+{
+	std::unordered_map<uint32_t, std::vector<std::shared_ptr<MeshData>>> materialMeshes;
+	for(auto &subMesh : subMeshes) {
+		auto meshData = CalcMeshData(mdl, *subMesh.subMesh, false, false);
+		meshData->shader = subMesh.shader;
+		materialMeshes[subMesh.materialIndex].push_back(meshData);
+	}
+
+	std::unordered_map<uint32_t, AOBakeMesh> meshes;
+	meshes.reserve(materialMeshes.size());
+	for(auto &[matIdx, meshDatas] : materialMeshes) {
+		auto &aoMesh = meshes[matIdx];
+		aoMesh.mesh = BuildMesh("ao_mesh_" + std::to_string(matIdx), meshDatas);
+	}
+	return meshes;
+}
+
 void pragma::modules::scenekit::Cache::AddAOBakeTarget(BaseEntity &ent, uint32_t matIndex, std::shared_ptr<pragma::scenekit::Object> &oAo, std::shared_ptr<pragma::scenekit::Object> &oEnv)
 {
 	auto mdl = ent.GetModel();
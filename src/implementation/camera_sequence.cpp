@@ -0,0 +1,235 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <pragma/c_engine.h>
+#include <sharedutils/util_parallel_job.hpp>
+#include <sharedutils/util_path.hpp>
+#include <sharedutils/util_file.h>
+#include <sharedutils/util_uuid.hpp>
+#include <util_image_buffer.hpp>
+#include <filesystem>
+#include <future>
+#include <deque>
+#include <array>
+#include <cstdio>
+
+module pragma.modules.scenekit;
+
+import pragma.scenekit;
+import :scene;
+import :split_render;
+import :camera_sequence;
+
+extern DLLCLIENT CEngine *c_engine;
+
+using namespace pragma::modules::scenekit;
+
+// Used if the camera of the scene wasn't created from an entity and doesn't have a uuid, which is required to find it again through the live editing interface
+static constexpr util::Uuid CAMERA_SEQUENCE_CAMERA_UUID {0x9c3e'5a71'4f0b'4d2e, 0xa1b6'07d4'e38c'52f9};
+
+static void apply_camera_frame(pragma::scenekit::Camera &cam, const CameraSequenceRenderer::Frame &frame)
+{
+	cam.SetPos(frame.position);
+	cam.SetRotation(frame.rotation);
+	if(frame.fov.has_value())
+		cam.SetFOV(*frame.fov);
+}
+
+std::shared_ptr<CameraSequenceRenderer> CameraSequenceRenderer::Create(Scene &scene, const std::string &rendererIdentifier, std::vector<Frame> frames, std::string &outErr)
+{
+	if(scene.IsFinalized() == false) {
+		outErr = "Scene has not been finalized";
+		return nullptr;
+	}
+	if(frames.empty()) {
+		outErr = "No frames specified";
+		return nullptr;
+	}
+	auto &cam = (*scene).GetCamera();
+	if(cam.GetUuid() == util::Uuid {})
+		cam.SetUuid(CAMERA_SEQUENCE_CAMERA_UUID);
+	// The first frame is applied directly, so the initial device update already uses the right camera
+	apply_camera_frame(cam, frames.front());
+
+	// Live editing is required to update the camera without rebuilding the scene
+	auto rtRenderer = pragma::scenekit::Renderer::Create(*scene, rendererIdentifier, outErr, pragma::scenekit::Renderer::Flags::EnableLiveEditing);
+	if(rtRenderer == nullptr)
+		return nullptr;
+	auto renderer = std::shared_ptr<CameraSequenceRenderer> {new CameraSequenceRenderer {}};
+	renderer->m_renderer = std::make_shared<Renderer>(scene, *rtRenderer);
+	renderer->m_cameraUuid = cam.GetUuid();
+	renderer->m_frames = std::move(frames);
+	return renderer;
+}
+
+CameraSequenceRenderer::~CameraSequenceRenderer()
+{
+	if(m_cbThink.IsValid())
+		m_cbThink.Remove();
+	if(m_job.IsValid()) {
+		m_job.Cancel();
+		m_job.Wait();
+	}
+	for(auto &output : m_pendingOutputs)
+		output.wait();
+}
+
+void CameraSequenceRenderer::SetOutputPath(const std::string &outputPath) { m_outputPath = outputPath; }
+void CameraSequenceRenderer::SetFrameCallback(const FrameCallback &callback) { m_frameCallback = callback; }
+
+uint32_t CameraSequenceRenderer::GetFrameCount() const { return m_frames.size(); }
+
+bool CameraSequenceRenderer::IsComplete() const { return m_state != State::Pending && m_state != State::Rendering && m_pendingOutputs.empty(); }
+
+float CameraSequenceRenderer::GetProgress() const
+{
+	if(m_frames.empty())
+		return 1.f;
+	auto progress = static_cast<float>(m_numCompleted);
+	if(m_job.IsValid())
+		progress += m_job.GetProgress();
+	return progress / static_cast<float>(m_frames.size());
+}
+
+void CameraSequenceRenderer::SetFailed(const std::string &err)
+{
+	if(m_state == State::Failed)
+		return;
+	Con::cwar << "Camera sequence render failed: " << err << Con::endl;
+	m_errorMessage = err;
+	m_state = State::Failed;
+	if(m_job.IsValid()) {
+		m_job.Cancel();
+		m_job.Wait();
+		m_job = {};
+	}
+}
+
+bool CameraSequenceRenderer::Start()
+{
+	if(m_state != State::Pending)
+		return false;
+	if(StartFrame(0) == false) {
+		SetFailed("Unable to start render for frame 0");
+		return false;
+	}
+	m_state = State::Rendering;
+	m_cbThink = c_engine->AddCallback("Think", FunctionCallback<void>::Create([this]() { Update(); }));
+	return true;
+}
+
+void CameraSequenceRenderer::Cancel()
+{
+	if(m_state != State::Pending && m_state != State::Rendering)
+		return;
+	if(m_job.IsValid()) {
+		m_job.Cancel();
+		m_job.Wait();
+		m_job = {};
+	}
+	m_state = State::Cancelled;
+}
+
+bool CameraSequenceRenderer::ApplyFrame(uint32_t frameIndex)
+{
+	auto &renderer = *m_renderer;
+	if(renderer->BeginSceneEdit() == false)
+		return false;
+	auto *o = renderer->FindActor(m_cameraUuid);
+	auto success = false;
+	if(o && typeid(*o) == typeid(pragma::scenekit::Camera)) {
+		apply_camera_frame(static_cast<pragma::scenekit::Camera &>(*o), m_frames[frameIndex]);
+		success = renderer->SyncEditedActor(m_cameraUuid);
+	}
+	return renderer->EndSceneEdit() && success;
+}
+
+bool CameraSequenceRenderer::StartFrame(uint32_t frameIndex)
+{
+	// The camera of the first frame has already been applied when the renderer was created
+	if(frameIndex > 0 && ApplyFrame(frameIndex) == false)
+		return false;
+	m_currentFrame = frameIndex;
+	m_job = (*m_renderer)->StartRender();
+	if(m_job.IsValid() == false)
+		return false;
+	m_job.Start();
+	return true;
+}
+
+void CameraSequenceRenderer::FinalizeFrame()
+{
+	auto frameIndex = m_currentFrame;
+	if(m_job.IsSuccessful() == false) {
+		SetFailed("Render of frame " + std::to_string(frameIndex) + " failed");
+		return;
+	}
+	auto result = m_job.GetResult();
+	m_job = {};
+	++m_numCompleted;
+
+	// The next frame is started before the output of this frame is processed, so the renderer isn't idle in the meantime
+	if(frameIndex + 1 < m_frames.size()) {
+		if(StartFrame(frameIndex + 1) == false)
+			SetFailed("Unable to start render for frame " + std::to_string(frameIndex + 1));
+	}
+	else
+		m_state = State::Complete;
+
+	if(m_frameCallback)
+		m_frameCallback(frameIndex, result);
+	if(m_outputPath.empty())
+		return;
+	auto programPath = util::Path::CreatePath(FileManager::GetProgramPath()).GetString();
+	auto basePath = m_outputPath;
+	std::string ext;
+	if(ufile::get_extension(basePath, &ext))
+		ufile::remove_extension_from_filename(basePath);
+	else
+		ext = "png";
+	std::array<char, 16> suffix {};
+	std::snprintf(suffix.data(), suffix.size(), "_%04u.", frameIndex);
+	auto absPath = programPath + basePath + suffix.data() + ext;
+	// Image encoding is slow, so it's moved off the main thread
+	m_pendingOutputs.push_back(std::async(std::launch::async, [absPath, programPath, result = std::move(result)]() -> FrameOutput {
+		FrameOutput output {};
+		std::error_code ec;
+		std::filesystem::create_directories(std::filesystem::path {absPath}.parent_path(), ec);
+		output.success = write_image_layers(result, absPath, output.files, output.errorMessage);
+		for(auto &f : output.files) {
+			if(f.compare(0, programPath.length(), programPath) == 0)
+				f = f.substr(programPath.length());
+		}
+		return output;
+	}));
+}
+
+void CameraSequenceRenderer::FinalizeOutputs()
+{
+	while(m_pendingOutputs.empty() == false) {
+		auto &front = m_pendingOutputs.front();
+		if(front.wait_for(std::chrono::seconds {0}) != std::future_status::ready)
+			break;
+		auto output = front.get();
+		m_pendingOutputs.pop_front();
+		if(output.success == false) {
+			SetFailed(output.errorMessage);
+			continue;
+		}
+		m_outputFiles.insert(m_outputFiles.end(), output.files.begin(), output.files.end());
+	}
+}
+
+void CameraSequenceRenderer::Update()
+{
+	FinalizeOutputs();
+	if(m_state != State::Rendering || m_job.IsComplete() == false)
+		return;
+	FinalizeFrame();
+}
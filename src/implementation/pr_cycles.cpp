@@ -78,6 +78,8 @@ namespace pragma::asset {
 #include <future>
 #include <deque>
 #include <queue>
+#include <map>
+#include <optional>
 #include "interface/definitions.hpp"
 
 module pragma.modules.scenekit;
@@ -87,6 +89,10 @@ import :scene;
 import :shader;
 import :texture;
 import :progressive_refinement;
+import :bake_queue;
+import :serialization;
+import :render_queue;
+import :camera_sequence;
 
 extern DLLCLIENT CGame *c_game;
 
@@ -308,10 +314,9 @@ static void initialize_cycles_geometry(pragma::CSceneComponent &gameScene, pragm
 		cache.AddEntity(*ent, nullptr, meshFilter);
 	};
 
-	if(entityList) {
-		for(auto *ent : *entityList)
-			fAddEntity(ent);
-	}
+	std::vector<BaseEntity *> ents;
+	if(entityList)
+		ents = *entityList;
 	else {
 		// All entities
 		EntityIterator entIt {*c_game};
@@ -323,10 +328,30 @@ static void initialize_cycles_geometry(pragma::CSceneComponent &gameScene, pragm
 			auto renderMode = renderC->GetSceneRenderPass();
 			if((renderMode != pragma::rendering::SceneRenderPass::World && renderMode != pragma::rendering::SceneRenderPass::Sky) || (camData.has_value() && renderC->ShouldDraw() == false) || (entFilter && entFilter(*ent) == false))
 				continue;
-			fAddEntity(ent);
+			ents.push_back(ent);
 		}
 	}
 
+	// Request all textures up front, so that missing textures can be converted in parallel
+	// instead of one at a time whenever a shader needs one
+	{
+		pragma::modules::scenekit::MaxTextureDimensionScope maxTexDimensionScope {cache.GetMaxTextureDimension()};
+		for(auto *ent : ents) {
+			auto mdlC = ent->GetComponent<pragma::CModelComponent>();
+			if(mdlC.expired())
+				continue;
+			for(auto &hMat : mdlC->GetRenderMaterials()) {
+				auto *mat = hMat.get();
+				if(mat)
+					pragma::modules::scenekit::prefetch_material_textures(*mat);
+			}
+		}
+		pragma::modules::scenekit::flush_texture_preparation();
+	}
+
+	for(auto *ent : ents)
+		fAddEntity(ent);
+
 	// Particle Systems
 #if 0
 	EntityIterator entItPt {*c_game};
@@ -351,6 +376,93 @@ static void sync_camera(BaseEntity &ent, pragma::scenekit::Camera &cam)
 	cam.SetFarZ(pragma::units_to_metres(hCam->GetFarZ()));
 	cam.SetFOV(hCam->GetFOV());
 }
+// Updates the actor of the entity (or creates it, if it's a light source that isn't part of the scene yet), but doesn't
+// commit the change with SyncEditedActor yet.
+// Has to be called between BeginSceneEdit and EndSceneEdit.
+static bool stage_actor(pragma::scenekit::Renderer &renderer, BaseEntity &ent)
+{
+	auto uuid = ent.GetUuid();
+	auto *o = renderer.FindActor(uuid);
+	if(!o) {
+		/*
+		auto skyboxC = ent.GetComponent<pragma::CSkyboxComponent>();
+		if(skyboxC.valid()) {
+			auto &scene = renderer.GetScene();
+			scene.SetSkyStrength(skyboxC->GetStrength());
+			return true;
+		}
+		*/
+
+		auto lightC = ent.GetComponent<pragma::CLightComponent>();
+		if(lightC.expired())
+			return false;
+		auto light = pragma::scenekit::Light::Create();
+		if(!light)
+			return false;
+		sync_light(ent, *light);
+		light->SetUuid(ent.GetUuid());
+		renderer.AddLiveActor(*light);
+		o = light.get();
+	}
+	if(typeid(*o) == typeid(pragma::scenekit::Light))
+		sync_light(ent, static_cast<pragma::scenekit::Light &>(*o));
+	else if(typeid(*o) == typeid(pragma::scenekit::Camera))
+		sync_camera(ent, static_cast<pragma::scenekit::Camera &>(*o));
+	else {
+		o->SetPos(ent.GetPosition());
+		o->SetRotation(ent.GetRotation());
+	}
+	return true;
+}
+
+// Registers the callback with the change events of all components read by stage_actor
+static std::vector<CallbackHandle> watch_actor(BaseEntity &ent, const std::function<void()> &onChanged)
+{
+	std::vector<CallbackHandle> callbacks;
+	auto onEvent = [onChanged](std::reference_wrapper<pragma::ComponentEvent> evData) -> util::EventReply {
+		onChanged();
+		return util::EventReply::Unhandled;
+	};
+	auto onPropertyChanged = [onChanged](auto, auto) { onChanged(); };
+	auto *trC = ent.GetTransformComponent();
+	if(trC)
+		callbacks.push_back(trC->AddEventCallback(pragma::BaseTransformComponent::EVENT_ON_POSE_CHANGED, onEvent));
+	auto toggleC = ent.GetComponent<pragma::CToggleComponent>();
+	if(toggleC.valid()) {
+		callbacks.push_back(toggleC->AddEventCallback(pragma::BaseToggleComponent::EVENT_ON_TURN_ON, onEvent));
+		callbacks.push_back(toggleC->AddEventCallback(pragma::BaseToggleComponent::EVENT_ON_TURN_OFF, onEvent));
+	}
+	auto colorC = ent.GetComponent<pragma::CColorComponent>();
+	if(colorC.valid())
+		callbacks.push_back(colorC->AddEventCallback(pragma::BaseColorComponent::EVENT_ON_COLOR_CHANGED, onEvent));
+	auto lightC = ent.GetComponent<pragma::CLightComponent>();
+	if(lightC.valid())
+		callbacks.push_back(lightC->AddEventCallback(pragma::BaseEnvLightComponent::EVENT_ON_LIGHT_INTENSITY_CHANGED, onEvent));
+	auto hLightSpot = ent.GetComponent<pragma::CLightSpotComponent>();
+	if(hLightSpot.valid()) {
+		callbacks.push_back(hLightSpot->GetOuterConeAngleProperty()->AddCallback(onPropertyChanged));
+		callbacks.push_back(hLightSpot->GetBlendFractionProperty()->AddCallback(onPropertyChanged));
+	}
+	auto hCam = ent.GetComponent<pragma::CCameraComponent>();
+	if(hCam.valid()) {
+		callbacks.push_back(hCam->GetFOVProperty()->AddCallback(onPropertyChanged));
+		callbacks.push_back(hCam->GetNearZProperty()->AddCallback(onPropertyChanged));
+		callbacks.push_back(hCam->GetFarZProperty()->AddCallback(onPropertyChanged));
+	}
+	return callbacks;
+}
+
+static std::map<util::Uuid, BaseEntity *> get_entity_uuid_map()
+{
+	std::map<util::Uuid, BaseEntity *> ents;
+	EntityIterator entIt {*c_game};
+	for(auto *ent : entIt)
+		ents[ent->GetUuid()] = ent;
+	return ents;
+}
+
+static void init_actor_sync(pragma::modules::scenekit::Renderer &renderer) { renderer.SetActorSyncFunctions(stage_actor, watch_actor); }
+
 static void initialize_cycles_scene_from_game_scene(pragma::CSceneComponent &gameScene, pragma::modules::scenekit::Scene &scene, const Vector3 &camPos, const Quat &camRot, bool equirect, const Mat4 &vp, float nearZ, float farZ, float fov, float aspectRatio, SceneFlags sceneFlags,
   const std::function<bool(BaseEntity &)> &entFilter = nullptr, const std::function<bool(BaseEntity &)> &lightFilter = nullptr, const std::vector<BaseEntity *> *entityList = nullptr)
 {
@@ -794,6 +906,14 @@ PRAGMA_EXPORT void pr_cycles_bake_ao_ent(const pragma::rendering::cycles::SceneI
 		return;
 	outJob = renderer->StartRender();
 }
+PRAGMA_EXPORT void pr_cycles_bake_ao_batch(const pragma::rendering::cycles::SceneInfo &renderImageSettings, const std::vector<std::pair<EntityHandle, uint32_t>> &targets, util::ParallelJob<uimg::ImageLayerSet> &outJob)
+{
+	std::vector<scenekit::AOBakeTarget> aoTargets;
+	aoTargets.reserve(targets.size());
+	for(auto &[hEnt, materialIndex] : targets)
+		aoTargets.push_back({nullptr, hEnt, materialIndex});
+	outJob = scenekit::bake_ambient_occlusion(aoTargets, [renderImageSettings]() { return setup_scene(pragma::scenekit::Scene::RenderMode::BakeAmbientOcclusion, renderImageSettings); }, renderImageSettings.renderer.value_or("cycles"));
+}
 PRAGMA_EXPORT void pr_cycles_bake_lightmaps(const pragma::rendering::cycles::SceneInfo &renderImageSettings, util::ParallelJob<uimg::ImageLayerSet> &outJob)
 {
 	outJob = {};
@@ -810,18 +930,7 @@ PRAGMA_EXPORT void pr_cycles_bake_lightmaps(const pragma::rendering::cycles::Sce
 
 	if(renderImageSettings.renderJob) {
 		std::string path = "render/lightmaps/";
-		auto fileName = path + "lightmap.prt";
-		auto rootPath = util::Path::CreatePath(FileManager::GetProgramPath()).GetString() + path;
-		pragma::scenekit::Scene::SerializationData serializationData {};
-		serializationData.outputFileName = fileName;
-		DataStream ds {};
-		(*scene)->Save(ds, rootPath, serializationData);
-		FileManager::CreatePath(path.c_str());
-		auto f = FileManager::OpenFile<VFilePtrReal>(fileName.c_str(), "wb");
-		if(f) {
-			f->Write(ds->GetData(), ds->GetInternalSize());
-			f = nullptr;
-		}
+		pragma::modules::scenekit::save_render_job(**scene, path, path + "lightmap.prt");
 	}
 	else {
 		std::string err;
@@ -857,6 +966,10 @@ void PRAGMA_EXPORT pragma_terminate_lua(Lua::Interface &l)
 {
 	g_nodeManager = nullptr;
 	g_shaderManager = nullptr;
+	pragma::modules::scenekit::wait_for_render_job_writes();
+	// Workers are only started on request and keep working through the queue after the session has ended, so they are detached, not terminated
+	pragma::modules::scenekit::detach_render_queue_workers();
+	pragma::modules::scenekit::close_texture_preparation();
 	pragma::scenekit::set_logger(nullptr);
 	pragma::scenekit::set_kernel_compile_callback(nullptr);
 	g_compileCallback = Lua::nil;
@@ -932,6 +1045,60 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 		     Lua::Push(l, job);
 		     return 1;
 	     })},
+	    {"bake_ambient_occlusion_batch", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     // Each target is a table {model or entity, materialIndex}
+		     auto tTargets = luabind::table<> {luabind::from_stack(l, 1)};
+		     std::vector<scenekit::AOBakeTarget> targets;
+		     for(luabind::iterator it {tTargets}, end; it != end; ++it) {
+			     luabind::object oTarget = *it;
+			     scenekit::AOBakeTarget target {};
+			     luabind::object oMdlOrEnt = oTarget[1];
+			     auto *ent = luabind::object_cast_nothrow<BaseEntity *>(oMdlOrEnt, static_cast<BaseEntity *>(nullptr));
+			     if(ent)
+				     target.entity = ent->GetHandle();
+			     else
+				     target.model = luabind::object_cast_nothrow<std::shared_ptr<Model>>(oMdlOrEnt, std::shared_ptr<Model> {});
+			     target.materialIndex = luabind::object_cast_nothrow<uint32_t>(oTarget[2], 0u);
+			     targets.push_back(target);
+		     }
+
+		     uint32_t width = 512;
+		     uint32_t height = 512;
+		     uint32_t sampleCount = 20;
+		     auto deviceType = pragma::scenekit::Scene::DeviceType::CPU;
+		     if(Lua::IsSet(l, 2))
+			     width = Lua::CheckInt(l, 2);
+		     if(Lua::IsSet(l, 3))
+			     height = Lua::CheckInt(l, 3);
+		     if(Lua::IsSet(l, 4))
+			     sampleCount = Lua::CheckInt(l, 4);
+		     if(Lua::IsSet(l, 5))
+			     deviceType = static_cast<pragma::scenekit::Scene::DeviceType>(Lua::CheckInt(l, 5));
+		     auto job = scenekit::bake_ambient_occlusion(targets, [width, height, sampleCount, deviceType]() -> std::shared_ptr<scenekit::Scene> {
+			     return setup_scene(pragma::scenekit::Scene::RenderMode::BakeAmbientOcclusion, width, height, sampleCount, false /* hdrOutput */, pragma::scenekit::Scene::DenoiseMode::AutoDetailed, {}, deviceType);
+		     });
+		     if(job.IsValid() == false)
+			     return 0;
+		     Lua::Push(l, job);
+		     return 1;
+	     })},
+	    {"create_ao_bake_queue", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     uint32_t maxConcurrentBatches = 0;
+		     if(Lua::IsSet(l, 1))
+			     maxConcurrentBatches = Lua::CheckInt(l, 1);
+		     auto queue = std::make_shared<scenekit::AOBakeQueue>(
+		       [](const scenekit::AOBakeQueue::JobInfo &jobInfo) -> std::shared_ptr<scenekit::Scene> {
+			       return setup_scene(pragma::scenekit::Scene::RenderMode::BakeAmbientOcclusion, jobInfo.width, jobInfo.height, jobInfo.samples, false /* hdrOutput */,
+			         jobInfo.denoise ? pragma::scenekit::Scene::DenoiseMode::AutoDetailed : pragma::scenekit::Scene::DenoiseMode::None, {}, jobInfo.deviceType);
+		       },
+		       maxConcurrentBatches);
+		     Lua::Push(l, queue);
+		     return 1;
+	     })},
+	    {"get_ao_bake_batch_layer_name", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     Lua::PushString(l, scenekit::get_ao_bake_batch_layer_name(Lua::CheckInt(l, 1)));
+		     return 1;
+	     })},
 	    {"set_kernel_compile_callback",
 	      +[](lua_State *l) -> int32_t {
 		      if(!Lua::IsSet(l, 1)) {
@@ -970,6 +1137,34 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 		     Lua::Push<std::shared_ptr<pragma::modules::scenekit::Renderer>>(l, std::make_shared<pragma::modules::scenekit::Renderer>(scene, *renderer));
 		     return 1;
 	     })},
+	    {"create_camera_sequence_renderer", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     // Each frame is a table {pos = Vector3, rot = Quat, [fov = degrees]}
+		     auto &scene = Lua::Check<scenekit::Scene>(l, 1);
+		     auto tFrames = luabind::table<> {luabind::from_stack(l, 2)};
+		     std::string rendererIdentifier = "cycles";
+		     if(Lua::IsSet(l, 3))
+			     rendererIdentifier = Lua::CheckString(l, 3);
+		     std::vector<scenekit::CameraSequenceRenderer::Frame> frames;
+		     for(luabind::iterator it {tFrames}, end; it != end; ++it) {
+			     luabind::object oFrame = *it;
+			     scenekit::CameraSequenceRenderer::Frame frame {};
+			     frame.position = luabind::object_cast_nothrow<Vector3>(oFrame["pos"], Vector3 {});
+			     frame.rotation = luabind::object_cast_nothrow<Quat>(oFrame["rot"], uquat::identity());
+			     luabind::object oFov = oFrame["fov"];
+			     if(oFov)
+				     frame.fov = luabind::object_cast_nothrow<float>(oFov, 0.f);
+			     frames.push_back(frame);
+		     }
+		     std::string err;
+		     auto renderer = scenekit::CameraSequenceRenderer::Create(scene, rendererIdentifier, std::move(frames), err);
+		     if(renderer == nullptr) {
+			     Lua::PushBool(l, false);
+			     Lua::PushString(l, err);
+			     return 2;
+		     }
+		     Lua::Push(l, renderer);
+		     return 1;
+	     })},
 	    {"create_render_job", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
 		     std::string relPath = "render/lightmaps/";
 		     auto path = relPath;
@@ -978,24 +1173,186 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 		     filemanager::create_path(path);
 		     auto &scene = Lua::Check<scenekit::Scene>(l, 1);
 
+		     // If the file is written in the background, the scene can be modified again as soon as this function returns,
+		     // but the file mustn't be used until unirender.wait_for_render_job_writes has been called, which also returns
+		     // whether the write was successful. In that case the returned bool only indicates that the write was started.
+		     auto writeInBackground = false;
+		     if(Lua::IsSet(l, 2))
+			     writeInBackground = Lua::CheckBool(l, 2);
 		     auto fileName = path + "lightmap.prt";
-		     auto rootPath = util::Path::CreatePath(FileManager::GetProgramPath()).GetString() + path;
-		     pragma::scenekit::Scene::SerializationData serializationData {};
-		     serializationData.outputFileName = fileName;
-		     DataStream ds {};
-		     scene->Save(ds, rootPath, serializationData);
-		     FileManager::CreatePath(path.c_str());
-		     auto f = FileManager::OpenFile<VFilePtrReal>(fileName.c_str(), "wb");
-		     if(!f) {
+		     auto result = pragma::modules::scenekit::save_render_job(*scene, path, fileName, writeInBackground);
+		     if(writeInBackground == false && result.get() == false) {
 			     Lua::PushBool(l, false);
 			     return 1;
 		     }
-		     f->Write(ds->GetData(), ds->GetInternalSize());
-		     f = nullptr;
 		     Lua::PushBool(l, true);
 		     Lua::PushString(l, relPath + "lightmap.prt");
 		     return 2;
 	     })},
+	    {"wait_for_render_job_writes", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     Lua::PushBool(l, pragma::modules::scenekit::wait_for_render_job_writes());
+		     return 1;
+	     })},
+	    {"submit_render_job", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     auto &scene = Lua::Check<scenekit::Scene>(l, 1);
+		     pragma::modules::scenekit::RenderQueueJobInfo info {};
+		     if(Lua::IsSet(l, 2))
+			     info.name = Lua::CheckString(l, 2);
+		     if(Lua::IsSet(l, 3))
+			     info.outputFileName = Lua::CheckString(l, 3);
+		     if(Lua::IsSet(l, 4))
+			     info.renderer = Lua::CheckString(l, 4);
+		     // Region retry (see RenderQueueJobInfo::checkpointCount) is only supported for equirectangular panoramas (see submit_split_render_job).
+		     // As with split jobs, the scene should be created without denoising if it is enabled.
+		     if(Lua::IsSet(l, 5))
+			     info.checkpointCount = Lua::CheckInt(l, 5);
+		     if(Lua::IsSet(l, 6))
+			     info.denoise = Lua::CheckBool(l, 6);
+		     if(Lua::IsSet(l, 7))
+			     info.horizontalRange = Lua::CheckNumber(l, 7);
+		     auto jobId = pragma::modules::scenekit::submit_render_queue_job(*scene, info);
+		     if(jobId.has_value() == false)
+			     return 0;
+		     Lua::PushString(l, *jobId);
+		     return 1;
+	     })},
+	    {"submit_split_render_job", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     // Splits an equirectangular panorama into vertical strips, which are rendered as separate jobs and merged once all of them are complete.
+		     // The scene should be created without denoising, the merged image is denoised instead.
+		     auto &scene = Lua::Check<scenekit::Scene>(l, 1);
+		     pragma::modules::scenekit::RenderQueueJobInfo info {};
+		     info.splitCount = umath::max(static_cast<uint32_t>(Lua::CheckInt(l, 2)), 1u);
+		     if(Lua::IsSet(l, 3))
+			     info.name = Lua::CheckString(l, 3);
+		     if(Lua::IsSet(l, 4))
+			     info.outputFileName = Lua::CheckString(l, 4);
+		     if(Lua::IsSet(l, 5))
+			     info.renderer = Lua::CheckString(l, 5);
+		     if(Lua::IsSet(l, 6))
+			     info.denoise = Lua::CheckBool(l, 6);
+		     if(Lua::IsSet(l, 7))
+			     info.horizontalRange = Lua::CheckNumber(l, 7);
+		     auto jobId = pragma::modules::scenekit::submit_render_queue_job(*scene, info);
+		     if(jobId.has_value() == false)
+			     return 0;
+		     Lua::PushString(l, *jobId);
+		     return 1;
+	     })},
+	    {"get_render_job_status", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     std::string jobId = Lua::CheckString(l, 1);
+		     auto &queue = pragma::modules::scenekit::get_render_queue();
+		     auto status = queue.ReadJobStatus(jobId);
+		     if(status.has_value() == false)
+			     return 0;
+		     if(status->state == pragma::modules::scenekit::RenderQueueJobState::Rendering) {
+			     // Split jobs don't render anything themselves, their progress is the progress of their parts
+			     auto info = queue.ReadJobInfo(jobId);
+			     if(info.has_value() && info->splitCount > 0) {
+				     auto progress = 0.f;
+				     for(auto i = decltype(info->splitCount) {0u}; i < info->splitCount; ++i) {
+					     auto partStatus = queue.ReadJobStatus(queue.GetSplitPartJobId(jobId, i));
+					     if(partStatus.has_value())
+						     progress += partStatus->progress;
+				     }
+				     status->progress = progress / static_cast<float>(info->splitCount);
+			     }
+		     }
+		     // Output files are returned relative to the program directory, so they can be opened with the file library
+		     auto programPath = util::Path::CreatePath(FileManager::GetProgramPath()).GetString();
+		     auto jobPath = queue.GetJobPath(jobId).substr(programPath.size());
+		     Lua::PushInt(l, umath::to_integral(status->state));
+		     Lua::PushNumber(l, status->progress);
+		     Lua::PushString(l, status->message);
+		     auto t = luabind::newtable(l);
+		     for(auto i = decltype(status->outputFiles.size()) {0u}; i < status->outputFiles.size(); ++i)
+			     t[i + 1] = jobPath + status->outputFiles[i];
+		     t.push(l);
+		     return 4;
+	     })},
+	    {"get_render_jobs", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     auto ids = pragma::modules::scenekit::get_render_queue().GetJobIds();
+		     auto t = luabind::newtable(l);
+		     for(auto i = decltype(ids.size()) {0u}; i < ids.size(); ++i)
+			     t[i + 1] = ids[i];
+		     t.push(l);
+		     return 1;
+	     })},
+	    {"remove_render_job", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     std::string jobId = Lua::CheckString(l, 1);
+		     Lua::PushBool(l, pragma::modules::scenekit::get_render_queue().RemoveJob(jobId));
+		     return 1;
+	     })},
+	    {"resume_render_job", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     std::string jobId = Lua::CheckString(l, 1);
+		     Lua::PushBool(l, pragma::modules::scenekit::get_render_queue().ResumeJob(jobId));
+		     return 1;
+	     })},
+	    {"start_render_workers", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     uint32_t processCount = 0;
+		     if(Lua::IsSet(l, 1))
+			     processCount = Lua::CheckInt(l, 1);
+		     Lua::PushInt(l, pragma::modules::scenekit::start_render_queue_workers(processCount));
+		     return 1;
+	     })},
+	    {"stop_render_workers", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     pragma::modules::scenekit::stop_render_queue_workers();
+		     return 0;
+	     })},
+	    {"get_render_worker_count", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     Lua::PushInt(l, pragma::modules::scenekit::get_render_queue_worker_count());
+		     return 1;
+	     })},
+	    {"set_render_job_compression_enabled", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     auto settings = pragma::modules::scenekit::get_render_job_file_settings();
+		     settings.compression = Lua::CheckBool(l, 1) ? pragma::modules::scenekit::RenderJobCompression::Lz4 : pragma::modules::scenekit::RenderJobCompression::None;
+		     pragma::modules::scenekit::set_render_job_file_settings(settings);
+		     return 0;
+	     })},
+	    {"set_render_job_legacy_format_enabled", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     auto settings = pragma::modules::scenekit::get_render_job_file_settings();
+		     settings.legacyFormat = Lua::CheckBool(l, 1);
+		     pragma::modules::scenekit::set_render_job_file_settings(settings);
+		     return 0;
+	     })},
+	    {"set_render_job_asset_store_enabled", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     auto settings = pragma::modules::scenekit::get_render_job_file_settings();
+		     settings.useAssetStore = Lua::CheckBool(l, 1);
+		     pragma::modules::scenekit::set_render_job_file_settings(settings);
+		     return 0;
+	     })},
+	    {"convert_render_job", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     std::string path = Lua::CheckString(l, 1);
+		     if(Lua::file::validate_write_operation(l, path) == false) {
+			     Lua::PushBool(l, false);
+			     return 1;
+		     }
+		     auto absPath = util::Path::CreatePath(FileManager::GetProgramPath()).GetString() + path;
+		     std::string err;
+		     if(pragma::modules::scenekit::convert_legacy_render_job(absPath, err) == false) {
+			     Lua::PushBool(l, false);
+			     Lua::PushString(l, err);
+			     return 2;
+		     }
+		     Lua::PushBool(l, true);
+		     return 1;
+	     })},
+	    {"collect_render_job_garbage", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     std::string path = Lua::CheckString(l, 1);
+		     if(Lua::file::validate_write_operation(l, path) == false) {
+			     Lua::PushBool(l, false);
+			     return 1;
+		     }
+		     auto absPath = util::Path::CreatePath(FileManager::GetProgramPath()).GetString() + path;
+		     std::string err;
+		     auto numRemoved = pragma::modules::scenekit::collect_render_job_asset_store_garbage(absPath, err);
+		     if(numRemoved.has_value() == false) {
+			     Lua::PushBool(l, false);
+			     Lua::PushString(l, err);
+			     return 2;
+		     }
+		     Lua::PushInt(l, *numRemoved);
+		     return 1;
+	     })},
 	    {"unload_renderer_library", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
 		     std::string rendererIdentifier = Lua::CheckString(l, 1);
 		     auto res = pragma::scenekit::Renderer::UnloadRendererLibrary(rendererIdentifier);
@@ -1020,6 +1377,25 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 		     o.push(l);
 		     return 1;
 	     })},
+	    {"get_texture_memory_report", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     auto report = pragma::modules::scenekit::get_texture_memory_report();
+		     auto t = luabind::newtable(l);
+		     for(auto i = decltype(report.size()) {0u}; i < report.size(); ++i) {
+			     auto &info = report[i];
+			     auto tInfo = luabind::newtable(l);
+			     tInfo["name"] = info.name;
+			     tInfo["width"] = info.width;
+			     tInfo["height"] = info.height;
+			     tInfo["size"] = info.size;
+			     t[i + 1] = tInfo;
+		     }
+		     t.push(l);
+		     return 1;
+	     })},
+	    {"print_texture_memory_report", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     pragma::modules::scenekit::print_texture_memory_report();
+		     return 0;
+	     })},
 	    {"set_log_enabled", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
 		     auto enabled = Lua::CheckBool(l, 1);
 		     if(enabled)
@@ -1094,9 +1470,10 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 			  return nullptr;
 		  auto prt = std::make_shared<pragma::modules::scenekit::ProgressiveTexture>();
 		  prt->Initialize(*renderer);
+		  renderer.SetProgressiveTexture(prt);
 		  return prt;
 	  }));
-	defRenderer.def("Restart", static_cast<void (*)(lua_State *, pragma::modules::scenekit::Renderer &)>([](lua_State *l, pragma::modules::scenekit::Renderer &renderer) { renderer->Restart(); }));
+	defRenderer.def("Restart", static_cast<void (*)(lua_State *, pragma::modules::scenekit::Renderer &)>([](lua_State *l, pragma::modules::scenekit::Renderer &renderer) { renderer.Restart(); }));
 	defRenderer.def("Reset", static_cast<void (*)(lua_State *, pragma::modules::scenekit::Renderer &)>([](lua_State *l, pragma::modules::scenekit::Renderer &renderer) { renderer->Reset(); }));
 	defRenderer.def("StopRendering", static_cast<void (*)(lua_State *, pragma::modules::scenekit::Renderer &)>([](lua_State *l, pragma::modules::scenekit::Renderer &renderer) { renderer->StopRendering(); }));
 	defRenderer.def("ReloadShaders", static_cast<void (*)(lua_State *, pragma::modules::scenekit::Renderer &)>([](lua_State *l, pragma::modules::scenekit::Renderer &renderer) { renderer.ReloadShaders(); }));
@@ -1106,39 +1483,46 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 	defRenderer.def("EndSceneEdit", static_cast<bool (*)(lua_State *, pragma::modules::scenekit::Renderer &)>([](lua_State *l, pragma::modules::scenekit::Renderer &renderer) -> bool { return renderer->EndSceneEdit(); }));
 	defRenderer.def(
 	  "SyncActor", +[](lua_State *l, pragma::modules::scenekit::Renderer &renderer, BaseEntity &ent) -> bool {
-		  auto uuid = ent.GetUuid();
-		  auto *o = renderer->FindActor(uuid);
-		  if(!o) {
-			  /*
-			  auto skyboxC = ent.GetComponent<pragma::CSkyboxComponent>();
-			  if(skyboxC.valid()) {
-				  auto &scene = renderer->GetScene();
-				  scene.SetSkyStrength(skyboxC->GetStrength());
-				  return true;
+		  if(stage_actor(*renderer, ent) == false || renderer->SyncEditedActor(ent.GetUuid()) == false)
+			  return false;
+		  renderer.NotifySceneEdited();
+		  return true;
+	  });
+	defRenderer.def(
+	  "SyncActors", +[](lua_State *l, pragma::modules::scenekit::Renderer &renderer, luabind::table<> t) -> uint32_t {
+		  std::vector<BaseEntity *> ents;
+		  // Only built if the table contains uuids, and only once for all of them
+		  std::optional<std::map<util::Uuid, BaseEntity *>> uuidToEnt {};
+		  for(auto it = luabind::iterator {t}, end = luabind::iterator {}; it != end; ++it) {
+			  auto *ent = luabind::object_cast_nothrow<BaseEntity *>(*it, static_cast<BaseEntity *>(nullptr));
+			  if(!ent) {
+				  auto uuid = luabind::object_cast_nothrow<Lua::util::Uuid *>(*it, static_cast<Lua::util::Uuid *>(nullptr));
+				  if(uuid) {
+					  if(uuidToEnt.has_value() == false)
+						  uuidToEnt = get_entity_uuid_map();
+					  auto itEnt = uuidToEnt->find(uuid->value);
+					  if(itEnt != uuidToEnt->end())
+						  ent = itEnt->second;
+				  }
 			  }
-			  */
-
-			  auto lightC = ent.GetComponent<pragma::CLightComponent>();
-			  if(lightC.expired())
-				  return false;
-			  auto light = pragma::scenekit::Light::Create();
-			  if(!light)
-				  return false;
-			  sync_light(ent, *light);
-			  light->SetUuid(ent.GetUuid());
-			  renderer->AddLiveActor(*light);
-			  o = light.get();
+			  if(ent)
+				  ents.push_back(ent);
 		  }
-		  if(typeid(*o) == typeid(pragma::scenekit::Light))
-			  sync_light(ent, static_cast<pragma::scenekit::Light &>(*o));
-		  else if(typeid(*o) == typeid(pragma::scenekit::Camera))
-			  sync_camera(ent, static_cast<pragma::scenekit::Camera &>(*o));
-		  else {
-			  o->SetPos(ent.GetPosition());
-			  o->SetRotation(ent.GetRotation());
-		  }
-		  return renderer->SyncEditedActor(uuid);
+		  init_actor_sync(renderer);
+		  return renderer.SyncActors(ents);
+	  });
+	defRenderer.def(
+	  "MarkActorDirty", +[](lua_State *l, pragma::modules::scenekit::Renderer &renderer, BaseEntity &ent) {
+		  init_actor_sync(renderer);
+		  renderer.MarkActorDirty(ent);
+	  });
+	defRenderer.def(
+	  "WatchActor", +[](lua_State *l, pragma::modules::scenekit::Renderer &renderer, BaseEntity &ent) {
+		  init_actor_sync(renderer);
+		  renderer.WatchActor(ent);
 	  });
+	defRenderer.def(
+	  "UnwatchActor", +[](lua_State *l, pragma::modules::scenekit::Renderer &renderer, BaseEntity &ent) { renderer.UnwatchActor(ent); });
 	defRenderer.def(
 	  "FindActor", +[](lua_State *l, pragma::modules::scenekit::Renderer &renderer, const Lua::util::Uuid &uuid) -> pragma::scenekit::WorldObject * { return renderer->FindActor(uuid.value); });
 	defRenderer.def("GetScene",
@@ -1466,6 +1850,10 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 	static_assert(pragma::scenekit::NODE_COUNT == 44, "Increase this number if new node types are added!");
 	Lua::RegisterLibraryValues<std::string>(l.GetState(), "unirender", nodeTypes);
 
+	Lua::RegisterLibraryValues<uint32_t>(l.GetState(), "unirender",
+	  {{"RENDER_JOB_STATE_SUBMITTING", umath::to_integral(pragma::modules::scenekit::RenderQueueJobState::Submitting)}, {"RENDER_JOB_STATE_QUEUED", umath::to_integral(pragma::modules::scenekit::RenderQueueJobState::Queued)},
+	    {"RENDER_JOB_STATE_RENDERING", umath::to_integral(pragma::modules::scenekit::RenderQueueJobState::Rendering)}, {"RENDER_JOB_STATE_COMPLETE", umath::to_integral(pragma::modules::scenekit::RenderQueueJobState::Complete)},
+	    {"RENDER_JOB_STATE_FAILED", umath::to_integral(pragma::modules::scenekit::RenderQueueJobState::Failed)}});
 	Lua::RegisterLibraryValues<uint32_t>(l.GetState(), "unirender",
 	  {{"SUBSURFACE_SCATTERING_METHOD_BURLEY", 32 /* ccl::ClosureType::CLOSURE_BSSRDF_BURLEY_ID */}, {"SUBSURFACE_SCATTERING_METHOD_RANDOM_WALK_FIXED_RADIUS", 34 /* ccl::ClosureType::CLOSURE_BSSRDF_RANDOM_WALK_FIXED_RADIUS_ID */},
 	    {"SUBSURFACE_SCATTERING_METHOD_RANDOM_WALK", 33 /* ccl::ClosureType::CLOSURE_BSSRDF_RANDOM_WALK_ID */}});
@@ -2435,8 +2823,131 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 
 	auto defProgressiveRefine = luabind::class_<pragma::modules::scenekit::ProgressiveTexture>("ProgressiveTexture");
 	defProgressiveRefine.def("GetTexture", &pragma::modules::scenekit::ProgressiveTexture::GetTexture);
+	defProgressiveRefine.def("GetDisplayLatency", &pragma::modules::scenekit::ProgressiveTexture::GetDisplayLatency);
+	defProgressiveRefine.def("GetMergedUpdateCount", &pragma::modules::scenekit::ProgressiveTexture::GetMergedUpdateCount);
+	defProgressiveRefine.def(
+	  "SetDenoiseEnabled", +[](pragma::modules::scenekit::ProgressiveTexture &prt, bool enabled) { prt.SetDenoiseEnabled(enabled); });
+	defProgressiveRefine.def(
+	  "SetDenoiseEnabled", +[](pragma::modules::scenekit::ProgressiveTexture &prt, bool enabled, uint32_t sampleInterval, float timeInterval) {
+		  pragma::modules::scenekit::DenoiseTexture::Settings settings {};
+		  settings.sampleInterval = sampleInterval;
+		  settings.timeInterval = timeInterval;
+		  prt.SetDenoiseEnabled(enabled, settings);
+	  });
+	defProgressiveRefine.def(
+	  "SetPreviewEnabled", +[](pragma::modules::scenekit::ProgressiveTexture &prt, bool enabled) {
+		  auto settings = prt.GetPreviewSettings();
+		  settings.enabled = enabled;
+		  prt.SetPreviewSettings(settings);
+	  });
+	defProgressiveRefine.def(
+	  "SetPreviewEnabled", +[](pragma::modules::scenekit::ProgressiveTexture &prt, bool enabled, uint32_t downscaleFactor, float refineDelay) {
+		  pragma::modules::scenekit::ProgressiveTexture::PreviewSettings settings {};
+		  settings.enabled = enabled;
+		  settings.downscaleFactor = downscaleFactor;
+		  settings.refineDelay = refineDelay;
+		  prt.SetPreviewSettings(settings);
+	  });
+	defProgressiveRefine.def("IsPreviewActive", &pragma::modules::scenekit::ProgressiveTexture::IsPreviewActive);
+	defProgressiveRefine.def(
+	  "Denoise", +[](pragma::modules::scenekit::ProgressiveTexture &prt) {
+		  auto *denoiseTex = prt.GetDenoiseTexture();
+		  if(denoiseTex)
+			  denoiseTex->Denoise();
+	  });
+	defProgressiveRefine.def(
+	  "GetDenoisedImage", +[](pragma::modules::scenekit::ProgressiveTexture &prt) -> std::shared_ptr<uimg::ImageBuffer> {
+		  auto *denoiseTex = prt.GetDenoiseTexture();
+		  return denoiseTex ? denoiseTex->GetDenoisedImageData() : nullptr;
+	  });
+	defProgressiveRefine.def(
+	  "GetDenoisedFrameIndex", +[](pragma::modules::scenekit::ProgressiveTexture &prt) -> uint32_t {
+		  auto *denoiseTex = prt.GetDenoiseTexture();
+		  return denoiseTex ? denoiseTex->GetDenoisedFrameIndex() : 0;
+	  });
 	modCycles[defProgressiveRefine];
 
+	auto defBakeQueue = luabind::class_<pragma::modules::scenekit::AOBakeQueue>("AOBakeQueue");
+	defBakeQueue.add_static_constant("JOB_STATE_PENDING", umath::to_integral(pragma::modules::scenekit::AOBakeQueue::JobState::Pending));
+	defBakeQueue.add_static_constant("JOB_STATE_BAKING", umath::to_integral(pragma::modules::scenekit::AOBakeQueue::JobState::Baking));
+	defBakeQueue.add_static_constant("JOB_STATE_WRITING", umath::to_integral(pragma::modules::scenekit::AOBakeQueue::JobState::Writing));
+	defBakeQueue.add_static_constant("JOB_STATE_COMPLETE", umath::to_integral(pragma::modules::scenekit::AOBakeQueue::JobState::Complete));
+	defBakeQueue.add_static_constant("JOB_STATE_FAILED", umath::to_integral(pragma::modules::scenekit::AOBakeQueue::JobState::Failed));
+	defBakeQueue.add_static_constant("JOB_STATE_CANCELLED", umath::to_integral(pragma::modules::scenekit::AOBakeQueue::JobState::Cancelled));
+	defBakeQueue.def(
+	  "AddJob", +[](lua_State *l, pragma::modules::scenekit::AOBakeQueue &queue, luabind::object oMdl, uint32_t materialIndex, const std::string &outputPath, uint32_t width, uint32_t height, uint32_t samples, uint32_t deviceType) -> uint32_t {
+		  pragma::modules::scenekit::AOBakeQueue::JobInfo jobInfo {};
+		  // The model can be specified by name, in which case it's only loaded once the bake is started
+		  if(luabind::type(oMdl) == LUA_TSTRING)
+			  jobInfo.modelName = luabind::object_cast<std::string>(oMdl);
+		  else
+			  jobInfo.model = luabind::object_cast<std::shared_ptr<Model>>(oMdl);
+		  jobInfo.materialIndex = materialIndex;
+		  jobInfo.outputPath = outputPath;
+		  jobInfo.width = width;
+		  jobInfo.height = height;
+		  jobInfo.samples = samples;
+		  jobInfo.deviceType = static_cast<pragma::scenekit::Scene::DeviceType>(deviceType);
+		  return queue.AddJob(jobInfo);
+	  });
+	defBakeQueue.def("Cancel", &pragma::modules::scenekit::AOBakeQueue::Cancel);
+	defBakeQueue.def("CancelAll", &pragma::modules::scenekit::AOBakeQueue::CancelAll);
+	defBakeQueue.def("GetJobState", +[](pragma::modules::scenekit::AOBakeQueue &queue, uint32_t jobId) -> uint32_t { return umath::to_integral(queue.GetJobState(jobId)); });
+	defBakeQueue.def("GetJobProgress", &pragma::modules::scenekit::AOBakeQueue::GetJobProgress);
+	defBakeQueue.def("GetPendingJobCount", &pragma::modules::scenekit::AOBakeQueue::GetPendingJobCount);
+	defBakeQueue.def("GetActiveJobCount", &pragma::modules::scenekit::AOBakeQueue::GetActiveJobCount);
+	defBakeQueue.def("GetCompletedJobCount", &pragma::modules::scenekit::AOBakeQueue::GetCompletedJobCount);
+	defBakeQueue.def("GetFailedJobCount", &pragma::modules::scenekit::AOBakeQueue::GetFailedJobCount);
+	defBakeQueue.def("IsComplete", &pragma::modules::scenekit::AOBakeQueue::IsComplete);
+	defBakeQueue.def("GetThroughput", &pragma::modules::scenekit::AOBakeQueue::GetThroughput);
+	defBakeQueue.def("SetMaxConcurrentBatches", &pragma::modules::scenekit::AOBakeQueue::SetMaxConcurrentBatches);
+	defBakeQueue.def("GetMaxConcurrentBatches", &pragma::modules::scenekit::AOBakeQueue::GetMaxConcurrentBatches);
+	modCycles[defBakeQueue];
+
+	auto defCameraSequence = luabind::class_<pragma::modules::scenekit::CameraSequenceRenderer>("CameraSequenceRenderer");
+	defCameraSequence.add_static_constant("STATE_PENDING", umath::to_integral(pragma::modules::scenekit::CameraSequenceRenderer::State::Pending));
+	defCameraSequence.add_static_constant("STATE_RENDERING", umath::to_integral(pragma::modules::scenekit::CameraSequenceRenderer::State::Rendering));
+	defCameraSequence.add_static_constant("STATE_COMPLETE", umath::to_integral(pragma::modules::scenekit::CameraSequenceRenderer::State::Complete));
+	defCameraSequence.add_static_constant("STATE_FAILED", umath::to_integral(pragma::modules::scenekit::CameraSequenceRenderer::State::Failed));
+	defCameraSequence.add_static_constant("STATE_CANCELLED", umath::to_integral(pragma::modules::scenekit::CameraSequenceRenderer::State::Cancelled));
+	defCameraSequence.def(
+	  "SetOutputPath", +[](lua_State *l, pragma::modules::scenekit::CameraSequenceRenderer &renderer, const std::string &outputPath) -> bool {
+		  auto path = outputPath;
+		  if(Lua::file::validate_write_operation(l, path) == false)
+			  return false;
+		  renderer.SetOutputPath(path);
+		  return true;
+	  });
+	defCameraSequence.def(
+	  "SetFrameCallback", +[](lua_State *l, pragma::modules::scenekit::CameraSequenceRenderer &renderer, luabind::object callback) {
+		  // The callback receives the frame index and the color layer of the frame
+		  renderer.SetFrameCallback([l, callback](uint32_t frameIndex, const uimg::ImageLayerSet &layers) {
+			  auto it = layers.images.find("COLOR");
+			  if(it == layers.images.end())
+				  it = layers.images.begin();
+			  if(it == layers.images.end() || it->second == nullptr)
+				  return;
+			  callback(frameIndex, it->second);
+		  });
+	  });
+	defCameraSequence.def("Start", &pragma::modules::scenekit::CameraSequenceRenderer::Start);
+	defCameraSequence.def("Cancel", &pragma::modules::scenekit::CameraSequenceRenderer::Cancel);
+	defCameraSequence.def("GetState", +[](pragma::modules::scenekit::CameraSequenceRenderer &renderer) -> uint32_t { return umath::to_integral(renderer.GetState()); });
+	defCameraSequence.def("IsComplete", &pragma::modules::scenekit::CameraSequenceRenderer::IsComplete);
+	defCameraSequence.def("GetProgress", &pragma::modules::scenekit::CameraSequenceRenderer::GetProgress);
+	defCameraSequence.def("GetFrameCount", &pragma::modules::scenekit::CameraSequenceRenderer::GetFrameCount);
+	defCameraSequence.def("GetCompletedFrameCount", &pragma::modules::scenekit::CameraSequenceRenderer::GetCompletedFrameCount);
+	defCameraSequence.def(
+	  "GetOutputFiles", +[](lua_State *l, pragma::modules::scenekit::CameraSequenceRenderer &renderer) -> luabind::object {
+		  auto t = luabind::newtable(l);
+		  auto &files = renderer.GetOutputFiles();
+		  for(auto i = decltype(files.size()) {0u}; i < files.size(); ++i)
+			  t[i + 1] = files[i];
+		  return t;
+	  });
+	defCameraSequence.def("GetErrorMessage", &pragma::modules::scenekit::CameraSequenceRenderer::GetErrorMessage);
+	modCycles[defCameraSequence];
+
 	auto defCache = luabind::class_<pragma::modules::scenekit::Cache>("Cache");
 	/*defCache.def("InitializeFromGameScene",static_cast<void(*)(lua_State*,pragma::modules::scenekit::Cache&,Scene&,luabind::object,luabind::object)>([](lua_State *l,pragma::modules::scenekit::Cache &cache,Scene &gameScene,luabind::object entFilter,luabind::object lightFilter) {
 			initialize_cycles_geometry(const_cast<Scene&>(gameScene),cache,{},SceneFlags::None,to_entity_filter(l,&entFilter,3),to_entity_filter(l,&entFilter,4));
@@ -2511,6 +3022,17 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 	defScene.def("SetAoBakeTarget", static_cast<void (scenekit::Scene::*)(Model &, uint32_t)>(&scenekit::Scene::SetAOBakeTarget));
 	defScene.def("SetAoBakeTarget", static_cast<void (scenekit::Scene::*)(BaseEntity &, uint32_t)>(&scenekit::Scene::SetAOBakeTarget));
 	defScene.def("SetLightmapDataCache", &scenekit::Scene::SetLightmapDataCache);
+	defScene.def("SetMaxTextureDimension", &scenekit::Scene::SetMaxTextureDimension);
+	defScene.def("GetMaxTextureDimension", &scenekit::Scene::GetMaxTextureDimension);
+	defScene.def("SetPreview", &scenekit::Scene::SetPreview);
+	defScene.def("IsPreview", &scenekit::Scene::IsPreview);
+	defScene.def(
+	  "SetAdaptiveBakeSampling", +[](scenekit::Scene &scene, uint32_t minSamples, float noiseThreshold) {
+		  scenekit::AdaptiveBakeSettings settings {};
+		  settings.minSamples = minSamples;
+		  settings.noiseThreshold = noiseThreshold;
+		  scene.SetAdaptiveBakeSettings(settings);
+	  });
 	defScene.def("AddLightmapBakeTarget", static_cast<void (scenekit::Scene::*)(BaseEntity &)>(&scenekit::Scene::AddLightmapBakeTarget));
 	defScene.def(
 	  "AddLightSource", +[](lua_State *l, scenekit::Scene &scene, BaseEntity &ent) {
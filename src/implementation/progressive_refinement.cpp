@@ -12,9 +12,16 @@ module;
 #include <image/prosper_texture.hpp>
 #include <prosper_command_buffer.hpp>
 #include <prosper_fence.hpp>
+#include <prosper_util.hpp>
+#include <buffers/prosper_buffer.hpp>
 #include <future>
 #include <deque>
 #include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <chrono>
+#include <algorithm>
 
 module pragma.modules.scenekit;
 import :progressive_refinement;
@@ -27,49 +34,130 @@ DenoiseTexture::DenoiseTexture(uint32_t w, uint32_t h)
 {
 	m_inputImage = uimg::ImageBuffer::Create(w, h, uimg::Format::RGB_FLOAT);
 	m_denoisedImage = uimg::ImageBuffer::Create(w, h, uimg::Format::RGB_FLOAT);
-	m_outputImage = uimg::ImageBuffer::Create(w, h, uimg::Format::RGBA_HDR);
+	m_lastDenoiseTime = std::chrono::steady_clock::now();
 	m_running = true;
-	m_thread = std::thread {[this]() {
-		while(m_running)
-			UpdatePendingTiles();
-	}};
+	m_thread = std::thread {[this]() { RunWorker(); }};
 }
 
-void DenoiseTexture::UpdatePendingTiles()
+DenoiseTexture::~DenoiseTexture()
+{
+	{
+		std::scoped_lock lock {m_tileMutex};
+		m_running = false;
+	}
+	m_tileCondition.notify_one();
+	m_thread.join();
+}
+
+void DenoiseTexture::SetSettings(const Settings &settings)
+{
+	{
+		std::scoped_lock lock {m_tileMutex};
+		m_settings = settings;
+	}
+	m_tileCondition.notify_one();
+}
+DenoiseTexture::Settings DenoiseTexture::GetSettings() const
+{
+	std::scoped_lock lock {m_tileMutex};
+	return m_settings;
+}
+
+void DenoiseTexture::RunWorker()
+{
+	std::unique_lock lock {m_tileMutex};
+	while(m_running) {
+		auto hasWork = [this]() { return !m_running || !m_pendingTiles.empty() || m_shouldDenoise; };
+		// If there is input that hasn't been denoised yet, the worker has to wake up once the time interval has passed
+		if(m_hasNewInput && m_settings.timeInterval > 0.f)
+			m_tileCondition.wait_until(lock, m_lastDenoiseTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float> {m_settings.timeInterval}), hasWork);
+		else
+			m_tileCondition.wait(lock, hasWork);
+		if(m_running == false)
+			break;
+		auto tiles = std::move(m_pendingTiles);
+		m_pendingTiles = {};
+		lock.unlock();
+
+		CompositeTiles(tiles);
+		if(ShouldDenoise()) {
+			m_denoisingState = DenoisingState::Denoising;
+			RunDenoise();
+			m_denoisingState = DenoisingState::Complete;
+		}
+		lock.lock();
+	}
+}
+
+void DenoiseTexture::CompositeTiles(std::queue<pragma::scenekit::TileManager::TileData> &tiles)
 {
-	m_tileMutex.lock();
-	auto tiles = std::move(m_pendingTiles);
-	m_pendingTiles = {};
-	m_tileMutex.unlock();
 	while(tiles.empty() == false) {
 		auto &tileData = tiles.front();
-		// TODO
-		//tileData.image->Copy(*m_inputImage,0,0,tileData.x,tileData.y,tileData.image->GetWidth(),tileData.image->GetHeight());
+		auto numPixels = static_cast<uint64_t>(tileData.w) * tileData.h;
+		if(numPixels > 0 && tileData.data.empty() == false) {
+			// The tile format depends on whether the renderer outputs float or half-float data, see ProgressiveTexture::CreateImage
+			auto bytesPerPixel = (tileData.data.size() * sizeof(tileData.data.front())) / numPixels;
+			auto format = (bytesPerPixel >= sizeof(float) * 4) ? uimg::Format::RGBA_FLOAT : (bytesPerPixel >= sizeof(uint16_t) * 4) ? uimg::Format::RGBA_HDR : uimg::Format::RGBA_LDR;
+			auto tileImg = uimg::ImageBuffer::Create(tileData.data.data(), tileData.w, tileData.h, format);
+			tileImg->Convert(m_inputImage->GetFormat());
+			tileImg->Copy(*m_inputImage, 0, 0, tileData.x, tileData.y, tileData.w, tileData.h);
+			m_receivedPixels += numPixels;
+			m_hasNewInput = true;
+		}
 		tiles.pop();
 	}
+}
 
-	if(m_shouldDenoise) {
-		m_shouldDenoise = false;
-		m_denoisingState = DenoisingState::Denoising;
-		RunDenoise();
-		m_denoisingState = DenoisingState::Complete;
+bool DenoiseTexture::ShouldDenoise()
+{
+	Settings settings;
+	{
+		std::scoped_lock lock {m_tileMutex};
+		settings = m_settings;
+		if(m_shouldDenoise) {
+			m_shouldDenoise = false;
+			return true;
+		}
 	}
+	if(m_hasNewInput == false)
+		return false;
+	auto imagePixels = static_cast<uint64_t>(m_inputImage->GetWidth()) * m_inputImage->GetHeight();
+	if(settings.sampleInterval > 0 && m_receivedPixels >= imagePixels * settings.sampleInterval)
+		return true;
+	return settings.timeInterval > 0.f && std::chrono::steady_clock::now() - m_lastDenoiseTime >= std::chrono::duration<float> {settings.timeInterval};
 }
 
 void DenoiseTexture::AppendTile(pragma::scenekit::TileManager::TileData &&tileData)
 {
-	m_tileMutex.lock();
-	m_pendingTiles.push(std::move(tileData));
-	m_tileMutex.unlock();
+	{
+		std::scoped_lock lock {m_tileMutex};
+		m_pendingTiles.push(std::move(tileData));
+	}
+	m_tileCondition.notify_one();
+}
+std::shared_ptr<uimg::ImageBuffer> DenoiseTexture::GetDenoisedImageData() const
+{
+	std::scoped_lock lock {m_outputMutex};
+	return m_outputImage;
 }
-std::shared_ptr<uimg::ImageBuffer> DenoiseTexture::GetDenoisedImageData() const { return m_outputImage; }
 
-void DenoiseTexture::Denoise() { m_shouldDenoise = true; }
+void DenoiseTexture::Denoise()
+{
+	{
+		std::scoped_lock lock {m_tileMutex};
+		m_shouldDenoise = true;
+	}
+	m_tileCondition.notify_one();
+}
 bool DenoiseTexture::IsDenoising() const { return m_denoisingState == DenoisingState::Denoising; }
 bool DenoiseTexture::IsDenoisingComplete() const { return m_denoisingState == DenoisingState::Complete; }
 
 void DenoiseTexture::RunDenoise()
 {
+	m_hasNewInput = false;
+	m_receivedPixels = 0;
+	m_lastDenoiseTime = std::chrono::steady_clock::now();
+
 	auto w = m_denoisedImage->GetWidth();
 	auto h = m_denoisedImage->GetHeight();
 	pragma::scenekit::denoise::Info denoiseInfo {};
@@ -77,30 +165,49 @@ void DenoiseTexture::RunDenoise()
 	denoiseInfo.width = w;
 	denoiseInfo.height = h;
 
-	pragma::scenekit::denoise::ImageData output {};
-	output.data = static_cast<uint8_t *>(m_inputImage->GetData());
-	output.format = m_inputImage->GetFormat();
-
 	pragma::scenekit::denoise::ImageInputs inputs {};
-	inputs.beautyImage = output;
+	inputs.beautyImage.data = static_cast<uint8_t *>(m_inputImage->GetData());
+	inputs.beautyImage.format = m_inputImage->GetFormat();
+
+	pragma::scenekit::denoise::ImageData output {};
+	output.data = static_cast<uint8_t *>(m_denoisedImage->GetData());
+	output.format = m_denoisedImage->GetFormat();
 
 	m_denoiser.Denoise(denoiseInfo, inputs, output);
-	m_denoisedImage->Copy(*m_outputImage, 0, 0, 0, 0, w, h);
-}
 
-DenoiseTexture::~DenoiseTexture()
-{
-	m_running = false;
-	m_thread.join();
+	// Published as a new image, so readers never see a partially updated image and never have to wait for the denoiser
+	auto outputImage = m_denoisedImage->Copy(uimg::Format::RGBA_HDR);
+	{
+		std::scoped_lock lock {m_outputMutex};
+		m_outputImage = outputImage;
+	}
+	++m_denoisedFrameIndex;
 }
 
 //////////
 
+// Copy offsets have to be a multiple of the texel size, the largest progressive format has 16 bytes per texel
+static constexpr uint64_t STAGING_ALIGNMENT = 16;
+static uint64_t get_staging_size(uint64_t size) { return (size + STAGING_ALIGNMENT - 1) / STAGING_ALIGNMENT * STAGING_ALIGNMENT; }
+// Weight of the most recent upload in the smoothed display latency
+static constexpr float DISPLAY_LATENCY_SMOOTHING = 0.1f;
+
 ProgressiveTexture::~ProgressiveTexture()
 {
 	if(m_cbThink.IsValid())
 		m_cbThink.Remove();
-	c_engine->GetRenderContext().KeepResourceAliveUntilPresentationComplete(m_cmdBuffer);
+	// Uploads may still be in flight, the resources they use have to outlive them
+	auto &context = c_engine->GetRenderContext();
+	for(auto &uploadSet : m_uploadSets) {
+		context.KeepResourceAliveUntilPresentationComplete(uploadSet.cmdBuffer);
+		if(uploadSet.stagingBuffer)
+			context.KeepResourceAliveUntilPresentationComplete(uploadSet.stagingBuffer);
+	}
+	// The images are the targets of those uploads
+	if(m_image)
+		context.KeepResourceAliveUntilPresentationComplete(m_image);
+	if(m_previewImage)
+		context.KeepResourceAliveUntilPresentationComplete(m_previewImage);
 }
 std::shared_ptr<prosper::Texture> ProgressiveTexture::GetTexture() const { return m_texture; }
 void ProgressiveTexture::Initialize(pragma::scenekit::Renderer &renderer)
@@ -109,22 +216,26 @@ void ProgressiveTexture::Initialize(pragma::scenekit::Renderer &renderer)
 	auto &scene = m_renderer->GetScene();
 	m_tileSize = m_renderer->GetTileManager().GetTileSize();
 	auto res = scene.GetResolution();
+	m_fullResolution = res;
 
 	auto &context = c_engine->GetRenderContext();
-	auto img = CreateImage(res.x, res.y, true);
+	auto img = CreateImage(res.x, res.y);
 	m_image = img;
 
-	uint32_t queueFamilyIndex;
-	m_cmdBuffer = context.AllocatePrimaryLevelCommandBuffer(prosper::QueueFamilyType::Universal, queueFamilyIndex);
-	m_fence = context.CreateFence(true);
-	auto result = m_cmdBuffer->StartRecording(false, false);
+	for(auto &uploadSet : m_uploadSets) {
+		uint32_t queueFamilyIndex;
+		uploadSet.cmdBuffer = context.AllocatePrimaryLevelCommandBuffer(prosper::QueueFamilyType::Universal, queueFamilyIndex);
+		uploadSet.fence = context.CreateFence(true);
+	}
+	auto &cmdBuffer = m_uploadSets.front().cmdBuffer;
+	auto result = cmdBuffer->StartRecording(false, false);
 	assert(result);
 
 	// Clear alpha
-	m_cmdBuffer->RecordClearImage(*img, prosper::ImageLayout::TransferDstOptimal, std::array<float, 4> {0.f, 0.f, 0.f, 0.f});
-	m_cmdBuffer->RecordImageBarrier(*img, prosper::ImageLayout::TransferDstOptimal, prosper::ImageLayout::ShaderReadOnlyOptimal);
-	m_cmdBuffer->StopRecording();
-	context.SubmitCommandBuffer(*m_cmdBuffer, prosper::QueueFamilyType::Universal, true);
+	cmdBuffer->RecordClearImage(*img, prosper::ImageLayout::TransferDstOptimal, std::array<float, 4> {0.f, 0.f, 0.f, 0.f});
+	cmdBuffer->RecordImageBarrier(*img, prosper::ImageLayout::TransferDstOptimal, prosper::ImageLayout::ShaderReadOnlyOptimal);
+	cmdBuffer->StopRecording();
+	context.SubmitCommandBuffer(*cmdBuffer, prosper::QueueFamilyType::Universal, true);
 
 	prosper::util::SamplerCreateInfo samplerCreateInfo {};
 	samplerCreateInfo.addressModeU = prosper::SamplerAddressMode::ClampToEdge;
@@ -135,60 +246,233 @@ void ProgressiveTexture::Initialize(pragma::scenekit::Renderer &renderer)
 	m_image = img;
 	m_texture = tex;
 
-	// m_denoiseTexture = std::make_unique<DenoiseTexture>(w,h);
 	m_cbThink = c_engine->AddCallback("Think", FunctionCallback<void>::Create([this]() { Update(); }));
 }
-std::shared_ptr<prosper::IImage> ProgressiveTexture::CreateImage(uint32_t width, uint32_t height, bool onDevice) const
+void ProgressiveTexture::SetDenoiseEnabled(bool enabled, const DenoiseTexture::Settings &settings)
+{
+	if(enabled == false) {
+		m_denoiseTexture = nullptr;
+		return;
+	}
+	if(m_denoiseTexture == nullptr) {
+		auto res = m_renderer->GetScene().GetResolution();
+		m_denoiseTexture = std::make_unique<DenoiseTexture>(res.x, res.y);
+	}
+	m_denoiseTexture->SetSettings(settings);
+}
+std::shared_ptr<prosper::IImage> ProgressiveTexture::CreateImage(uint32_t width, uint32_t height) const
 {
 	auto &context = c_engine->GetRenderContext();
 	prosper::util::ImageCreateInfo imgCreateInfo {};
 	imgCreateInfo.width = width;
 	imgCreateInfo.height = height;
 	imgCreateInfo.format = m_renderer->ShouldUseProgressiveFloatFormat() ? prosper::Format::R32G32B32A32_SFloat : prosper::Format::R16G16B16A16_SFloat;
-	imgCreateInfo.usage = prosper::ImageUsageFlags::TransferSrcBit | prosper::ImageUsageFlags::TransferDstBit;
-	if(onDevice)
-		imgCreateInfo.usage |= prosper::ImageUsageFlags::SampledBit;
-	imgCreateInfo.memoryFeatures = onDevice ? prosper::MemoryFeatureFlags::DeviceLocal : prosper::MemoryFeatureFlags::HostAccessable | prosper::MemoryFeatureFlags::HostCached;
-	imgCreateInfo.tiling = onDevice ? prosper::ImageTiling::Optimal : prosper::ImageTiling::Linear;
-	imgCreateInfo.postCreateLayout = onDevice ? prosper::ImageLayout::TransferDstOptimal : prosper::ImageLayout::TransferSrcOptimal;
+	imgCreateInfo.usage = prosper::ImageUsageFlags::TransferSrcBit | prosper::ImageUsageFlags::TransferDstBit | prosper::ImageUsageFlags::SampledBit;
+	imgCreateInfo.memoryFeatures = prosper::MemoryFeatureFlags::DeviceLocal;
+	imgCreateInfo.tiling = prosper::ImageTiling::Optimal;
+	imgCreateInfo.postCreateLayout = prosper::ImageLayout::TransferDstOptimal;
 	return context.CreateImage(imgCreateInfo);
 }
+bool ProgressiveTexture::ReserveStagingBuffer(UploadSet &uploadSet, uint64_t size)
+{
+	if(uploadSet.stagingBuffer && uploadSet.stagingBuffer->GetSize() >= size)
+		return true;
+	// Grow in steps of at least a full image, so the buffer rarely has to be re-created
+	auto res = m_renderer->GetScene().GetResolution();
+	auto pixelSize = m_renderer->ShouldUseProgressiveFloatFormat() ? (sizeof(float) * 4) : (sizeof(uint16_t) * 4);
+	auto &context = c_engine->GetRenderContext();
+	prosper::util::BufferCreateInfo bufCreateInfo {};
+	bufCreateInfo.size = umath::max(static_cast<uint64_t>(res.x) * res.y * pixelSize, size);
+	bufCreateInfo.usageFlags = prosper::BufferUsageFlags::TransferSrcBit;
+	bufCreateInfo.memoryFeatures = prosper::MemoryFeatureFlags::HostAccessable | prosper::MemoryFeatureFlags::HostCoherent;
+	bufCreateInfo.flags |= prosper::util::BufferCreateInfo::Flags::Persistent;
+	auto buf = context.CreateBuffer(bufCreateInfo);
+	if(buf == nullptr)
+		return false;
+	buf->SetDebugName("rt_tile_staging");
+	if(buf->SetPermanentlyMapped(true, prosper::IBuffer::MapFlags::WriteBit) == false)
+		return false;
+	uploadSet.stagingBuffer = buf;
+	return true;
+}
+void ProgressiveTexture::RetireUploads()
+{
+	auto t = std::chrono::steady_clock::now();
+	for(auto &uploadSet : m_uploadSets) {
+		if(uploadSet.inFlight == false || uploadSet.fence->IsSignaled() == false)
+			continue;
+		uploadSet.inFlight = false;
+		auto latency = std::chrono::duration<float, std::milli> {t - uploadSet.oldestTileTime}.count();
+		m_displayLatency = (m_displayLatency == 0.f) ? latency : (m_displayLatency + (latency - m_displayLatency) * DISPLAY_LATENCY_SMOOTHING);
+	}
+}
+void ProgressiveTexture::SetPreviewSettings(const PreviewSettings &settings)
+{
+	m_previewSettings = settings;
+	m_previewSettings.downscaleFactor = umath::max(m_previewSettings.downscaleFactor, 1u);
+}
+void ProgressiveTexture::NotifySceneEdited()
+{
+	if(m_previewSettings.enabled == false)
+		return;
+	// The switch to the preview resolution happens with the next update, the scene may still be in the middle of an edit
+	m_lastEditTime = std::chrono::steady_clock::now();
+	if(m_previewActive == false)
+		m_previewRequested = true;
+}
+void ProgressiveTexture::Restart()
+{
+	NotifySceneEdited();
+	if(m_previewRequested) {
+		UpdatePreview(); // Restarts the renderer at the preview resolution
+		return;
+	}
+	m_renderer->Restart();
+}
+bool ProgressiveTexture::SetRenderResolution(uint32_t width, uint32_t height)
+{
+	auto &cam = m_renderer->GetScene().GetCamera();
+	auto uuid = cam.GetUuid();
+	if(m_renderer->BeginSceneEdit() == false)
+		return false;
+	auto *o = m_renderer->FindActor(uuid);
+	auto &liveCam = (o && typeid(*o) == typeid(pragma::scenekit::Camera)) ? static_cast<pragma::scenekit::Camera &>(*o) : cam;
+	liveCam.SetResolution(width, height);
+	auto success = m_renderer->SyncEditedActor(uuid);
+	success = m_renderer->EndSceneEdit() && success;
+	// Tiles of the previous resolution may still be waiting in the renderer. A stale full resolution tile can lie within the
+	// preview bounds and vice versa, so the bounds of a tile can't be used to tell them apart.
+	DiscardRenderedTiles();
+	++m_renderGeneration;
+	m_renderer->Restart();
+	// Restart stops the previous render before it returns, any tiles it completed in the meantime are discarded as well.
+	// All tiles retrieved after this point belong to the new generation.
+	DiscardRenderedTiles();
+	return success;
+}
+void ProgressiveTexture::DiscardRenderedTiles()
+{
+	m_renderer->GetRenderedTileBatch();
+	std::erase_if(m_pendingTiles, [this](const auto &pair) { return pair.second.generation != m_renderGeneration; });
+}
+void ProgressiveTexture::UpdatePreview()
+{
+	if(m_previewRequested) {
+		m_previewRequested = false;
+		auto w = umath::max(static_cast<uint32_t>(m_fullResolution.x) / m_previewSettings.downscaleFactor, 1u);
+		auto h = umath::max(static_cast<uint32_t>(m_fullResolution.y) / m_previewSettings.downscaleFactor, 1u);
+		m_previewActive = SetRenderResolution(w, h);
+		return;
+	}
+	if(m_previewActive == false)
+		return;
+	auto t = std::chrono::steady_clock::now();
+	if(m_previewSettings.enabled && t - m_lastEditTime < std::chrono::duration<float> {m_previewSettings.refineDelay})
+		return;
+	// The scene has been still long enough (or the preview has been disabled), refine at full resolution
+	SetRenderResolution(m_fullResolution.x, m_fullResolution.y);
+	m_previewActive = false;
+}
 void ProgressiveTexture::Update()
 {
-	auto &scene = m_renderer->GetScene();
+	RetireUploads();
+	UpdatePreview();
+
 	auto &tileManager = m_renderer->GetTileManager();
 	// We'll wait for all tiles to have at least 1 finished sample before we write the image data
 	if(tileManager.AllTilesHaveRenderedSamples() == false)
 		return;
 	auto tiles = m_renderer->GetRenderedTileBatch();
-	if(tiles.empty())
+	auto generation = m_renderGeneration;
+	auto t = std::chrono::steady_clock::now();
+	auto renderResolution = m_renderer->GetScene().GetResolution();
+	auto isPreview = (renderResolution.x != m_fullResolution.x || renderResolution.y != m_fullResolution.y);
+	// Tiles that haven't been uploaded yet are replaced by newer results for the same tile
+	for(auto &tile : tiles) {
+		if(tile.data.empty())
+			continue;
+		// Tiles of a previous generation are discarded when the resolution changes (see SetRenderResolution), this only guards the copy
+		if(static_cast<int32_t>(tile.x + tile.w) > renderResolution.x || static_cast<int32_t>(tile.y + tile.h) > renderResolution.y)
+			continue;
+		// The denoiser only receives full resolution tiles, the preview is replaced soon anyway
+		if(m_denoiseTexture && isPreview == false)
+			m_denoiseTexture->AppendTile(pragma::scenekit::TileManager::TileData {tile});
+		auto key = (static_cast<uint64_t>(tile.x) << 32) | static_cast<uint32_t>(tile.y);
+		auto it = m_pendingTiles.find(key);
+		if(it != m_pendingTiles.end())
+			it->second.data = std::move(tile);
+		else
+			m_pendingTiles.insert(std::make_pair(key, PendingTile {std::move(tile), t, generation}));
+	}
+	std::erase_if(m_pendingTiles, [generation](const auto &pair) { return pair.second.generation != generation; });
+	if(m_pendingTiles.empty())
+		return;
+
+	auto itUploadSet = std::find_if(m_uploadSets.begin(), m_uploadSets.end(), [](const UploadSet &uploadSet) { return uploadSet.inFlight == false; });
+	if(itUploadSet == m_uploadSets.end()) {
+		// All uploads are still in flight, the tiles will be uploaded with the next update
+		if(tiles.empty() == false)
+			++m_mergedUpdateCount;
 		return;
-	auto &tile = tiles.back();
-	auto it = std::find_if(m_mipImages.begin(), m_mipImages.end(), [&tile](const std::shared_ptr<prosper::IImage> &img) { return img->GetWidth() == tile.w && img->GetHeight() == tile.h; });
-	if(it == m_mipImages.end()) {
-		auto newImg = CreateImage(tile.w, tile.h, false);
-		m_mipImages.push_back(newImg);
-		it = m_mipImages.end() - 1;
 	}
+	auto &uploadSet = *itUploadSet;
+	if(isPreview && (m_previewImage == nullptr || m_previewImage->GetWidth() != static_cast<uint32_t>(renderResolution.x) || m_previewImage->GetHeight() != static_cast<uint32_t>(renderResolution.y))) {
+		if(m_previewImage)
+			c_engine->GetRenderContext().KeepResourceAliveUntilPresentationComplete(m_previewImage);
+		m_previewImage = CreateImage(renderResolution.x, renderResolution.y);
+		m_previewImageGeneration = {};
+	}
+	auto &dstImage = isPreview ? *m_previewImage : *m_image;
 
-	auto &imgData = **it;
-	imgData.WriteImageData(tile.x, tile.y, tile.w, tile.h, 0, 0, tile.data.size() * sizeof(tile.data.front()), tile.data.data());
+	uint64_t uploadSize = 0;
+	for(auto &[key, tile] : m_pendingTiles)
+		uploadSize += get_staging_size(tile.data.data.size() * sizeof(tile.data.data.front()));
+	if(ReserveStagingBuffer(uploadSet, uploadSize) == false)
+		return;
 
-	auto &context = c_engine->GetRenderContext();
-	context.WaitForFence(*m_fence);
-	auto res = m_cmdBuffer->StartRecording(false, false);
+	auto &cmdBuffer = *uploadSet.cmdBuffer;
+	auto res = cmdBuffer.StartRecording(false, false);
 	assert(res);
 	if(!res)
 		return;
-	m_fence->Reset();
-	prosper::util::BarrierImageLayout {};
-	// Ensure image data has been written by host before blitting to destination image
-	m_cmdBuffer->RecordImageBarrier(imgData, prosper::PipelineStageFlags::HostBit, prosper::PipelineStageFlags::TransferBit, prosper::ImageLayout::TransferSrcOptimal, prosper::ImageLayout::TransferSrcOptimal, prosper::AccessFlags::HostWriteBit, prosper::AccessFlags::TransferReadBit);
-
-	m_cmdBuffer->RecordImageBarrier(*m_image, prosper::ImageLayout::ShaderReadOnlyOptimal, prosper::ImageLayout::TransferDstOptimal);
-	m_cmdBuffer->RecordBlitImage({}, imgData, *m_image);
-	m_cmdBuffer->RecordImageBarrier(*m_image, prosper::ImageLayout::TransferDstOptimal, prosper::ImageLayout::ShaderReadOnlyOptimal);
+	uploadSet.fence->Reset();
+	uploadSet.oldestTileTime = t;
+	// Host writes to coherent memory are made visible to the device by the queue submission, so no buffer barrier is required.
+	// The image barriers order the uploads, so a newer result for a tile can't be overwritten by an older one.
+	// The preview image always remains in the transfer destination layout between updates
+	if(isPreview == false)
+		cmdBuffer.RecordImageBarrier(*m_image, prosper::ImageLayout::ShaderReadOnlyOptimal, prosper::ImageLayout::TransferDstOptimal);
+	else if(m_previewImageGeneration != generation) {
+		// The preview image may still contain tiles of an earlier preview, which would be blitted along with the new tiles
+		cmdBuffer.RecordClearImage(*m_previewImage, prosper::ImageLayout::TransferDstOptimal, std::array<float, 4> {0.f, 0.f, 0.f, 0.f});
+		cmdBuffer.RecordImageBarrier(*m_previewImage, prosper::ImageLayout::TransferDstOptimal, prosper::ImageLayout::TransferDstOptimal);
+		m_previewImageGeneration = generation;
+	}
+	uint64_t offset = 0;
+	for(auto &[key, pendingTile] : m_pendingTiles) {
+		auto &tile = pendingTile.data;
+		auto size = tile.data.size() * sizeof(tile.data.front());
+		uploadSet.stagingBuffer->Write(offset, size, tile.data.data());
+		uploadSet.oldestTileTime = std::min(uploadSet.oldestTileTime, pendingTile.retrieveTime);
 
-	m_cmdBuffer->StopRecording();
-	context.SubmitCommandBuffer(*m_cmdBuffer, prosper::QueueFamilyType::Universal, false, m_fence.get());
+		prosper::util::BufferImageCopyInfo copyInfo {};
+		copyInfo.bufferOffset = offset;
+		copyInfo.imageOffset = {static_cast<int32_t>(tile.x), static_cast<int32_t>(tile.y)};
+		copyInfo.imageExtent = prosper::Extent2D {static_cast<uint32_t>(tile.w), static_cast<uint32_t>(tile.h)};
+		copyInfo.dstImageLayout = prosper::ImageLayout::TransferDstOptimal;
+		cmdBuffer.RecordCopyBufferToImage(copyInfo, *uploadSet.stagingBuffer, dstImage);
+		offset += get_staging_size(size);
+	}
+	if(isPreview) {
+		// The blit covers the full extents of both images, which upscales the preview to the full resolution
+		cmdBuffer.RecordImageBarrier(*m_previewImage, prosper::ImageLayout::TransferDstOptimal, prosper::ImageLayout::TransferSrcOptimal);
+		cmdBuffer.RecordImageBarrier(*m_image, prosper::ImageLayout::ShaderReadOnlyOptimal, prosper::ImageLayout::TransferDstOptimal);
+		cmdBuffer.RecordBlitImage({}, *m_previewImage, *m_image);
+		cmdBuffer.RecordImageBarrier(*m_previewImage, prosper::ImageLayout::TransferSrcOptimal, prosper::ImageLayout::TransferDstOptimal);
+	}
+	cmdBuffer.RecordImageBarrier(*m_image, prosper::ImageLayout::TransferDstOptimal, prosper::ImageLayout::ShaderReadOnlyOptimal);
+	cmdBuffer.StopRecording();
+	c_engine->GetRenderContext().SubmitCommandBuffer(cmdBuffer, prosper::QueueFamilyType::Universal, false, uploadSet.fence.get());
+	uploadSet.inFlight = true;
+	m_pendingTiles.clear();
 }
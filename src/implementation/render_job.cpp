@@ -0,0 +1,309 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <pragma/c_engine.h>
+#include <sharedutils/datastream.h>
+#include <sharedutils/util_path.hpp>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <filesystem>
+#include <algorithm>
+#include <cctype>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+module pragma.modules.scenekit;
+
+import pragma.scenekit;
+import :serialization;
+import :render_queue;
+import :split_render;
+
+using namespace pragma::modules::scenekit;
+
+static std::mutex g_renderJobWriteMutex;
+static std::vector<std::shared_future<bool>> g_renderJobWrites;
+// Set if a write has failed since the last call to wait_for_render_job_writes
+static bool g_renderJobWriteFailed = false;
+
+static void track_render_job_write(const std::shared_future<bool> &future)
+{
+	std::scoped_lock lock {g_renderJobWriteMutex};
+	// Forget about writes that have already been completed, but remember whether they succeeded
+	g_renderJobWrites.erase(std::remove_if(g_renderJobWrites.begin(), g_renderJobWrites.end(),
+	                          [](const std::shared_future<bool> &f) {
+		                          if(f.wait_for(std::chrono::seconds {0}) != std::future_status::ready)
+			                          return false;
+		                          if(f.get() == false)
+			                          g_renderJobWriteFailed = true;
+		                          return true;
+	                          }),
+	  g_renderJobWrites.end());
+	g_renderJobWrites.push_back(future);
+}
+
+std::shared_future<bool> pragma::modules::scenekit::save_render_job(pragma::scenekit::Scene &scene, const std::string &relPath, const std::string &fileName, bool writeInBackground)
+{
+	auto programPath = util::Path::CreatePath(FileManager::GetProgramPath()).GetString();
+	auto rootPath = programPath + relPath;
+	pragma::scenekit::Scene::SerializationData serializationData {};
+	serializationData.outputFileName = fileName;
+	DataStream ds {};
+	scene.Save(ds, rootPath, serializationData);
+
+	auto absPath = programPath + fileName;
+	auto write = [absPath, ds, settings = get_render_job_file_settings()]() mutable -> bool { return write_render_job_file(absPath, ds->GetData(), ds->GetInternalSize(), settings); };
+	if(writeInBackground == false) {
+		std::promise<bool> promise;
+		promise.set_value(write());
+		return promise.get_future().share();
+	}
+
+	auto future = std::async(std::launch::async, std::move(write)).share();
+	track_render_job_write(future);
+	return future;
+}
+
+bool pragma::modules::scenekit::wait_for_render_job_writes()
+{
+	std::vector<std::shared_future<bool>> writes;
+	auto success = true;
+	{
+		std::scoped_lock lock {g_renderJobWriteMutex};
+		writes = std::move(g_renderJobWrites);
+		g_renderJobWrites.clear();
+		success = !g_renderJobWriteFailed;
+		g_renderJobWriteFailed = false;
+	}
+	for(auto &f : writes)
+		success = f.get() && success;
+	return success;
+}
+
+static constexpr const char *RENDER_QUEUE_PATH = "render/queue/";
+
+RenderQueue &pragma::modules::scenekit::get_render_queue()
+{
+	static RenderQueue queue {util::Path::CreatePath(FileManager::GetProgramPath()).GetString() + RENDER_QUEUE_PATH};
+	return queue;
+}
+
+std::optional<std::string> pragma::modules::scenekit::submit_render_queue_job(pragma::scenekit::Scene &scene, const RenderQueueJobInfo &info)
+{
+	if(is_valid_render_queue_output_file_name(info.outputFileName) == false) {
+		Con::cwar << "Unable to submit render job: Invalid output file name '" << info.outputFileName << "'! The file name must not contain path separators or '..'." << Con::endl;
+		return {};
+	}
+	// Region retry renders the frame as strips as well, so it has the same camera requirements as split jobs
+	if(info.splitCount > 1 || info.checkpointCount > 1) {
+		std::string err;
+		if(is_split_render_supported(scene, err) == false) {
+			Con::cwar << "Unable to submit render job: " << err << "!" << Con::endl;
+			return {};
+		}
+	}
+	auto &queue = get_render_queue();
+	auto jobId = queue.CreateJobId();
+	auto jobInfo = info;
+	jobInfo.splitJobId = {};
+	if(jobInfo.splitCount == 1)
+		jobInfo.splitCount = 0;
+	std::vector<std::string> partJobIds;
+	partJobIds.reserve(jobInfo.splitCount);
+	// Workers ignore jobs that aren't queued yet, so the directories of a job that couldn't be written completely can just be removed
+	auto discardJob = [&queue, &jobId, &partJobIds]() -> std::optional<std::string> {
+		std::error_code ec;
+		for(auto &partJobId : partJobIds)
+			std::filesystem::remove_all(queue.GetJobPath(partJobId), ec);
+		std::filesystem::remove_all(queue.GetJobPath(jobId), ec);
+		Con::cwar << "Unable to submit render job: Failed to write job '" << jobId << "' to the render queue!" << Con::endl;
+		return {};
+	};
+	if(queue.WriteJobInfo(jobId, jobInfo) == false || queue.WriteJobStatus(jobId, {}) == false)
+		return discardJob();
+	for(auto i = decltype(jobInfo.splitCount) {0u}; i < jobInfo.splitCount; ++i) {
+		RenderQueueJobInfo partInfo {};
+		partInfo.name = jobInfo.name;
+		partInfo.renderer = jobInfo.renderer;
+		partInfo.splitJobId = jobId;
+		partInfo.splitIndex = i;
+		auto partJobId = queue.GetSplitPartJobId(jobId, i);
+		partJobIds.push_back(partJobId);
+		if(queue.WriteJobInfo(partJobId, partInfo) == false || queue.WriteJobStatus(partJobId, {}) == false)
+			return discardJob();
+	}
+	std::string relPath = RENDER_QUEUE_PATH + jobId + '/';
+	auto write = save_render_job(scene, relPath, relPath + RENDER_QUEUE_JOB_FILE_NAME, true);
+	// Workers ignore the job until it's marked as queued, which only happens once the file is complete.
+	// Split jobs are never rendered directly, only their parts are queued.
+	track_render_job_write(std::async(std::launch::async, [write, jobId, partJobIds = std::move(partJobIds)]() -> bool {
+		auto &queue = get_render_queue();
+		RenderQueueJobStatus status {};
+		auto success = write.get();
+		if(success)
+			status.state = partJobIds.empty() ? RenderQueueJobState::Queued : RenderQueueJobState::Rendering;
+		else {
+			status.state = RenderQueueJobState::Failed;
+			status.message = "Unable to write render job file";
+		}
+		auto statusWritten = queue.WriteJobStatus(jobId, status);
+		if(success)
+			status.state = RenderQueueJobState::Queued;
+		for(auto &partJobId : partJobIds)
+			statusWritten = queue.WriteJobStatus(partJobId, status) && statusWritten;
+		return statusWritten && success;
+	}).share());
+	return jobId;
+}
+
+namespace {
+	struct WorkerProcess {
+#ifdef _WIN32
+		HANDLE handle = nullptr;
+#else
+		pid_t pid = -1;
+#endif
+	};
+};
+static std::vector<WorkerProcess> g_workerProcesses;
+
+static uint32_t get_numa_node_count()
+{
+#ifdef _WIN32
+	ULONG highestNode = 0;
+	if(GetNumaHighestNodeNumber(&highestNode) == FALSE)
+		return 1;
+	return highestNode + 1;
+#else
+	uint32_t count = 0;
+	std::error_code ec;
+	for(auto it = std::filesystem::directory_iterator {"/sys/devices/system/node/", ec}; !ec && it != std::filesystem::directory_iterator {}; it.increment(ec)) {
+		auto name = it->path().filename().string();
+		if(name.size() > 4 && name.compare(0, 4, "node") == 0 && std::isdigit(static_cast<unsigned char>(name[4])))
+			++count;
+	}
+	return umath::max(count, 1u);
+#endif
+}
+
+static bool spawn_worker_process(const std::string &exePath, const std::vector<std::string> &args, WorkerProcess &outProcess)
+{
+#ifdef _WIN32
+	auto cmd = '"' + exePath + '"';
+	for(auto &arg : args)
+		cmd += " \"" + arg + '"';
+	STARTUPINFOA startupInfo {};
+	startupInfo.cb = sizeof(startupInfo);
+	PROCESS_INFORMATION processInfo {};
+	if(CreateProcessA(exePath.c_str(), cmd.data(), nullptr, nullptr, FALSE, CREATE_NO_WINDOW | BELOW_NORMAL_PRIORITY_CLASS, nullptr, nullptr, &startupInfo, &processInfo) == FALSE)
+		return false;
+	CloseHandle(processInfo.hThread);
+	outProcess.handle = processInfo.hProcess;
+	return true;
+#else
+	std::vector<char *> argv;
+	argv.reserve(args.size() + 2);
+	argv.push_back(const_cast<char *>(exePath.c_str()));
+	for(auto &arg : args)
+		argv.push_back(const_cast<char *>(arg.c_str()));
+	argv.push_back(nullptr);
+	pid_t pid;
+	if(posix_spawn(&pid, exePath.c_str(), nullptr, nullptr, argv.data(), environ) != 0)
+		return false;
+	outProcess.pid = pid;
+	return true;
+#endif
+}
+
+uint32_t pragma::modules::scenekit::start_render_queue_workers(uint32_t processCount)
+{
+	auto programPath = util::Path::CreatePath(FileManager::GetProgramPath()).GetString();
+#ifdef _WIN32
+	auto exePath = programPath + "modules/unirender/pr_unirender_worker.exe";
+#else
+	auto exePath = programPath + "modules/unirender/pr_unirender_worker";
+#endif
+	std::error_code ec;
+	if(std::filesystem::exists(exePath, ec) == false) {
+		Con::cwar << "Unable to start render queue workers: Worker executable '" << exePath << "' not found! The module has to be built with PR_UNIRENDER_WITH_WORKER enabled." << Con::endl;
+		return 0;
+	}
+	auto numaNodeCount = get_numa_node_count();
+	if(processCount == 0)
+		processCount = numaNodeCount;
+	auto threadCount = umath::max(std::thread::hardware_concurrency() / processCount, 1u);
+	uint32_t numStarted = 0;
+	for(auto i = decltype(processCount) {0u}; i < processCount; ++i) {
+		std::vector<std::string> args {"--queue", get_render_queue().GetSpoolPath(), "--threads", std::to_string(threadCount)};
+		if(numaNodeCount > 1) {
+			args.push_back("--numa-node");
+			args.push_back(std::to_string(i % numaNodeCount));
+		}
+		WorkerProcess process {};
+		if(spawn_worker_process(exePath, args, process) == false) {
+			Con::cwar << "Failed to start render queue worker process!" << Con::endl;
+			continue;
+		}
+		g_workerProcesses.push_back(process);
+		++numStarted;
+	}
+	return numStarted;
+}
+
+void pragma::modules::scenekit::stop_render_queue_workers()
+{
+	for(auto &process : g_workerProcesses) {
+#ifdef _WIN32
+		TerminateProcess(process.handle, 0);
+		WaitForSingleObject(process.handle, INFINITE);
+		CloseHandle(process.handle);
+#else
+		kill(process.pid, SIGTERM);
+		waitpid(process.pid, nullptr, 0);
+#endif
+	}
+	g_workerProcesses.clear();
+}
+
+void pragma::modules::scenekit::detach_render_queue_workers()
+{
+#ifdef _WIN32
+	for(auto &process : g_workerProcesses)
+		CloseHandle(process.handle);
+#endif
+	g_workerProcesses.clear();
+}
+
+uint32_t pragma::modules::scenekit::get_render_queue_worker_count()
+{
+	// Forget about processes that have exited on their own
+	g_workerProcesses.erase(std::remove_if(g_workerProcesses.begin(), g_workerProcesses.end(),
+	                          [](WorkerProcess &process) {
+#ifdef _WIN32
+		                          if(WaitForSingleObject(process.handle, 0) != WAIT_OBJECT_0)
+			                          return false;
+		                          CloseHandle(process.handle);
+		                          return true;
+#else
+		                          return waitpid(process.pid, nullptr, WNOHANG) == process.pid;
+#endif
+	                          }),
+	  g_workerProcesses.end());
+	return static_cast<uint32_t>(g_workerProcesses.size());
+}
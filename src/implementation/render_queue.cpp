@@ -0,0 +1,455 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <sharedutils/util_file.h>
+#include <mathutil/umath.h>
+#undef __UTIL_STRING_H__
+#include <sharedutils/util_string.h>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <random>
+#include <mutex>
+#include <array>
+#include <algorithm>
+#include <cinttypes>
+#include <cstdlib>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+module pragma.modules.scenekit;
+
+import :render_queue;
+import :split_render;
+
+using namespace pragma::modules::scenekit;
+
+static constexpr uint32_t RENDER_QUEUE_FILE_VERSION = 1;
+static constexpr const char *JOB_INFO_FILE_NAME = "job.txt";
+static constexpr const char *JOB_STATUS_FILE_NAME = "status.txt";
+static constexpr const char *JOB_LOCK_FILE_NAME = "lock";
+
+static constexpr std::array<const char *, 5> JOB_STATE_NAMES = {"submitting", "queued", "rendering", "complete", "failed"};
+
+bool pragma::modules::scenekit::is_valid_render_queue_output_file_name(const std::string &fileName)
+{
+	if(fileName.empty() || fileName.find("..") != std::string::npos)
+		return false;
+	return fileName.find_first_of("/\\:") == std::string::npos;
+}
+
+std::unique_ptr<RenderQueueLock> RenderQueueLock::TryAcquire(const std::string &absPath) { return Acquire(absPath, false); }
+std::unique_ptr<RenderQueueLock> RenderQueueLock::Acquire(const std::string &absPath) { return Acquire(absPath, true); }
+
+std::unique_ptr<RenderQueueLock> RenderQueueLock::Acquire(const std::string &absPath, bool wait)
+{
+	auto lock = std::unique_ptr<RenderQueueLock> {new RenderQueueLock {}};
+#ifdef _WIN32
+	auto hFile = CreateFileA(absPath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(hFile == INVALID_HANDLE_VALUE)
+		return nullptr;
+	OVERLAPPED overlapped {};
+	if(LockFileEx(hFile, LOCKFILE_EXCLUSIVE_LOCK | (wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY), 0, 1, 0, &overlapped) == FALSE) {
+		CloseHandle(hFile);
+		return nullptr;
+	}
+	lock->m_handle = hFile;
+#else
+	auto fd = open(absPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(fd == -1)
+		return nullptr;
+	if(flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB)) != 0) {
+		close(fd);
+		return nullptr;
+	}
+	lock->m_fd = fd;
+#endif
+	return lock;
+}
+
+RenderQueueLock::~RenderQueueLock()
+{
+#ifdef _WIN32
+	if(m_handle)
+		CloseHandle(static_cast<HANDLE>(m_handle));
+#else
+	if(m_fd != -1)
+		close(m_fd);
+#endif
+}
+
+RenderQueue::RenderQueue(const std::string &absSpoolPath) : m_spoolPath {absSpoolPath}
+{
+	if(!m_spoolPath.empty() && m_spoolPath.back() != '/' && m_spoolPath.back() != '\\')
+		m_spoolPath += '/';
+}
+
+std::string RenderQueue::GetJobPath(const std::string &jobId) const { return m_spoolPath + jobId + '/'; }
+
+std::string RenderQueue::GetSplitPartJobId(const std::string &splitJobId, uint32_t index) const
+{
+	std::array<char, 16> suffix;
+	snprintf(suffix.data(), suffix.size(), "-part%04" PRIu32, index);
+	return splitJobId + suffix.data();
+}
+
+std::string RenderQueue::GetCheckpointPath(const std::string &jobId, uint32_t index) const
+{
+	std::array<char, 32> fileName;
+	snprintf(fileName.data(), fileName.size(), "checkpoint%04" PRIu32 ".pls", index);
+	return GetJobPath(jobId) + fileName.data();
+}
+
+std::string RenderQueue::CreateJobId() const
+{
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	static std::mt19937_64 rng {std::random_device {}()};
+	static std::mutex rngMutex;
+	uint32_t suffix;
+	{
+		std::scoped_lock lock {rngMutex};
+		suffix = static_cast<uint32_t>(rng());
+	}
+	std::array<char, 32> id;
+	snprintf(id.data(), id.size(), "%013" PRId64 "-%08" PRIx32, static_cast<int64_t>(ms), suffix);
+	return id.data();
+}
+
+std::vector<std::string> RenderQueue::GetJobIds() const
+{
+	std::vector<std::string> ids;
+	std::error_code ec;
+	for(auto it = std::filesystem::directory_iterator {m_spoolPath, ec}; !ec && it != std::filesystem::directory_iterator {}; it.increment(ec)) {
+		if(it->is_directory(ec))
+			ids.push_back(it->path().filename().string());
+	}
+	std::sort(ids.begin(), ids.end());
+	return ids;
+}
+
+// Key-value files are replaced atomically, so a reader never sees a partially written file
+static bool write_key_values(const std::string &path, const std::vector<std::pair<std::string, std::string>> &values)
+{
+	std::stringstream ss;
+	ss << "version " << RENDER_QUEUE_FILE_VERSION << "\n";
+	for(auto &[key, value] : values)
+		ss << key << " " << value << "\n";
+	std::error_code ec;
+	std::filesystem::create_directories(ufile::get_path_from_filename(path), ec);
+	auto tmpPath = path + ".tmp";
+	{
+		std::ofstream f {tmpPath, std::ios::trunc};
+		if(!f)
+			return false;
+		f << ss.str();
+		if(!f)
+			return false;
+	}
+	std::filesystem::rename(tmpPath, path, ec);
+	return !ec;
+}
+
+static std::optional<std::vector<std::pair<std::string, std::string>>> read_key_values(const std::string &path)
+{
+	std::ifstream f {path};
+	if(!f)
+		return {};
+	std::string line;
+	if(!std::getline(f, line) || line != "version " + std::to_string(RENDER_QUEUE_FILE_VERSION))
+		return {};
+	std::vector<std::pair<std::string, std::string>> values;
+	while(std::getline(f, line)) {
+		auto sep = line.find(' ');
+		if(sep == std::string::npos)
+			values.push_back({line, ""});
+		else
+			values.push_back({line.substr(0, sep), line.substr(sep + 1)});
+	}
+	return values;
+}
+
+bool RenderQueue::WriteJobInfo(const std::string &jobId, const RenderQueueJobInfo &info) const
+{
+	std::vector<std::pair<std::string, std::string>> values {{"name", info.name}, {"renderer", info.renderer}, {"output", info.outputFileName}};
+	if(info.splitCount > 0)
+		values.push_back({"split_count", std::to_string(info.splitCount)});
+	if(info.checkpointCount > 0)
+		values.push_back({"checkpoint_count", std::to_string(info.checkpointCount)});
+	if(info.splitCount > 0 || info.checkpointCount > 0) {
+		values.push_back({"horizontal_range", std::to_string(info.horizontalRange)});
+		values.push_back({"denoise", info.denoise ? "1" : "0"});
+	}
+	if(info.splitJobId.empty() == false) {
+		values.push_back({"split_job", info.splitJobId});
+		values.push_back({"split_index", std::to_string(info.splitIndex)});
+	}
+	return write_key_values(GetJobPath(jobId) + JOB_INFO_FILE_NAME, values);
+}
+
+std::optional<RenderQueueJobInfo> RenderQueue::ReadJobInfo(const std::string &jobId) const
+{
+	auto values = read_key_values(GetJobPath(jobId) + JOB_INFO_FILE_NAME);
+	if(values.has_value() == false)
+		return {};
+	RenderQueueJobInfo info {};
+	for(auto &[key, value] : *values) {
+		if(key == "name")
+			info.name = value;
+		else if(key == "renderer")
+			info.renderer = value;
+		else if(key == "output")
+			info.outputFileName = value;
+		else if(key == "split_count")
+			info.splitCount = static_cast<uint32_t>(std::strtoul(value.c_str(), nullptr, 10));
+		else if(key == "checkpoint_count")
+			info.checkpointCount = static_cast<uint32_t>(std::strtoul(value.c_str(), nullptr, 10));
+		else if(key == "horizontal_range")
+			info.horizontalRange = std::strtof(value.c_str(), nullptr);
+		else if(key == "denoise")
+			info.denoise = (value == "1");
+		else if(key == "split_job")
+			info.splitJobId = value;
+		else if(key == "split_index")
+			info.splitIndex = static_cast<uint32_t>(std::strtoul(value.c_str(), nullptr, 10));
+	}
+	return info;
+}
+
+bool RenderQueue::WriteJobStatus(const std::string &jobId, const RenderQueueJobStatus &status) const
+{
+	std::vector<std::pair<std::string, std::string>> values {{"state", JOB_STATE_NAMES[umath::to_integral(status.state)]}, {"progress", std::to_string(status.progress)}};
+	if(status.message.empty() == false) {
+		// Messages have to fit on a single line
+		auto msg = status.message;
+		std::replace(msg.begin(), msg.end(), '\n', ' ');
+		values.push_back({"message", msg});
+	}
+	for(auto &file : status.outputFiles)
+		values.push_back({"output", file});
+	if(status.attempts > 0)
+		values.push_back({"attempts", std::to_string(status.attempts)});
+	return write_key_values(GetJobPath(jobId) + JOB_STATUS_FILE_NAME, values);
+}
+
+std::optional<RenderQueueJobStatus> RenderQueue::ReadJobStatus(const std::string &jobId) const
+{
+	auto values = read_key_values(GetJobPath(jobId) + JOB_STATUS_FILE_NAME);
+	if(values.has_value() == false)
+		return {};
+	RenderQueueJobStatus status {};
+	for(auto &[key, value] : *values) {
+		if(key == "state") {
+			auto it = std::find_if(JOB_STATE_NAMES.begin(), JOB_STATE_NAMES.end(), [&value](const char *name) { return value == name; });
+			if(it == JOB_STATE_NAMES.end())
+				return {};
+			status.state = static_cast<RenderQueueJobState>(it - JOB_STATE_NAMES.begin());
+		}
+		else if(key == "progress")
+			status.progress = std::strtof(value.c_str(), nullptr);
+		else if(key == "message")
+			status.message = value;
+		else if(key == "output")
+			status.outputFiles.push_back(value);
+		else if(key == "attempts")
+			status.attempts = static_cast<uint32_t>(std::strtoul(value.c_str(), nullptr, 10));
+	}
+	return status;
+}
+
+std::optional<RenderQueue::ClaimedJob> RenderQueue::ClaimNextJob() const
+{
+	for(auto &jobId : GetJobIds()) {
+		auto status = ReadJobStatus(jobId);
+		if(status.has_value() == false || (status->state != RenderQueueJobState::Queued && status->state != RenderQueueJobState::Rendering))
+			continue;
+		auto lock = RenderQueueLock::TryAcquire(GetJobPath(jobId) + JOB_LOCK_FILE_NAME);
+		if(lock == nullptr)
+			continue; // Another worker is rendering this job
+		// The job may have been completed by another worker between reading the status and acquiring the lock
+		status = ReadJobStatus(jobId);
+		if(status.has_value() == false || (status->state != RenderQueueJobState::Queued && status->state != RenderQueueJobState::Rendering))
+			continue;
+		auto info = ReadJobInfo(jobId);
+		if(info.has_value() == false)
+			continue;
+		if(info->splitCount > 0) {
+			// Split jobs are rendered through their parts. Normally the worker that completes the last part merges them,
+			// this only catches merges that were interrupted.
+			CompleteSplitJob(jobId, *info);
+			continue;
+		}
+		std::optional<std::string> err {};
+		if(is_valid_render_queue_output_file_name(info->outputFileName) == false)
+			err = "Invalid output file name '" + info->outputFileName + "'";
+		else if(status->attempts >= RENDER_QUEUE_MAX_JOB_ATTEMPTS)
+			err = "The job was interrupted " + std::to_string(status->attempts) + " times, the worker has most likely crashed while rendering it";
+		if(err.has_value()) {
+			RenderQueueJobStatus failedStatus {};
+			failedStatus.state = RenderQueueJobState::Failed;
+			failedStatus.message = *err;
+			failedStatus.attempts = status->attempts;
+			WriteJobStatus(jobId, failedStatus);
+			lock = nullptr;
+			// The split job fails with its part
+			if(info->splitJobId.empty() == false)
+				TryCompleteSplitJob(info->splitJobId);
+			continue;
+		}
+		RenderQueueJobStatus claimedStatus {};
+		claimedStatus.state = RenderQueueJobState::Rendering;
+		claimedStatus.attempts = status->attempts + 1;
+		if(WriteJobStatus(jobId, claimedStatus) == false)
+			continue;
+		return ClaimedJob {jobId, std::move(*info), std::move(claimedStatus), std::move(lock)};
+	}
+	return {};
+}
+
+bool RenderQueue::RemoveJob(const std::string &jobId) const
+{
+	auto info = ReadJobInfo(jobId);
+	if(info.has_value() && info->splitCount > 0) {
+		for(auto i = decltype(info->splitCount) {0u}; i < info->splitCount; ++i) {
+			if(RemoveJob(GetSplitPartJobId(jobId, i)) == false)
+				return false;
+		}
+	}
+	auto jobPath = GetJobPath(jobId);
+	std::error_code ec;
+	{
+		auto lock = RenderQueueLock::TryAcquire(jobPath + JOB_LOCK_FILE_NAME);
+		if(lock == nullptr)
+			return false;
+		// The contents are removed while the lock is held, so no worker can claim the job in the meantime. The status is removed first,
+		// so a worker that acquires the lock between releasing it and removing the directory doesn't consider the job claimable.
+		std::filesystem::remove(jobPath + JOB_STATUS_FILE_NAME, ec);
+		if(ec)
+			return false;
+		std::vector<std::filesystem::path> paths;
+		for(auto it = std::filesystem::directory_iterator {jobPath, ec}; !ec && it != std::filesystem::directory_iterator {}; it.increment(ec)) {
+			// The lock file can't be removed while it's open on all platforms
+			if(it->path().filename() != JOB_LOCK_FILE_NAME)
+				paths.push_back(it->path());
+		}
+		for(auto &path : paths)
+			std::filesystem::remove_all(path, ec);
+	}
+	std::filesystem::remove_all(jobPath, ec);
+	return !ec;
+}
+
+bool RenderQueue::ResumeJob(const std::string &jobId) const
+{
+	auto info = ReadJobInfo(jobId);
+	if(info.has_value() == false)
+		return false;
+	// Each status is only checked and rewritten while the job's lock is held, so a worker can't claim or finish the job in between
+	auto requeue = [this](const std::string &jobId, RenderQueueJobState state) -> bool {
+		auto lock = RenderQueueLock::Acquire(GetJobPath(jobId) + JOB_LOCK_FILE_NAME);
+		if(lock == nullptr)
+			return false;
+		auto status = ReadJobStatus(jobId);
+		if(status.has_value() == false || status->state != RenderQueueJobState::Failed)
+			return false;
+		RenderQueueJobStatus queuedStatus {};
+		queuedStatus.state = state;
+		return WriteJobStatus(jobId, queuedStatus);
+	};
+	if(info->splitCount > 0) {
+		// The parts may have all been complete already, in which case only the merge has failed
+		if(requeue(jobId, RenderQueueJobState::Rendering) == false)
+			return false;
+		for(auto i = decltype(info->splitCount) {0u}; i < info->splitCount; ++i)
+			requeue(GetSplitPartJobId(jobId, i), RenderQueueJobState::Queued);
+		TryCompleteSplitJob(jobId);
+		return true;
+	}
+	return requeue(jobId, RenderQueueJobState::Queued);
+}
+
+bool RenderQueue::TryCompleteSplitJob(const std::string &splitJobId) const
+{
+	auto info = ReadJobInfo(splitJobId);
+	if(info.has_value() == false || info->splitCount == 0)
+		return false;
+	// Only one worker may merge the parts. The lock has to be waited for, not just tried: Another worker may be checking the parts
+	// right now and not see the part that was just completed, in which case nobody would merge them.
+	auto lock = RenderQueueLock::Acquire(GetJobPath(splitJobId) + JOB_LOCK_FILE_NAME);
+	if(lock == nullptr)
+		return false;
+	return CompleteSplitJob(splitJobId, *info);
+}
+
+bool RenderQueue::CompleteSplitJob(const std::string &splitJobId, const RenderQueueJobInfo &info) const
+{
+	auto status = ReadJobStatus(splitJobId);
+	if(status.has_value() == false || status->state == RenderQueueJobState::Complete || status->state == RenderQueueJobState::Failed)
+		return false;
+
+	auto fail = [this, &splitJobId](const std::string &msg) {
+		RenderQueueJobStatus status {};
+		status.state = RenderQueueJobState::Failed;
+		status.message = msg;
+		WriteJobStatus(splitJobId, status);
+		return true;
+	};
+	for(auto i = decltype(info.splitCount) {0u}; i < info.splitCount; ++i) {
+		auto partStatus = ReadJobStatus(GetSplitPartJobId(splitJobId, i));
+		if(partStatus.has_value() && partStatus->state == RenderQueueJobState::Failed)
+			return fail("Part " + std::to_string(i) + " failed: " + partStatus->message);
+		if(partStatus.has_value() == false || partStatus->state != RenderQueueJobState::Complete)
+			return false; // Not all parts are complete yet
+	}
+	if(is_valid_render_queue_output_file_name(info.outputFileName) == false)
+		return fail("Invalid output file name '" + info.outputFileName + "'");
+	// Interrupted merges are retried by ClaimNextJob, a merge that keeps crashing the worker has to fail eventually
+	if(status->attempts >= RENDER_QUEUE_MAX_JOB_ATTEMPTS)
+		return fail("The merge was interrupted " + std::to_string(status->attempts) + " times, the worker has most likely crashed while merging");
+	auto mergingStatus = *status;
+	++mergingStatus.attempts;
+	WriteJobStatus(splitJobId, mergingStatus);
+
+	std::vector<uimg::ImageLayerSet> parts;
+	parts.reserve(info.splitCount);
+	for(auto i = decltype(info.splitCount) {0u}; i < info.splitCount; ++i) {
+		std::string err;
+		auto part = read_image_layer_set(GetJobPath(GetSplitPartJobId(splitJobId, i)) + RENDER_QUEUE_PART_FILE_NAME, err);
+		if(part.has_value() == false)
+			return fail(err);
+		parts.push_back(std::move(*part));
+	}
+
+	std::string err;
+	auto merged = merge_split_renders(parts, err);
+	if(merged.has_value() == false)
+		return fail(err);
+	parts.clear();
+	if(info.denoise && denoise_image_layer_set(*merged) == false)
+		return fail("Denoising failed");
+	std::vector<std::string> files;
+	auto jobPath = GetJobPath(splitJobId);
+	if(write_image_layers(*merged, jobPath + info.outputFileName, files, err) == false)
+		return fail(err);
+	RenderQueueJobStatus completeStatus {};
+	completeStatus.state = RenderQueueJobState::Complete;
+	completeStatus.progress = 1.f;
+	for(auto &f : files)
+		completeStatus.outputFiles.push_back(f.substr(jobPath.size()));
+	WriteJobStatus(splitJobId, completeStatus);
+	return true;
+}
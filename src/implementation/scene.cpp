@@ -43,6 +43,8 @@ module pragma.modules.scenekit;
 import pragma.scenekit;
 import :scene;
 import :shader;
+import :texture;
+import :progressive_refinement;
 
 using namespace pragma::modules;
 
@@ -113,7 +115,39 @@ void scenekit::Scene::SetAOBakeTarget(Model &mdl, uint32_t matIndex)
 	m_rtScene->SetBakeTarget(*oAo);
 }
 
+void scenekit::Scene::SetAOBakeTarget(const Cache &meshCache, const Cache::AOBakeMesh &target, const std::vector<pragma::scenekit::PMesh> &occluders)
+{
+	// The meshes belong to the shader cache of meshCache, so they're added through a separate model cache.
+	// The bake target has to be the first mesh added to the scene (see Cache::AddAOBakeTarget).
+	auto mdlCache = pragma::scenekit::ModelCache::Create();
+	mdlCache->AddChunk(meshCache.GetShaderCache());
+	auto &chunk = mdlCache->GetChunks().front();
+	chunk.AddMesh(*target.mesh);
+	auto oAo = pragma::scenekit::Object::Create(*target.mesh);
+	chunk.AddObject(*oAo);
+	for(auto &mesh : occluders) {
+		chunk.AddMesh(*mesh);
+		auto oEnv = pragma::scenekit::Object::Create(*mesh);
+		chunk.AddObject(*oEnv);
+	}
+	m_rtScene->AddModelsFromCache(*mdlCache);
+	m_rtScene->SetBakeTarget(*oAo);
+}
+
+void scenekit::Scene::SetAdaptiveBakeSettings(const AdaptiveBakeSettings &settings)
+{
+	m_rtScene->SetAdaptiveSampling(true, settings.noiseThreshold, settings.minSamples);
+}
+
 scenekit::Cache &scenekit::Scene::GetCache() { return *m_cache; }
+void scenekit::Scene::SetMaxTextureDimension(uint32_t maxDimension) { m_cache->SetMaxTextureDimension(maxDimension); }
+uint32_t scenekit::Scene::GetMaxTextureDimension() const { return m_cache->GetMaxTextureDimension(); }
+void scenekit::Scene::SetPreview(bool preview)
+{
+	m_preview = preview;
+	auto resolution = m_rtScene->GetResolution();
+	SetMaxTextureDimension(preview ? calc_preview_max_texture_dimension(resolution.x, resolution.y) : 0);
+}
 
 void scenekit::Scene::Finalize()
 {
@@ -140,6 +174,122 @@ pragma::scenekit::Object *scenekit::Scene::FindObject(const std::string &name)
 
 scenekit::Renderer::Renderer(Scene &scene, pragma::scenekit::Renderer &renderer) : m_scene {scene.shared_from_this()}, m_renderer {renderer.shared_from_this()} {}
 
+void scenekit::Renderer::SetProgressiveTexture(const std::shared_ptr<ProgressiveTexture> &texture) { m_progressiveTexture = texture; }
+
+void scenekit::Renderer::Restart()
+{
+	auto texture = m_progressiveTexture.lock();
+	if(texture) {
+		texture->Restart();
+		return;
+	}
+	m_renderer->Restart();
+}
+
+void scenekit::Renderer::NotifySceneEdited()
+{
+	auto texture = m_progressiveTexture.lock();
+	if(texture)
+		texture->NotifySceneEdited();
+}
+
+scenekit::Renderer::~Renderer()
+{
+	if(m_cbSyncActors.IsValid())
+		m_cbSyncActors.Remove();
+	for(auto &[uuid, callbacks] : m_watchedActors) {
+		for(auto &cb : callbacks) {
+			if(cb.IsValid())
+				cb.Remove();
+		}
+	}
+}
+
+void scenekit::Renderer::SetActorSyncFunctions(const ActorSyncFunction &syncFunction, const ActorWatchFunction &watchFunction)
+{
+	m_actorSyncFunction = syncFunction;
+	m_actorWatchFunction = watchFunction;
+}
+
+void scenekit::Renderer::UpdateSyncCallback()
+{
+	auto needsCallback = !m_dirtyActors.empty();
+	if(needsCallback == m_cbSyncActors.IsValid())
+		return;
+	if(needsCallback == false) {
+		m_cbSyncActors.Remove();
+		return;
+	}
+	m_cbSyncActors = c_engine->AddCallback("Think", FunctionCallback<void>::Create([this]() { SyncDirtyActors(); }));
+}
+
+void scenekit::Renderer::MarkActorDirty(BaseEntity &ent)
+{
+	m_dirtyActors[ent.GetUuid()] = ent.GetHandle();
+	UpdateSyncCallback();
+}
+
+void scenekit::Renderer::WatchActor(BaseEntity &ent)
+{
+	if(!m_actorWatchFunction)
+		return;
+	UnwatchActor(ent);
+	// The current state is assumed to be synchronized already, the entity is only marked as dirty once it changes
+	auto hEnt = ent.GetHandle();
+	m_watchedActors[ent.GetUuid()] = m_actorWatchFunction(ent, [this, hEnt]() {
+		if(hEnt.valid())
+			MarkActorDirty(*hEnt.get());
+	});
+}
+
+void scenekit::Renderer::UnwatchActor(BaseEntity &ent)
+{
+	auto it = m_watchedActors.find(ent.GetUuid());
+	if(it == m_watchedActors.end())
+		return;
+	for(auto &cb : it->second) {
+		if(cb.IsValid())
+			cb.Remove();
+	}
+	m_watchedActors.erase(it);
+}
+
+uint32_t scenekit::Renderer::SyncActors(const std::vector<BaseEntity *> &ents)
+{
+	if(!m_actorSyncFunction || ents.empty() || m_renderer->BeginSceneEdit() == false)
+		return 0;
+	// All actors are staged first and only committed afterwards, so the renderer receives the changes of all entities
+	// together instead of resetting the render after every individual entity
+	std::vector<BaseEntity *> staged;
+	staged.reserve(ents.size());
+	for(auto *ent : ents) {
+		if(ent && m_actorSyncFunction(*m_renderer, *ent))
+			staged.push_back(ent);
+	}
+	uint32_t numSynced = 0;
+	for(auto *ent : staged) {
+		if(m_renderer->SyncEditedActor(ent->GetUuid()))
+			++numSynced;
+	}
+	m_renderer->EndSceneEdit();
+	if(numSynced > 0)
+		NotifySceneEdited();
+	return numSynced;
+}
+
+uint32_t scenekit::Renderer::SyncDirtyActors()
+{
+	std::vector<BaseEntity *> ents;
+	ents.reserve(m_dirtyActors.size());
+	for(auto &[uuid, hEnt] : m_dirtyActors) {
+		if(hEnt.valid())
+			ents.push_back(hEnt.get());
+	}
+	m_dirtyActors.clear();
+	UpdateSyncCallback();
+	return SyncActors(ents);
+}
+
 void scenekit::Renderer::ReloadShaders()
 {
 	// Can only reload shaders that are part of this scene's parimary cache
@@ -245,6 +395,7 @@ void scenekit::Scene::BuildLightMapObject()
 		uvOffset += verts.size();
 		++idx;
 	}
+
 	mesh->SetLightmapUVs(std::move(cclLightmapUvs));
 	m_rtScene->SetBakeTarget(*o);
 }
@@ -274,6 +425,8 @@ pragma::scenekit::PShader scenekit::Cache::CreateShader(Material &mat, const std
 	if(ustring::compare<std::string>(cyclesShader, "nodraw", false))
 		return nullptr;
 
+	// The shaders request their textures while they're being initialized
+	MaxTextureDimensionScope maxTexDimensionScope {m_maxTextureDimension};
 	auto shader = shaderManager.CreateShader(get_node_manager(), cyclesShader, shaderInfo.entity.has_value() ? *shaderInfo.entity : nullptr, shaderInfo.subMesh.has_value() ? *shaderInfo.subMesh : nullptr, mat);
 	if(shader == nullptr)
 		return nullptr;
@@ -0,0 +1,472 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <sharedutils/datastream.h>
+#include <sharedutils/util_file.h>
+#include <mathutil/umath.h>
+#include <udm.hpp>
+#include <filesystem>
+#include <cstring>
+#include <cinttypes>
+#include <array>
+#include <mutex>
+#include <algorithm>
+#include <random>
+#include <unordered_set>
+#include <limits>
+
+module pragma.modules.scenekit;
+
+import pragma.scenekit;
+import :serialization;
+import :asset_store;
+
+using namespace pragma::modules::scenekit;
+
+std::unique_ptr<StreamingFileWriter> StreamingFileWriter::Open(const std::string &absPath, const Settings &settings)
+{
+	std::error_code ec;
+	std::filesystem::create_directories(ufile::get_path_from_filename(absPath), ec);
+	auto writer = std::unique_ptr<StreamingFileWriter> {new StreamingFileWriter {absPath, settings}};
+	if(!writer->m_file)
+		return nullptr;
+	return writer;
+}
+
+// Multiple writers (threads or processes) may write the same file concurrently, so each one needs its own temporary file
+static std::string get_unique_tmp_path(const std::string &absPath)
+{
+	static std::mutex mutex;
+	static std::mt19937_64 rng {std::random_device {}()};
+	uint64_t id;
+	{
+		std::scoped_lock lock {mutex};
+		id = rng();
+	}
+	std::array<char, 17> str;
+	snprintf(str.data(), str.size(), "%016" PRIx64, id);
+	return absPath + '.' + str.data() + ".tmp";
+}
+
+StreamingFileWriter::StreamingFileWriter(const std::string &absPath, const Settings &settings) : m_path {absPath}, m_tmpPath {get_unique_tmp_path(absPath)}, m_settings {settings}
+{
+	m_settings.chunkSize = umath::max(m_settings.chunkSize, static_cast<size_t>(1));
+	m_settings.maxQueuedChunks = umath::max(m_settings.maxQueuedChunks, 1u);
+	m_file.open(m_tmpPath, std::ios::binary | std::ios::trunc);
+	m_chunk.reserve(m_settings.chunkSize);
+	if(m_settings.backgroundThread && m_file) {
+		m_writerRunning = true;
+		m_thread = std::thread {[this]() { RunWriter(); }};
+	}
+}
+
+StreamingFileWriter::~StreamingFileWriter() { Close(); }
+
+void StreamingFileWriter::Write(const void *data, size_t size)
+{
+	auto *bytes = static_cast<const uint8_t *>(data);
+	while(size > 0) {
+		if(m_thread.joinable() == false && m_chunk.empty() && size >= m_settings.chunkSize) {
+			// Full chunks that are written on this thread anyway don't have to be copied into the chunk buffer first
+			if(m_file.write(reinterpret_cast<const char *>(bytes), m_settings.chunkSize))
+				m_bytesWritten += m_settings.chunkSize;
+			else
+				m_failed = true;
+			bytes += m_settings.chunkSize;
+			size -= m_settings.chunkSize;
+			continue;
+		}
+		auto n = umath::min(size, m_settings.chunkSize - m_chunk.size());
+		m_chunk.insert(m_chunk.end(), bytes, bytes + n);
+		bytes += n;
+		size -= n;
+		if(m_chunk.size() == m_settings.chunkSize)
+			SubmitChunk();
+	}
+}
+
+void StreamingFileWriter::SubmitChunk()
+{
+	if(m_chunk.empty())
+		return;
+	if(m_thread.joinable() == false) {
+		WriteChunk(m_chunk);
+		m_chunk.clear();
+		return;
+	}
+	std::unique_lock lock {m_queueMutex};
+	m_queueCondition.wait(lock, [this]() { return m_queue.size() < m_settings.maxQueuedChunks; });
+	m_queue.push(std::move(m_chunk));
+	lock.unlock();
+	m_queueCondition.notify_all();
+	m_chunk = {};
+	m_chunk.reserve(m_settings.chunkSize);
+}
+
+void StreamingFileWriter::WriteChunk(const std::vector<uint8_t> &chunk)
+{
+	m_file.write(reinterpret_cast<const char *>(chunk.data()), chunk.size());
+	if(!m_file)
+		m_failed = true;
+	else
+		m_bytesWritten += chunk.size();
+}
+
+void StreamingFileWriter::RunWriter()
+{
+	for(;;) {
+		std::vector<uint8_t> chunk;
+		{
+			std::unique_lock lock {m_queueMutex};
+			m_queueCondition.wait(lock, [this]() { return m_queue.empty() == false || m_writerRunning == false; });
+			if(m_queue.empty())
+				return;
+			chunk = std::move(m_queue.front());
+			m_queue.pop();
+		}
+		m_queueCondition.notify_all();
+		WriteChunk(chunk);
+	}
+}
+
+void StreamingFileWriter::Patch(uint64_t offset, const void *data, size_t size)
+{
+	auto *bytes = static_cast<const uint8_t *>(data);
+	m_patches.push_back({offset, std::vector<uint8_t>(bytes, bytes + size)});
+}
+
+bool StreamingFileWriter::Close()
+{
+	if(m_closed)
+		return !m_failed;
+	m_closed = true;
+	SubmitChunk();
+	if(m_thread.joinable()) {
+		{
+			std::unique_lock lock {m_queueMutex};
+			m_writerRunning = false;
+		}
+		m_queueCondition.notify_all();
+		m_thread.join();
+	}
+	for(auto &patch : m_patches) {
+		m_file.seekp(patch.offset);
+		m_file.write(reinterpret_cast<const char *>(patch.data.data()), patch.data.size());
+	}
+	m_file.close();
+	std::error_code ec;
+	if(m_failed || !m_file) {
+		m_failed = true;
+		std::filesystem::remove(m_tmpPath, ec);
+		return false;
+	}
+	std::filesystem::rename(m_tmpPath, m_path, ec);
+	if(ec) {
+		m_failed = true;
+		std::filesystem::remove(m_tmpPath, ec);
+	}
+	return !m_failed;
+}
+
+namespace {
+	constexpr std::array<char, 4> RENDER_JOB_FILE_MAGIC = {'P', 'R', 'T', 'C'};
+	enum class RenderJobFileFlags : uint32_t { None = 0u };
+	struct RenderJobFileHeader {
+		std::array<char, 4> magic = RENDER_JOB_FILE_MAGIC;
+		uint32_t version = RENDER_JOB_FILE_VERSION;
+		uint32_t sectionCount = 0;
+		RenderJobFileFlags flags = RenderJobFileFlags::None;
+	};
+	struct RenderJobSectionHeader {
+		RenderJobSectionType type = RenderJobSectionType::Scene;
+		RenderJobCompression compression = RenderJobCompression::None;
+		uint64_t offset = 0;
+		uint64_t size = 0;
+		uint64_t uncompressedSize = 0;
+		uint32_t blockSize = 0;
+		uint32_t reserved = 0;
+	};
+	static_assert(sizeof(RenderJobFileHeader) == 16 && sizeof(RenderJobSectionHeader) == 40);
+};
+
+static RenderJobFileSettings g_renderJobFileSettings {};
+void pragma::modules::scenekit::set_render_job_file_settings(const RenderJobFileSettings &settings) { g_renderJobFileSettings = settings; }
+const RenderJobFileSettings &pragma::modules::scenekit::get_render_job_file_settings() { return g_renderJobFileSettings; }
+
+bool pragma::modules::scenekit::write_render_job_file(const std::string &absPath, const void *sceneData, size_t sceneDataSize, const RenderJobFileSettings &settings, bool backgroundThread)
+{
+	StreamingFileWriter::Settings writerSettings {};
+	writerSettings.backgroundThread = backgroundThread;
+	if(settings.legacyFormat) {
+		auto writer = StreamingFileWriter::Open(absPath, writerSettings);
+		if(writer == nullptr)
+			return false;
+		writer->Write(sceneData, sceneDataSize);
+		return writer->Close();
+	}
+
+	RenderJobSectionHeader section {};
+	section.type = RenderJobSectionType::Scene;
+	section.compression = settings.useAssetStore ? RenderJobCompression::AssetStore : settings.compression;
+	section.uncompressedSize = sceneDataSize;
+
+	std::optional<std::vector<AssetStore::ChunkRef>> refs {};
+	if(section.compression == RenderJobCompression::AssetStore) {
+		AssetStore store {ufile::get_path_from_filename(absPath) + RENDER_JOB_ASSET_STORE_DIRECTORY};
+		refs = store.Put(sceneData, sceneDataSize);
+		if(refs.has_value() == false)
+			return false;
+	}
+
+	RenderJobFileHeader header {};
+	header.sectionCount = 1;
+	section.offset = sizeof(header) + sizeof(section);
+
+	auto writer = StreamingFileWriter::Open(absPath, writerSettings);
+	if(writer == nullptr)
+		return false;
+	writer->Write(&header, sizeof(header));
+	// The size of a compressed section is only known once all blocks have been written, the section header is patched afterwards
+	writer->Write(&section, sizeof(section));
+	auto *bytes = static_cast<const uint8_t *>(sceneData);
+	switch(section.compression) {
+	case RenderJobCompression::Lz4:
+		// Blocks are compressed independently (each prefixed with its compressed size) and written as soon as they're compressed,
+		// so neither the writer nor a reader ever has to hold more than one compressed block
+		section.blockSize = umath::max(settings.blockSize, 1u);
+		for(uint64_t offset = 0; offset < sceneDataSize; offset += section.blockSize) {
+			auto n = umath::min(static_cast<uint64_t>(section.blockSize), sceneDataSize - offset);
+			auto blob = udm::compress_lz4_blob(bytes + offset, n);
+			auto blockSize = static_cast<uint32_t>(blob.compressedData.size());
+			writer->Write(&blockSize, sizeof(blockSize));
+			writer->Write(blob.compressedData.data(), blob.compressedData.size());
+			section.size += sizeof(blockSize) + blockSize;
+		}
+		break;
+	case RenderJobCompression::AssetStore:
+		section.size = refs->size() * sizeof(AssetStore::ChunkRef);
+		writer->Write(refs->data(), section.size);
+		break;
+	default:
+		section.size = sceneDataSize;
+		writer->Write(sceneData, sceneDataSize);
+		break;
+	}
+	writer->Patch(sizeof(header), &section, sizeof(section));
+	return writer->Close();
+}
+
+std::unique_ptr<RenderJobFile> RenderJobFile::Open(const std::string &absPath, std::string &outErr)
+{
+	auto file = std::unique_ptr<RenderJobFile> {new RenderJobFile {}};
+	file->m_path = absPath;
+	file->m_file.open(absPath, std::ios::binary);
+	if(!file->m_file) {
+		outErr = "Unable to open file '" + absPath + "'";
+		return nullptr;
+	}
+	file->m_file.seekg(0, std::ios::end);
+	file->m_fileSize = file->m_file.tellg();
+	file->m_file.seekg(0, std::ios::beg);
+
+	RenderJobFileHeader header {};
+	if(file->m_fileSize >= sizeof(header))
+		file->m_file.read(reinterpret_cast<char *>(&header), sizeof(header));
+	if(file->m_fileSize < sizeof(header) || header.magic != RENDER_JOB_FILE_MAGIC) {
+		// Files written before the container format only contain the serialized scene
+		file->m_legacy = true;
+		file->m_sections.push_back({RenderJobSectionType::Scene, RenderJobCompression::None, 0, file->m_fileSize, file->m_fileSize, 0});
+		return file;
+	}
+	if(header.version == 0 || header.version > RENDER_JOB_FILE_VERSION) {
+		outErr = "Unsupported render job file version " + std::to_string(header.version);
+		return nullptr;
+	}
+	file->m_version = header.version;
+	file->m_sections.reserve(header.sectionCount);
+	for(auto i = decltype(header.sectionCount) {0u}; i < header.sectionCount; ++i) {
+		RenderJobSectionHeader sectionHeader {};
+		if(!file->m_file.read(reinterpret_cast<char *>(&sectionHeader), sizeof(sectionHeader)) || sectionHeader.offset > file->m_fileSize || sectionHeader.size > file->m_fileSize - sectionHeader.offset) {
+			outErr = "Render job file is truncated";
+			return nullptr;
+		}
+		file->m_sections.push_back({sectionHeader.type, sectionHeader.compression, sectionHeader.offset, sectionHeader.size, sectionHeader.uncompressedSize, sectionHeader.blockSize});
+	}
+	return file;
+}
+
+const RenderJobFile::Section *RenderJobFile::FindSection(RenderJobSectionType type) const
+{
+	auto it = std::find_if(m_sections.begin(), m_sections.end(), [type](const Section &section) { return section.type == type; });
+	return (it != m_sections.end()) ? &*it : nullptr;
+}
+
+std::optional<std::vector<uint8_t>> RenderJobFile::ReadSectionData(const Section &section, std::string &outErr)
+{
+	std::vector<uint8_t> data(section.size);
+	m_file.clear();
+	m_file.seekg(section.offset);
+	if(!m_file.read(reinterpret_cast<char *>(data.data()), data.size())) {
+		outErr = "Unable to read render job file section";
+		return {};
+	}
+	return data;
+}
+
+std::optional<DataStream> RenderJobFile::ReadSection(RenderJobSectionType type, std::string &outErr)
+{
+	auto *section = FindSection(type);
+	if(section == nullptr) {
+		outErr = "Render job file has no section of type " + std::to_string(umath::to_integral(type));
+		return {};
+	}
+	auto optData = ReadSectionData(*section, outErr);
+	if(optData.has_value() == false)
+		return {};
+	auto &data = *optData;
+	DataStream ds {};
+	switch(section->compression) {
+	case RenderJobCompression::None:
+		ds->Write(data.data(), data.size());
+		break;
+	case RenderJobCompression::Lz4:
+		{
+			auto corrupt = [&outErr]() -> std::optional<DataStream> {
+				outErr = "Render job file section is corrupt";
+				return {};
+			};
+			// The uncompressed size comes from the file, so it has to be plausible before anything is allocated for it.
+			// lz4 can't compress by more than a factor of 255, and every block takes at least its size prefix and one byte.
+			constexpr uint64_t maxLz4Ratio = 255;
+			if(section->blockSize == 0 || section->uncompressedSize > section->size * maxLz4Ratio || section->uncompressedSize > std::numeric_limits<uint32_t>::max())
+				return corrupt();
+			auto numBlocks = (section->uncompressedSize + section->blockSize - 1) / section->blockSize;
+			if(numBlocks * (sizeof(uint32_t) + 1) > section->size)
+				return corrupt();
+			// Blocks are decompressed straight into the stream
+			ds->Resize(static_cast<uint32_t>(section->uncompressedSize));
+			auto *uncompressed = static_cast<uint8_t *>(ds->GetData());
+			uint64_t readOffset = 0;
+			for(uint64_t offset = 0; offset < section->uncompressedSize; offset += section->blockSize) {
+				uint32_t compressedSize;
+				if(readOffset + sizeof(compressedSize) > data.size())
+					return corrupt();
+				memcpy(&compressedSize, data.data() + readOffset, sizeof(compressedSize));
+				readOffset += sizeof(compressedSize);
+				if(compressedSize > data.size() - readOffset)
+					return corrupt();
+				auto n = umath::min(static_cast<uint64_t>(section->blockSize), section->uncompressedSize - offset);
+				if(udm::decompress_lz4_blob(data.data() + readOffset, compressedSize, n, uncompressed + offset) == false)
+					return corrupt();
+				readOffset += compressedSize;
+			}
+			break;
+		}
+	case RenderJobCompression::AssetStore:
+		{
+			if(data.size() % sizeof(AssetStore::ChunkRef) != 0) {
+				outErr = "Render job file section is corrupt";
+				return {};
+			}
+			std::vector<AssetStore::ChunkRef> refs(data.size() / sizeof(AssetStore::ChunkRef));
+			memcpy(refs.data(), data.data(), data.size());
+			// Checked before the asset store allocates anything for the chunks
+			uint64_t totalSize = 0;
+			for(auto &ref : refs)
+				totalSize += ref.size;
+			if(totalSize != section->uncompressedSize || totalSize > std::numeric_limits<uint32_t>::max()) {
+				outErr = "Render job file section is corrupt";
+				return {};
+			}
+			AssetStore store {ufile::get_path_from_filename(m_path) + RENDER_JOB_ASSET_STORE_DIRECTORY};
+			auto uncompressed = store.Get(refs, outErr);
+			if(uncompressed.has_value() == false)
+				return {};
+			if(uncompressed->size() != section->uncompressedSize) {
+				outErr = "Render job file section is corrupt";
+				return {};
+			}
+			ds->Write(uncompressed->data(), uncompressed->size());
+			break;
+		}
+	default:
+		outErr = "Unsupported compression type " + std::to_string(umath::to_integral(section->compression));
+		return {};
+	}
+	ds->SetOffset(0);
+	return ds;
+}
+
+std::optional<DataStream> pragma::modules::scenekit::read_render_job_file(const std::string &absPath, std::string &outErr)
+{
+	auto file = RenderJobFile::Open(absPath, outErr);
+	if(file == nullptr)
+		return {};
+	return file->ReadSection(RenderJobSectionType::Scene, outErr);
+}
+
+bool pragma::modules::scenekit::convert_legacy_render_job(const std::string &absPath, std::string &outErr, const std::string &outAbsPath)
+{
+	auto file = RenderJobFile::Open(absPath, outErr);
+	if(file == nullptr)
+		return false;
+	if(file->IsLegacy() == false)
+		return true;
+	auto ds = file->ReadSection(RenderJobSectionType::Scene, outErr);
+	// The file has to be closed before it can be replaced
+	file = nullptr;
+	if(ds.has_value() == false)
+		return false;
+	auto settings = get_render_job_file_settings();
+	settings.legacyFormat = false;
+	if(write_render_job_file(outAbsPath.empty() ? absPath : outAbsPath, (*ds)->GetData(), (*ds)->GetInternalSize(), settings) == false) {
+		outErr = "Unable to write render job file";
+		return false;
+	}
+	return true;
+}
+
+std::optional<uint32_t> pragma::modules::scenekit::collect_render_job_asset_store_garbage(const std::string &absDirectory, std::string &outErr, std::chrono::seconds minAge)
+{
+	auto dir = absDirectory;
+	if(!dir.empty() && dir.back() != '/' && dir.back() != '\\')
+		dir += '/';
+	std::vector<AssetStore::Hash> referencedBlobs;
+	std::error_code ec;
+	for(auto it = std::filesystem::directory_iterator {dir, ec}; !ec && it != std::filesystem::directory_iterator {}; it.increment(ec)) {
+		if(!it->is_regular_file(ec) || it->path().extension() != ".prt")
+			continue;
+		// If any of the files can't be read, the blobs it references are unknown and nothing may be removed
+		auto path = it->path().string();
+		auto file = RenderJobFile::Open(path, outErr);
+		if(file == nullptr) {
+			outErr = "Unable to open render job file '" + path + "': " + outErr;
+			return {};
+		}
+		for(auto &section : file->GetSections()) {
+			if(section.compression != RenderJobCompression::AssetStore)
+				continue;
+			auto data = file->ReadSectionData(section, outErr);
+			if(data.has_value() == false || data->size() % sizeof(AssetStore::ChunkRef) != 0) {
+				outErr = "Unable to read asset store references of render job file '" + path + "'";
+				return {};
+			}
+			std::vector<AssetStore::ChunkRef> refs(data->size() / sizeof(AssetStore::ChunkRef));
+			memcpy(refs.data(), data->data(), data->size());
+			for(auto &ref : refs)
+				referencedBlobs.push_back(ref.hash);
+		}
+	}
+	if(ec) {
+		outErr = "Unable to iterate directory '" + dir + "': " + ec.message();
+		return {};
+	}
+	AssetStore store {dir + RENDER_JOB_ASSET_STORE_DIRECTORY};
+	return store.RemoveUnreferencedBlobs(referencedBlobs, minAge, outErr);
+}
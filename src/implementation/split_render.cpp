@@ -0,0 +1,268 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <util_image_buffer.hpp>
+#include <util_image.hpp>
+#include <sharedutils/util_file.h>
+#include <sharedutils/util_ifile.hpp>
+#undef __UTIL_STRING_H__
+#include <sharedutils/util_string.h>
+#include <mathutil/umath.h>
+#include <mathutil/uquat.h>
+#include <mathutil/eulerangles.h>
+#include <fstream>
+#include <cstring>
+#include <array>
+#include <algorithm>
+
+module pragma.modules.scenekit;
+
+import pragma.scenekit;
+import :split_render;
+import :serialization;
+
+using namespace pragma::modules::scenekit;
+
+static constexpr std::array<char, 4> LAYER_SET_FILE_MAGIC = {'P', 'L', 'S', '\0'};
+static constexpr uint32_t LAYER_SET_FILE_VERSION = 1;
+
+SplitRenderStrip pragma::modules::scenekit::get_split_render_strip(uint32_t imageWidth, uint32_t index, uint32_t count)
+{
+	// The remainder is distributed across the first strips, so strip widths differ by at most one pixel
+	auto baseWidth = imageWidth / count;
+	auto remainder = imageWidth % count;
+	SplitRenderStrip strip {};
+	strip.x = index * baseWidth + umath::min(index, remainder);
+	strip.width = baseWidth + ((index < remainder) ? 1 : 0);
+	return strip;
+}
+
+bool pragma::modules::scenekit::is_split_render_supported(pragma::scenekit::Scene &scene, std::string &outErr)
+{
+	// Rotating a perspective camera towards a strip changes the projection of every pixel, so the strips wouldn't line up
+	auto &cam = scene.GetCamera();
+	if(cam.GetCameraType() != pragma::scenekit::Camera::CameraType::Panorama || cam.GetPanoramaType() != pragma::scenekit::Camera::PanoramaType::Equirectangular) {
+		outErr = "Split renders are only supported for equirectangular panorama cameras";
+		return false;
+	}
+	return true;
+}
+
+bool pragma::modules::scenekit::apply_split_render_region(pragma::scenekit::Scene &scene, const SplitRenderRegion &region, std::string &outErr)
+{
+	if(is_split_render_supported(scene, outErr) == false)
+		return false;
+	if(region.count == 0 || region.index >= region.count) {
+		outErr = "Invalid split region " + std::to_string(region.index) + "/" + std::to_string(region.count);
+		return false;
+	}
+	auto res = scene.GetResolution();
+	if(region.count > static_cast<uint32_t>(res.x)) {
+		outErr = "Image is too small to be split into " + std::to_string(region.count) + " regions";
+		return false;
+	}
+	auto strip = get_split_render_strip(res.x, region.index, region.count);
+	auto &cam = scene.GetCamera();
+	// Offset of the strip center from the image center in degrees. Columns map linearly to the longitude, so rotating the camera
+	// by this offset centers the strip. Positive yaw turns the camera to the left, strips right of the center need a negative yaw.
+	auto center = strip.x + strip.width * 0.5f;
+	auto offset = (center / static_cast<float>(res.x) - 0.5f) * region.horizontalRange;
+	cam.SetRotation(cam.GetRotation() * uquat::create(EulerAngles {0.f, -offset, 0.f}));
+	cam.SetEquirectangularHorizontalRange(region.horizontalRange * strip.width / static_cast<float>(res.x));
+	cam.SetResolution(strip.width, res.y);
+	return true;
+}
+
+static bool save_layer(const std::string &path, const std::shared_ptr<uimg::ImageBuffer> &imgBuf)
+{
+	std::string ext;
+	ufile::get_extension(path, &ext);
+	ustring::to_lower(ext);
+	auto format = uimg::ImageFormat::PNG;
+	auto img = imgBuf;
+	if(ext == "hdr") {
+		format = uimg::ImageFormat::HDR;
+		if(img->IsFloatFormat() == false)
+			img = img->Copy(uimg::Format::RGBA_FLOAT);
+	}
+	else {
+		if(ext == "tga")
+			format = uimg::ImageFormat::TGA;
+		else if(ext == "bmp")
+			format = uimg::ImageFormat::BMP;
+		else if(ext == "jpg" || ext == "jpeg")
+			format = uimg::ImageFormat::JPG;
+		if(img->GetFormat() != uimg::Format::RGBA8)
+			img = img->Copy(uimg::Format::RGBA8);
+	}
+	ufile::VectorFile f {};
+	if(uimg::save_image(f, *img, format) == false)
+		return false;
+	auto writer = StreamingFileWriter::Open(path);
+	if(writer == nullptr)
+		return false;
+	auto &data = f.GetVector();
+	writer->Write(data.data(), data.size());
+	return writer->Close();
+}
+
+bool pragma::modules::scenekit::write_image_layers(const uimg::ImageLayerSet &layers, const std::string &outputPath, std::vector<std::string> &outFiles, std::string &outErr)
+{
+	if(layers.images.empty()) {
+		outErr = "Render produced no images";
+		return false;
+	}
+	auto itPrimary = layers.images.find("COLOR");
+	if(itPrimary == layers.images.end())
+		itPrimary = layers.images.begin();
+	auto basePath = outputPath;
+	std::string ext;
+	if(ufile::get_extension(basePath, &ext))
+		ufile::remove_extension_from_filename(basePath);
+	else
+		ext = "png";
+	for(auto it = layers.images.begin(); it != layers.images.end(); ++it) {
+		if(it->second == nullptr)
+			continue;
+		auto name = it->first;
+		ustring::to_lower(name);
+		auto path = (it == itPrimary) ? outputPath : (basePath + '_' + name + '.' + ext);
+		if(save_layer(path, it->second) == false) {
+			outErr = "Unable to write image '" + path + "'";
+			return false;
+		}
+		outFiles.push_back(path);
+	}
+	return true;
+}
+
+namespace {
+	struct LayerHeader {
+		uint32_t nameLength = 0;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		uint32_t format = 0;
+		uint64_t dataSize = 0;
+	};
+};
+
+bool pragma::modules::scenekit::write_image_layer_set(const std::string &absPath, const uimg::ImageLayerSet &layers)
+{
+	auto writer = StreamingFileWriter::Open(absPath);
+	if(writer == nullptr)
+		return false;
+	writer->Write(LAYER_SET_FILE_MAGIC.data(), LAYER_SET_FILE_MAGIC.size());
+	writer->Write(&LAYER_SET_FILE_VERSION, sizeof(LAYER_SET_FILE_VERSION));
+	uint32_t layerCount = std::count_if(layers.images.begin(), layers.images.end(), [](const auto &pair) { return pair.second != nullptr; });
+	writer->Write(&layerCount, sizeof(layerCount));
+	for(auto &[name, img] : layers.images) {
+		if(img == nullptr)
+			continue;
+		LayerHeader header {};
+		header.nameLength = name.size();
+		header.width = img->GetWidth();
+		header.height = img->GetHeight();
+		header.format = umath::to_integral(img->GetFormat());
+		header.dataSize = img->GetSize();
+		writer->Write(&header, sizeof(header));
+		writer->Write(name.data(), name.size());
+		writer->Write(img->GetData(), header.dataSize);
+	}
+	return writer->Close();
+}
+
+std::optional<uimg::ImageLayerSet> pragma::modules::scenekit::read_image_layer_set(const std::string &absPath, std::string &outErr)
+{
+	std::ifstream f {absPath, std::ios::binary};
+	if(!f) {
+		outErr = "Unable to open file '" + absPath + "'";
+		return {};
+	}
+	auto corrupt = [&outErr, &absPath]() -> std::optional<uimg::ImageLayerSet> {
+		outErr = "File '" + absPath + "' is corrupt";
+		return {};
+	};
+	std::array<char, 4> magic;
+	uint32_t version;
+	uint32_t layerCount;
+	if(!f.read(magic.data(), magic.size()) || magic != LAYER_SET_FILE_MAGIC || !f.read(reinterpret_cast<char *>(&version), sizeof(version)) || version != LAYER_SET_FILE_VERSION
+	  || !f.read(reinterpret_cast<char *>(&layerCount), sizeof(layerCount)))
+		return corrupt();
+	uimg::ImageLayerSet layers {};
+	for(auto i = decltype(layerCount) {0u}; i < layerCount; ++i) {
+		LayerHeader header {};
+		if(!f.read(reinterpret_cast<char *>(&header), sizeof(header)))
+			return corrupt();
+		std::string name(header.nameLength, '\0');
+		if(!f.read(name.data(), name.size()))
+			return corrupt();
+		auto img = uimg::ImageBuffer::Create(header.width, header.height, static_cast<uimg::Format>(header.format));
+		if(img == nullptr || img->GetSize() != header.dataSize || !f.read(static_cast<char *>(img->GetData()), header.dataSize))
+			return corrupt();
+		layers.images[name] = img;
+	}
+	return layers;
+}
+
+std::optional<uimg::ImageLayerSet> pragma::modules::scenekit::merge_split_renders(const std::vector<uimg::ImageLayerSet> &parts, std::string &outErr)
+{
+	if(parts.empty()) {
+		outErr = "No parts to merge";
+		return {};
+	}
+	uimg::ImageLayerSet merged {};
+	for(auto &[name, firstImg] : parts.front().images) {
+		if(firstImg == nullptr)
+			continue;
+		uint32_t width = 0;
+		for(auto &part : parts) {
+			auto it = part.images.find(name);
+			if(it == part.images.end() || it->second == nullptr || it->second->GetFormat() != firstImg->GetFormat() || it->second->GetHeight() != firstImg->GetHeight()) {
+				outErr = "Layer '" + name + "' is missing or mismatched in one of the parts";
+				return {};
+			}
+			width += it->second->GetWidth();
+		}
+		auto height = firstImg->GetHeight();
+		auto pixelSize = firstImg->GetPixelSize();
+		auto img = uimg::ImageBuffer::Create(width, height, firstImg->GetFormat());
+		auto *dst = static_cast<uint8_t *>(img->GetData());
+		uint32_t x = 0;
+		for(auto &part : parts) {
+			auto &partImg = *part.images.find(name)->second;
+			auto *src = static_cast<const uint8_t *>(partImg.GetData());
+			auto rowSize = partImg.GetWidth() * pixelSize;
+			for(auto y = decltype(height) {0u}; y < height; ++y)
+				memcpy(dst + (static_cast<size_t>(y) * width + x) * pixelSize, src + static_cast<size_t>(y) * rowSize, rowSize);
+			x += partImg.GetWidth();
+		}
+		merged.images[name] = img;
+	}
+	return merged;
+}
+
+bool pragma::modules::scenekit::denoise_image_layer_set(uimg::ImageLayerSet &layers)
+{
+	auto find = [&layers](const char *name) -> uimg::ImageBuffer * {
+		auto it = layers.images.find(name);
+		return (it != layers.images.end()) ? it->second.get() : nullptr;
+	};
+	auto *color = find("COLOR");
+	if(color == nullptr)
+		return false;
+	auto *albedo = find("ALBEDO");
+	auto *normal = find("NORMAL");
+	// The denoiser requires the guide layers to match the color layer
+	if(albedo && (albedo->GetWidth() != color->GetWidth() || albedo->GetHeight() != color->GetHeight()))
+		albedo = nullptr;
+	if(normal && (normal->GetWidth() != color->GetWidth() || normal->GetHeight() != color->GetHeight()))
+		normal = nullptr;
+	pragma::scenekit::denoise::Info denoiseInfo {};
+	return pragma::scenekit::denoise::denoise(denoiseInfo, *color, albedo, normal, [](float progress) -> bool { return true; });
+}
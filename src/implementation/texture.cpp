@@ -16,11 +16,25 @@ module;
 #include <cmaterialmanager.h>
 #include <cmaterial_manager2.hpp>
 #include <sharedutils/util_file.h>
+#include <sharedutils/util_path.hpp>
+#include <sharedutils/util.h>
+#undef __UTIL_STRING_H__
+#include <sharedutils/util_string.h>
 #include <pragma/rendering/shaders/c_shader_cubemap_to_equirectangular.hpp>
 #include <pragma/rendering/shaders/particles/c_shader_particle.hpp>
 #include <util_texture_info.hpp>
 #include <util_image.hpp>
 #include <fsys/ifile.hpp>
+#include <sharedutils/util_ifile.hpp>
+#include <material.h>
+#include <future>
+#include <thread>
+#include <condition_variable>
+#include <queue>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 
 module pragma.modules.scenekit;
 
@@ -44,13 +58,108 @@ REGISTER_BASIC_BITWISE_OPERATORS(PreparedTextureInputFlags)
 enum class PreparedTextureOutputFlags : uint8_t { None = 0u, Envmap = 1u };
 REGISTER_BASIC_BITWISE_OPERATORS(PreparedTextureOutputFlags)
 
-static std::optional<std::string> prepare_texture(std::shared_ptr<Texture> &tex, bool &outSuccess, bool &outConverted, PreparedTextureInputFlags inFlags, PreparedTextureOutputFlags *optOutFlags, const std::optional<std::string> &defaultTexture, bool translucent)
+namespace {
+	enum class ConversionFormat : uint8_t { DDS = 0, PNG };
+	struct TextureConversion {
+		std::string texName;
+		std::string texPath;
+		std::string identity;
+		std::string sourcePath;
+		uint32_t flags = 0;
+		ConversionFormat format = ConversionFormat::DDS;
+		uimg::TextureInfo imgWriteInfo {};
+		uimg::Format readbackFormat = uimg::Format::RGBA8;
+		// Set if the texture has to be downscaled after the readback
+		uint32_t maxDimension = 0;
+		// Keeps the source image alive until it has been read back
+		std::shared_ptr<prosper::Texture> texture = nullptr;
+		std::shared_ptr<uimg::ImageBuffer> imageBuffer = nullptr;
+		// Resolved on the main thread, since the file system lookup isn't safe to use on the encoding workers
+		std::optional<std::string> errorTexturePath {};
+		std::string baseOutputPath;
+		// Set if the manifest has an entry for the conversion whose source has been touched, in which case the source is hashed
+		// on the worker first and the existing file is used if the content hasn't changed
+		bool revalidate = false;
+		std::promise<std::optional<std::string>> promise;
+		std::shared_ptr<std::atomic<bool>> success = nullptr;
+	};
+};
+
+static bool is_converted_texture_file(std::string path)
+{
+	ustring::replace(path, "\\", "/");
+	ustring::to_lower(path);
+	return path.find("addons/converted/") != std::string::npos;
+}
+
+// Locates the file the texture was originally loaded from.
+// A single wildcard search yields the formats that exist, only those are resolved to an absolute path.
+static std::optional<std::string> find_source_texture_file(const std::string &texName)
+{
+	auto basePath = "materials/" + texName;
+	std::vector<std::string> files;
+	FileManager::FindFiles((basePath + ".*").c_str(), &files, nullptr);
+	if(files.empty())
+		return {};
+	for(auto &f : files) {
+		std::string ext;
+		ufile::get_extension(f, &ext);
+		ustring::to_lower(ext);
+		f = std::move(ext);
+	}
+	for(auto *ext : {"dds", "ktx", "png", "tga", "jpg", "bmp", "psd", "hdr", "vtf", "vtex_c"}) {
+		if(std::find(files.begin(), files.end(), ext) == files.end())
+			continue;
+		std::string absPath;
+		if(FileManager::FindAbsolutePath(basePath + "." + ext, absPath) && is_converted_texture_file(absPath) == false)
+			return absPath;
+	}
+	return {};
+}
+
+// Conversions from before the manifest existed can't be verified by content, so they're only trusted if they're newer than the source
+static bool is_conversion_older_than_source(const std::string &convertedPath, const std::string &sourcePath)
+{
+	std::error_code ec;
+	auto sourceTime = std::filesystem::last_write_time(sourcePath, ec);
+	if(ec)
+		return false;
+	auto convertedTime = std::filesystem::last_write_time(convertedPath, ec);
+	return ec || convertedTime < sourceTime;
+}
+
+// Same as the defaults of ShaderCubemapToEquirectangular::CubemapToEquirectangularTexture
+static constexpr prosper::Extent2D DEFAULT_EQUIRECT_EXTENTS {1'600, 800};
+// Without a max texture dimension the engine default is used. Otherwise the conversion is done at the reduced size right away,
+// instead of converting at full size and downscaling afterwards.
+static prosper::Extent2D calc_equirect_extents(uint32_t maxDimension)
+{
+	auto extents = DEFAULT_EQUIRECT_EXTENTS;
+	while(maxDimension > 0 && extents.width > maxDimension && extents.height > 1) {
+		extents.width /= 2;
+		extents.height /= 2;
+	}
+	return extents;
+}
+
+static std::shared_ptr<prosper::Texture> cubemap_to_equirect(prosper::Texture &cubemap, uint32_t maxDimension)
+{
+	auto &shader = static_cast<pragma::ShaderCubemapToEquirectangular &>(*c_engine->GetShader("cubemap_to_equirectangular"));
+	if(maxDimension == 0)
+		return shader.CubemapToEquirectangularTexture(cubemap);
+	auto extents = calc_equirect_extents(maxDimension);
+	return shader.CubemapToEquirectangularTexture(cubemap, extents.width, extents.height);
+}
+
+// Returns the path to the texture if it can be used as is. Otherwise outConversion contains everything required to convert it.
+static std::optional<std::string> resolve_texture(std::shared_ptr<Texture> &tex, bool &outSuccess, PreparedTextureInputFlags inFlags, PreparedTextureOutputFlags *optOutFlags, const std::optional<std::string> &defaultTexture, bool translucent,
+  uint32_t maxDimension, std::unique_ptr<TextureConversion> &outConversion)
 {
 	if(optOutFlags)
 		*optOutFlags = PreparedTextureOutputFlags::None;
 
 	outSuccess = false;
-	outConverted = false;
+	outConversion = nullptr;
 	std::string texName {};
 	// Make sure texture has been fully loaded!
 	if(tex == nullptr || tex->IsLoaded() == false) {
@@ -81,66 +190,94 @@ static std::optional<std::string> prepare_texture(std::shared_ptr<Texture> &tex,
 	}
 	*/
 	ufile::remove_extension_from_filename(texName); // DDS-writer will add the extension for us
+	auto sourceName = texName;
 
 	auto vkTex = tex->GetVkTexture();
 	auto *img = &vkTex->GetImage();
+	auto extents = img->GetExtents();
 	auto isCubemap = img->IsCubemap();
 	if(isCubemap) {
 		if(umath::is_flag_set(inFlags, PreparedTextureInputFlags::CanBeEnvMap) == false)
 			return {};
 		// Image is a cubemap, which Cycles doesn't support! We'll have to convert it to a equirectangular image and use that instead.
-		auto &shader = static_cast<pragma::ShaderCubemapToEquirectangular &>(*c_engine->GetShader("cubemap_to_equirectangular"));
-		auto equiRectMap = shader.CubemapToEquirectangularTexture(*vkTex);
-		vkTex = equiRectMap;
-		img = &vkTex->GetImage();
+		// The conversion only happens further below if there's no up-to-date version of it on disk yet.
+		// The downscaled variants get the usual "_max" suffix below.
+		extents = DEFAULT_EQUIRECT_EXTENTS;
 		texName += "_equirect";
 
 		if(optOutFlags)
 			*optOutFlags |= PreparedTextureOutputFlags::Envmap;
 	}
 
-	enum class Format { DDS = 0, PNG };
-	auto format = Format::DDS;
+	// Only textures that actually exceed the limit get a downscaled variant, all others can share the full resolution version
+	auto requiresDownscale = (maxDimension > 0 && (extents.width > maxDimension || extents.height > maxDimension));
+	if(requiresDownscale)
+		texName += "_max" + std::to_string(maxDimension);
+
+	auto format = ConversionFormat::DDS;
 	if(translucent) {
 		// Transparent DDS textures sometimes cause weird emission artifacts (with transparent areas
 		// appearing emissive in bright white), so we'll use png for those textures instead.
-		format = Format::PNG;
+		format = ConversionFormat::PNG;
 	}
 
 	auto texPath = "materials\\" + texName;
-	std::string ext = (format == Format::DDS) ? "dds" : "png";
+	std::string ext = (format == ConversionFormat::DDS) ? "dds" : "png";
 
 	std::string absPath;
 	texPath += "." + ext;
-	// Check if a version of the texture already exists, in which case we can just use it directly!
-	if(FileManager::FindAbsolutePath(texPath, absPath)) {
+	auto flags = optOutFlags ? umath::to_integral(*optOutFlags) : 0u;
+	auto &manifest = pragma::modules::scenekit::TextureConversionManifest::GetInstance();
+	auto identity = pragma::modules::scenekit::TextureConversionManifest::GetIdentity(texPath);
+	auto lookupResult = manifest.Find(identity, absPath);
+	if(lookupResult == pragma::modules::scenekit::TextureConversionManifest::LookupResult::Found) {
 		outSuccess = true;
 		return absPath;
 	}
+	// Check if a version of the texture already exists, in which case we can just use it directly!
+	// If the manifest says that the existing conversion is outdated, we mustn't pick it up here.
+	if(lookupResult == pragma::modules::scenekit::TextureConversionManifest::LookupResult::NotFound && FileManager::FindAbsolutePath(texPath, absPath)) {
+		// Remember the location, so it doesn't have to be searched for again next time
+		auto sourcePath = is_converted_texture_file(absPath) ? find_source_texture_file(sourceName).value_or(absPath) : absPath;
+		if(sourcePath == absPath || is_conversion_older_than_source(absPath, sourcePath) == false) {
+			manifest.Update(identity, sourcePath, absPath, ext, flags);
+			outSuccess = true;
+			return absPath;
+		}
+		// The existing conversion predates the last change to the source, it has to be converted again
+	}
 
 	// Texture does not have the right format to begin with or does not exist on the local hard drive.
 	// We will have to create the texture file in the right format (if the texture object is valid).
 	if(tex == nullptr)
 		return get_abs_error_texture_path(); // Texture is not valid! Return error texture.
+	if(isCubemap) {
+		vkTex = cubemap_to_equirect(*vkTex, requiresDownscale ? maxDimension : 0);
+		if(vkTex == nullptr)
+			return get_abs_error_texture_path();
+		img = &vkTex->GetImage();
+	}
 
-	std::string baseOutputPath = "addons/converted/";
-	if(format == Format::PNG) {
-		auto imgBuf = img->ToHostImageBuffer(uimg::Format::RGBA8, prosper::ImageLayout::ShaderReadOnlyOptimal);
-		auto fullPath = baseOutputPath + texPath;
-		FileManager::CreatePath(ufile::get_path_from_filename(fullPath).c_str());
-		auto f = filemanager::open_file(fullPath, filemanager::FileMode::Write | filemanager::FileMode::Binary);
-		fsys::File fp {f};
-		uimg::save_image(fp, *imgBuf, uimg::ImageFormat::PNG);
-		if(FileManager::FindAbsolutePath(texPath, absPath)) {
-			outSuccess = true;
-			return absPath;
-		}
-		return get_abs_error_texture_path();
+	auto conversion = std::make_unique<TextureConversion>();
+	conversion->texName = texName;
+	conversion->texPath = texPath;
+	conversion->format = format;
+	conversion->texture = vkTex;
+	conversion->identity = identity;
+	conversion->sourcePath = find_source_texture_file(sourceName).value_or("");
+	conversion->flags = flags;
+	conversion->errorTexturePath = get_abs_error_texture_path();
+	conversion->baseOutputPath = util::Path::CreatePath(FileManager::GetProgramPath()).GetString() + "addons/converted/";
+	if(requiresDownscale)
+		conversion->maxDimension = maxDimension;
+	conversion->revalidate = (lookupResult == pragma::modules::scenekit::TextureConversionManifest::LookupResult::NeedsRevalidation);
+	if(format == ConversionFormat::PNG) {
+		conversion->readbackFormat = uimg::Format::RGBA8;
+		outConversion = std::move(conversion);
+		return {};
 	}
 
-	// Output path for the DDS-file we're about to create
-	auto ddsPath = baseOutputPath + "materials/" + texName;
-	uimg::TextureInfo imgWriteInfo {};
+	auto &imgWriteInfo = conversion->imgWriteInfo;
 	imgWriteInfo.containerFormat = uimg::TextureInfo::ContainerFormat::DDS; // Cycles doesn't support KTX
 	if(tex->HasFlag(Texture::Flags::SRGB))
 		imgWriteInfo.flags |= uimg::TextureInfo::Flags::SRGB;
@@ -206,63 +343,427 @@ static std::optional<std::string> prepare_texture(std::shared_ptr<Texture> &tex,
 			break;
 		}
 	}
-	absPath = "";
+	switch(imgWriteInfo.inputFormat) {
+	case uimg::TextureInfo::InputFormat::R16G16B16A16_Float:
+		conversion->readbackFormat = uimg::Format::RGBA16;
+		break;
+	case uimg::TextureInfo::InputFormat::R32G32B32A32_Float:
+		conversion->readbackFormat = uimg::Format::RGBA32;
+		break;
+	default:
+		conversion->readbackFormat = uimg::Format::RGBA8;
+		break;
+	}
+	outConversion = std::move(conversion);
+	return {};
+}
+
+// 2x2 box filter. Odd sizes are handled by clamping to the last row/column.
+static std::vector<float> downsample(const std::vector<float> &src, uint32_t w, uint32_t h, uint32_t &outW, uint32_t &outH)
+{
+	constexpr uint32_t numChannels = 4;
+	outW = umath::max(w / 2u, 1u);
+	outH = umath::max(h / 2u, 1u);
+	std::vector<float> dst(static_cast<size_t>(outW) * outH * numChannels);
+	for(auto y = decltype(outH) {0u}; y < outH; ++y) {
+		auto y0 = umath::min(y * 2, h - 1);
+		auto y1 = umath::min(y * 2 + 1, h - 1);
+		for(auto x = decltype(outW) {0u}; x < outW; ++x) {
+			auto x0 = umath::min(x * 2, w - 1);
+			auto x1 = umath::min(x * 2 + 1, w - 1);
+			for(auto c = decltype(numChannels) {0u}; c < numChannels; ++c) {
+				auto v = src[(static_cast<size_t>(y0) * w + x0) * numChannels + c] + src[(static_cast<size_t>(y0) * w + x1) * numChannels + c] + src[(static_cast<size_t>(y1) * w + x0) * numChannels + c]
+				  + src[(static_cast<size_t>(y1) * w + x1) * numChannels + c];
+				dst[(static_cast<size_t>(y) * outW + x) * numChannels + c] = v * 0.25f;
+			}
+		}
+	}
+	return dst;
+}
+
+static std::vector<float> get_float_data(const uimg::ImageBuffer &imgBuf)
+{
+	auto fullPrecision = imgBuf.Copy(uimg::Format::RGBA_FLOAT);
+	std::vector<float> data(static_cast<size_t>(fullPrecision->GetWidth()) * fullPrecision->GetHeight() * 4);
+	std::memcpy(data.data(), fullPrecision->GetData(), data.size() * sizeof(float));
+	return data;
+}
+
+// Halves the image with a box filter until neither side exceeds maxDimension. Returns a copy in the original format.
+static std::shared_ptr<uimg::ImageBuffer> downscale_texture_image(const uimg::ImageBuffer &imgBuf, uint32_t maxDimension)
+{
+	auto w = static_cast<uint32_t>(imgBuf.GetWidth());
+	auto h = static_cast<uint32_t>(imgBuf.GetHeight());
+	if(maxDimension == 0 || (w <= maxDimension && h <= maxDimension))
+		return imgBuf.Copy();
+	auto data = get_float_data(imgBuf);
+	while(w > maxDimension || h > maxDimension) {
+		uint32_t newW, newH;
+		data = downsample(data, w, h, newW, newH);
+		w = newW;
+		h = newH;
+	}
+	auto result = uimg::ImageBuffer::Create(data.data(), w, h, uimg::Format::RGBA_FLOAT);
+	result->Convert(imgBuf.GetFormat());
+	return result;
+}
+
+// Bytes per texel the renderer stores for the converted texture. The renderer's image loader decompresses block compressed
+// files and keeps them as 8-bit RGBA, or as half-float RGBA for HDR color maps, regardless of the number of channels.
+static uint32_t get_renderer_texel_size(const TextureConversion &conversion)
+{
+	if(conversion.format == ConversionFormat::DDS && conversion.imgWriteInfo.outputFormat == uimg::TextureInfo::OutputFormat::HDRColorMap)
+		return sizeof(uint16_t) * 4;
+	return sizeof(uint8_t) * 4;
+}
+
+static std::mutex g_textureMemoryMutex;
+static std::unordered_map<std::string, pragma::modules::scenekit::TextureMemoryInfo> g_textureMemory;
+static void record_texture_memory(const TextureConversion &conversion)
+{
+	pragma::modules::scenekit::TextureMemoryInfo info {};
+	info.name = conversion.texName;
+	info.width = conversion.imageBuffer->GetWidth();
+	info.height = conversion.imageBuffer->GetHeight();
+	auto numTexels = static_cast<uint64_t>(info.width) * info.height;
+	info.size = numTexels * get_renderer_texel_size(conversion);
+	std::scoped_lock lock {g_textureMemoryMutex};
+	g_textureMemory[conversion.identity] = std::move(info);
+}
+
+static bool write_file(const std::string &absPath, const void *data, size_t size)
+{
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path {absPath}.parent_path(), ec);
+	std::ofstream f {absPath, std::ios::binary | std::ios::trunc};
+	if(f.is_open() == false)
+		return false;
+	f.write(static_cast<const char *>(data), size);
+	return f.good();
+}
+
+// Writes the image data that was read back from the GPU to disk.
+// This includes the block compression, which is by far the most expensive part, so it runs on a worker thread.
+// Only absolute paths are used here, the file manager and console are left to the main thread.
+static std::optional<std::string> encode_texture(TextureConversion &conversion, bool &outSuccess)
+{
+	outSuccess = false;
+	if(conversion.revalidate) {
+		std::string absPath;
+		if(pragma::modules::scenekit::TextureConversionManifest::GetInstance().Revalidate(conversion.identity, absPath)) {
+			outSuccess = true;
+			return absPath;
+		}
+	}
+	if(conversion.imageBuffer == nullptr)
+		return conversion.errorTexturePath;
+	if(conversion.maxDimension > 0)
+		conversion.imageBuffer = downscale_texture_image(*conversion.imageBuffer, conversion.maxDimension);
+	record_texture_memory(conversion);
+	auto &baseOutputPath = conversion.baseOutputPath;
+	if(conversion.format == ConversionFormat::PNG) {
+		auto absPath = baseOutputPath + conversion.texPath;
+		ustring::replace(absPath, "\\", "/");
+		ufile::VectorFile f {};
+		if(uimg::save_image(f, *conversion.imageBuffer, uimg::ImageFormat::PNG) == false || write_file(absPath, f.GetVector().data(), f.GetVector().size()) == false)
+			return conversion.errorTexturePath;
+		pragma::modules::scenekit::TextureConversionManifest::GetInstance().Update(conversion.identity, conversion.sourcePath, absPath, "png", conversion.flags, true);
+		outSuccess = true;
+		return absPath;
+	}
+
+	// Output path for the DDS-file we're about to create (the DDS-writer adds the extension)
+	auto ddsPath = baseOutputPath + "materials/" + conversion.texName;
+	ustring::replace(ddsPath, "\\", "/");
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path {ddsPath}.parent_path(), ec);
 	// Save the DDS image and make sure the file exists
-	if(c_game->SaveImage(*img, ddsPath, imgWriteInfo) && FileManager::FindAbsolutePath(ddsPath + ".dds", absPath)) {
+	auto absPath = ddsPath + ".dds";
+	if(uimg::save_texture(ddsPath, *conversion.imageBuffer, conversion.imgWriteInfo) && std::filesystem::exists(absPath, ec)) {
+		pragma::modules::scenekit::TextureConversionManifest::GetInstance().Update(conversion.identity, conversion.sourcePath, absPath, "dds", conversion.flags, true);
 		outSuccess = true;
-		outConverted = true;
 		return absPath;
 	}
 	// Something went wrong, fall back to error texture!
-	return get_abs_error_texture_path();
+	return conversion.errorTexturePath;
 }
 
-static std::optional<std::string> prepare_texture(std::shared_ptr<Texture> &texInfo, PreparedTextureInputFlags inFlags, PreparedTextureOutputFlags *optOutFlags, const std::optional<std::string> &defaultTexture, bool translucent)
+static void log_prepared_texture(const std::string &texName, bool success, bool converted)
 {
-	if(optOutFlags)
-		*optOutFlags = PreparedTextureOutputFlags::None;
-	if(texInfo == nullptr)
-		return {};
-	auto success = false;
-	auto converted = false;
-	auto result = prepare_texture(texInfo, success, converted, inFlags, optOutFlags, defaultTexture, translucent);
-	if(success == false && texInfo->GetName() != "error") {
-		Con::cwar << "WARNING: Unable to prepare texture '";
-		if(texInfo)
-			Con::cwar << texInfo->GetName();
-		else
-			Con::cwar << "Unknown";
-		Con::cwar << "'! Using error texture instead..." << Con::endl;
+	if(success == false && texName != "error") {
+		Con::cwar << "WARNING: Unable to prepare texture '" << (texName.empty() ? std::string {"Unknown"} : texName) << "'! Using error texture instead..." << Con::endl;
+		return;
 	}
-	else {
-		if(converted)
-			Con::cout << "Converted texture '" << texInfo->GetName() << "' to DDS!" << Con::endl;
+	if(converted)
+		Con::cout << "Converted texture '" << texName << "' to DDS!" << Con::endl;
 
 #if 0
-		// TODO: Re-implement this
-		ccl::ImageMetaData metaData;
+	// TODO: Re-implement this
+	ccl::ImageMetaData metaData;
+	if(scene.image_manager->get_image_metadata(*result,nullptr,ccl::u_colorspace_raw,metaData) == false)
+	{
+		Con::cwar<<"WARNING: Texture '"<<texInfo->name<<"' has format which is incompatible with cycles! Falling back to error texture..."<<Con::endl;
+		result = get_abs_error_texture_path();
 		if(scene.image_manager->get_image_metadata(*result,nullptr,ccl::u_colorspace_raw,metaData) == false)
 		{
-			Con::cwar<<"WARNING: Texture '"<<texInfo->name<<"' has format which is incompatible with cycles! Falling back to error texture..."<<Con::endl;
-			result = get_abs_error_texture_path();
-			if(scene.image_manager->get_image_metadata(*result,nullptr,ccl::u_colorspace_raw,metaData) == false)
-			{
-				Con::cwar<<"WARNING: Error texture also not compatible! Falling back to untextured!"<<Con::endl;
-				result = {};
-			}
+			Con::cwar<<"WARNING: Error texture also not compatible! Falling back to untextured!"<<Con::endl;
+			result = {};
 		}
+	}
 #endif
+}
+
+namespace {
+	class TexturePreparer {
+	  public:
+		using Result = std::optional<std::string>;
+		TexturePreparer();
+		~TexturePreparer();
+		std::shared_future<Result> Request(const std::string &texPath, const std::optional<std::string> &defaultTexture, bool translucent);
+		void Flush();
+		// Prints the results of conversions that have completed on the workers
+		void PrintLog();
+	  private:
+		struct LogEntry {
+			std::string texName;
+			bool success = false;
+			bool converted = false;
+		};
+		struct PendingRequest {
+			std::shared_future<Result> future;
+			// Failed results are not cached, since the texture may not have been loaded yet
+			std::shared_ptr<std::atomic<bool>> success = nullptr;
+		};
+		void RunWorker();
+		std::unordered_map<std::string, PendingRequest> m_requests;
+		// Keyed by the identity of the converted file, so requests that differ only in their default texture or translucency
+		// but end up with the same output share a single conversion, instead of writing the same file concurrently
+		std::unordered_map<std::string, PendingRequest> m_conversions;
+		std::vector<std::unique_ptr<TextureConversion>> m_pendingReadbacks;
+		std::vector<LogEntry> m_log;
+		std::mutex m_logMutex;
+
+		std::vector<std::thread> m_workers;
+		std::queue<std::function<void()>> m_tasks;
+		std::mutex m_taskMutex;
+		std::condition_variable m_taskCondition;
+		bool m_running = true;
+	};
+};
+
+TexturePreparer::TexturePreparer()
+{
+	auto numWorkers = umath::max(std::thread::hardware_concurrency() / 2u, 1u);
+	m_workers.reserve(numWorkers);
+	for(auto i = decltype(numWorkers) {0u}; i < numWorkers; ++i)
+		m_workers.push_back(std::thread {[this]() { RunWorker(); }});
+}
+
+TexturePreparer::~TexturePreparer()
+{
+	Flush();
+	{
+		std::unique_lock lock {m_taskMutex};
+		m_running = false;
 	}
+	m_taskCondition.notify_all();
+	for(auto &worker : m_workers)
+		worker.join();
+	PrintLog();
+}
 
-	return result;
+void TexturePreparer::PrintLog()
+{
+	std::vector<LogEntry> log;
+	{
+		std::scoped_lock lock {m_logMutex};
+		log = std::move(m_log);
+		m_log = {};
+	}
+	for(auto &entry : log)
+		log_prepared_texture(entry.texName, entry.success, entry.converted);
 }
 
-std::optional<std::string> pragma::modules::scenekit::prepare_texture(const std::string &texPath, const std::optional<std::string> &defaultTexture, bool translucent)
+void TexturePreparer::RunWorker()
+{
+	for(;;) {
+		std::function<void()> task;
+		{
+			std::unique_lock lock {m_taskMutex};
+			m_taskCondition.wait(lock, [this]() { return m_tasks.empty() == false || m_running == false; });
+			// Remaining tasks are still processed before shutting down, otherwise their futures would never be satisfied
+			if(m_tasks.empty())
+				return;
+			task = std::move(m_tasks.front());
+			m_tasks.pop();
+		}
+		task();
+	}
+}
+
+std::shared_future<TexturePreparer::Result> TexturePreparer::Request(const std::string &texPath, const std::optional<std::string> &defaultTexture, bool translucent)
 {
+	PrintLog();
+	auto maxDimension = pragma::modules::scenekit::get_max_texture_dimension();
+	auto key = texPath + '|' + defaultTexture.value_or("") + '|' + (translucent ? '1' : '0') + '|' + std::to_string(maxDimension);
+	auto it = m_requests.find(key);
+	if(it != m_requests.end()) {
+		auto &request = it->second;
+		auto ready = (request.future.wait_for(std::chrono::seconds {0}) == std::future_status::ready);
+		if(ready == false || *request.success)
+			return request.future;
+		m_requests.erase(it);
+	}
+
 	auto &texManager = static_cast<msys::CMaterialManager &>(client->GetMaterialManager()).GetTextureManager();
-	auto ptex = texManager.LoadAsset(texPath);
+	auto tex = texManager.LoadAsset(texPath);
+	auto texName = tex ? tex->GetName() : texPath;
 	auto flags = PreparedTextureInputFlags::CanBeEnvMap;
 	PreparedTextureOutputFlags retFlags;
-	auto tex = ptex;
-	return ::prepare_texture(tex, flags, &retFlags, defaultTexture, translucent);
+	PendingRequest request {};
+	request.success = std::make_shared<std::atomic<bool>>(false);
+	std::unique_ptr<TextureConversion> conversion = nullptr;
+	Result result {};
+	auto success = false;
+	if(tex != nullptr) {
+		result = resolve_texture(tex, success, flags, &retFlags, defaultTexture, translucent, maxDimension, conversion);
+		if(conversion == nullptr)
+			log_prepared_texture(texName, success, false);
+	}
+	if(conversion == nullptr) {
+		*request.success = success;
+		std::promise<Result> promise;
+		promise.set_value(result);
+		request.future = promise.get_future().share();
+	}
+	else {
+		auto itConversion = m_conversions.find(conversion->identity);
+		if(itConversion != m_conversions.end()) {
+			auto &pending = itConversion->second;
+			auto ready = (pending.future.wait_for(std::chrono::seconds {0}) == std::future_status::ready);
+			if(ready == false || *pending.success)
+				conversion = nullptr;
+		}
+		if(conversion == nullptr)
+			request = itConversion->second;
+		else {
+			conversion->success = request.success;
+			request.future = conversion->promise.get_future().share();
+			m_conversions[conversion->identity] = request;
+			m_pendingReadbacks.push_back(std::move(conversion));
+		}
+	}
+	m_requests[key] = request;
+	return request.future;
+}
+
+void TexturePreparer::Flush()
+{
+	PrintLog();
+	if(m_pendingReadbacks.empty())
+		return;
+	// All readbacks are done back-to-back on the main thread, the encoding is then distributed across the workers
+	auto conversions = std::move(m_pendingReadbacks);
+	m_pendingReadbacks = {};
+	for(auto &conversion : conversions) {
+		conversion->imageBuffer = conversion->texture->GetImage().ToHostImageBuffer(conversion->readbackFormat, prosper::ImageLayout::ShaderReadOnlyOptimal);
+		conversion->texture = nullptr;
+	}
+
+	std::unique_lock lock {m_taskMutex};
+	for(auto &conversion : conversions) {
+		std::shared_ptr<TextureConversion> sharedConversion {std::move(conversion)};
+		m_tasks.push([this, sharedConversion]() {
+			auto success = false;
+			auto result = encode_texture(*sharedConversion, success);
+			{
+				std::scoped_lock lock {m_logMutex};
+				m_log.push_back({sharedConversion->texName, success, success && sharedConversion->format != ConversionFormat::PNG});
+			}
+			*sharedConversion->success = success;
+			sharedConversion->promise.set_value(result);
+		});
+	}
+	lock.unlock();
+	m_taskCondition.notify_all();
+}
+
+static std::atomic<uint32_t> g_maxTextureDimension = 0;
+void pragma::modules::scenekit::set_max_texture_dimension(uint32_t maxDimension) { g_maxTextureDimension = maxDimension; }
+uint32_t pragma::modules::scenekit::get_max_texture_dimension() { return g_maxTextureDimension; }
+
+pragma::modules::scenekit::MaxTextureDimensionScope::MaxTextureDimensionScope(uint32_t maxDimension) : m_prevMaxDimension {get_max_texture_dimension()} { set_max_texture_dimension(maxDimension); }
+pragma::modules::scenekit::MaxTextureDimensionScope::~MaxTextureDimensionScope() { set_max_texture_dimension(m_prevMaxDimension); }
+
+uint32_t pragma::modules::scenekit::calc_preview_max_texture_dimension(uint32_t width, uint32_t height)
+{
+	constexpr uint32_t minDimension = 256;
+	return umath::max(umath::max(width, height), minDimension);
+}
+
+static std::unique_ptr<TexturePreparer> g_texturePreparer = nullptr;
+static TexturePreparer &get_texture_preparer()
+{
+	if(g_texturePreparer == nullptr)
+		g_texturePreparer = std::make_unique<TexturePreparer>();
+	return *g_texturePreparer;
+}
+
+std::shared_future<std::optional<std::string>> pragma::modules::scenekit::prepare_texture_async(const std::string &texPath, const std::optional<std::string> &defaultTexture, bool translucent)
+{
+	return get_texture_preparer().Request(texPath, defaultTexture, translucent);
+}
+
+void pragma::modules::scenekit::flush_texture_preparation()
+{
+	if(g_texturePreparer)
+		g_texturePreparer->Flush();
+	TextureConversionManifest::GetInstance().Save();
+}
+
+void pragma::modules::scenekit::close_texture_preparation()
+{
+	g_texturePreparer = nullptr;
+	TextureConversionManifest::GetInstance().Save();
+}
+
+void pragma::modules::scenekit::prefetch_material_textures(Material &mat)
+{
+	for(auto *identifier : {Material::ALBEDO_MAP_IDENTIFIER, Material::ALBEDO_MAP2_IDENTIFIER, Material::NORMAL_MAP_IDENTIFIER, Material::RMA_MAP_IDENTIFIER, Material::EMISSION_MAP_IDENTIFIER}) {
+		auto *texInfo = mat.GetTextureInfo(identifier);
+		if(texInfo == nullptr || texInfo->name.empty())
+			continue;
+		prepare_texture_async(texInfo->name);
+	}
+}
+
+std::vector<pragma::modules::scenekit::TextureMemoryInfo> pragma::modules::scenekit::get_texture_memory_report()
+{
+	std::scoped_lock lock {g_textureMemoryMutex};
+	std::vector<TextureMemoryInfo> report;
+	report.reserve(g_textureMemory.size());
+	for(auto &[identity, info] : g_textureMemory)
+		report.push_back(info);
+	std::sort(report.begin(), report.end(), [](const TextureMemoryInfo &a, const TextureMemoryInfo &b) { return a.size > b.size; });
+	return report;
+}
+
+void pragma::modules::scenekit::print_texture_memory_report()
+{
+	auto report = get_texture_memory_report();
+	uint64_t total = 0;
+	Con::cout << "Renderer texture memory (estimated) of " << report.size() << " converted textures:" << Con::endl;
+	for(auto &info : report) {
+		Con::cout << info.name << " (" << info.width << "x" << info.height << "): " << util::get_pretty_bytes(info.size) << Con::endl;
+		total += info.size;
+	}
+	Con::cout << "Total: " << util::get_pretty_bytes(total) << Con::endl;
+}
+
+std::optional<std::string> pragma::modules::scenekit::prepare_texture(const std::string &texPath, const std::optional<std::string> &defaultTexture, bool translucent)
+{
+	auto future = prepare_texture_async(texPath, defaultTexture, translucent);
+	if(future.wait_for(std::chrono::seconds {0}) != std::future_status::ready)
+		flush_texture_preparation();
+	return future.get();
 }
@@ -0,0 +1,226 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <pragma/c_engine.h>
+#include <sharedutils/util_file.h>
+#include <sharedutils/util_path.hpp>
+#undef __UTIL_STRING_H__
+#include <sharedutils/util_string.h>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <array>
+#include <cstdlib>
+
+module pragma.modules.scenekit;
+
+import :texture;
+
+using namespace pragma::modules::scenekit;
+
+static constexpr uint32_t MANIFEST_VERSION = 1;
+
+namespace {
+	struct FileStats {
+		uint64_t size = 0;
+		int64_t time = 0;
+	};
+};
+static std::optional<FileStats> get_file_stats(const std::string &path)
+{
+	std::error_code ec;
+	auto size = std::filesystem::file_size(path, ec);
+	if(ec)
+		return {};
+	auto time = std::filesystem::last_write_time(path, ec);
+	if(ec)
+		return {};
+	return FileStats {size, static_cast<int64_t>(time.time_since_epoch().count())};
+}
+
+// 64-bit FNV-1a, which is stable across builds and platforms (unlike std::hash)
+static std::optional<uint64_t> calc_file_hash(const std::string &path)
+{
+	std::ifstream f {path, std::ios::binary};
+	if(!f)
+		return {};
+	uint64_t hash = 14'695'981'039'346'656'037ull;
+	std::array<char, 64 * 1'024> buf;
+	while(f) {
+		f.read(buf.data(), buf.size());
+		auto n = f.gcount();
+		for(auto i = decltype(n) {0}; i < n; ++i) {
+			hash ^= static_cast<uint8_t>(buf[i]);
+			hash *= 1'099'511'628'211ull;
+		}
+	}
+	return hash;
+}
+
+TextureConversionManifest &TextureConversionManifest::GetInstance()
+{
+	static TextureConversionManifest manifest {};
+	return manifest;
+}
+
+std::string TextureConversionManifest::GetIdentity(const std::string &texPath)
+{
+	auto identity = texPath;
+	ustring::replace(identity, "\\", "/");
+	ustring::to_lower(identity);
+	return identity;
+}
+
+TextureConversionManifest::TextureConversionManifest() { Load(); }
+
+std::string TextureConversionManifest::GetManifestPath() const { return util::Path::CreatePath(FileManager::GetProgramPath()).GetString() + "addons/converted/texture_manifest.txt"; }
+
+void TextureConversionManifest::Load()
+{
+	std::ifstream f {GetManifestPath()};
+	if(!f)
+		return;
+	std::string line;
+	if(!std::getline(f, line) || line != "version " + std::to_string(MANIFEST_VERSION))
+		return; // Unknown version, everything will be re-validated
+	while(std::getline(f, line)) {
+		std::vector<std::string> fields;
+		ustring::explode(line, "\t", fields);
+		if(fields.size() != 8)
+			continue;
+		Entry entry {};
+		entry.sourcePath = fields[1];
+		entry.sourceSize = std::strtoull(fields[2].c_str(), nullptr, 10);
+		entry.sourceTime = std::strtoll(fields[3].c_str(), nullptr, 10);
+		entry.sourceHash = std::strtoull(fields[4].c_str(), nullptr, 10);
+		entry.convertedPath = fields[5];
+		entry.format = fields[6];
+		entry.flags = static_cast<uint32_t>(std::strtoul(fields[7].c_str(), nullptr, 10));
+		m_entries[fields[0]] = std::move(entry);
+	}
+}
+
+void TextureConversionManifest::Save()
+{
+	std::unique_lock lock {m_mutex};
+	if(m_dirty == false)
+		return;
+	m_dirty = false;
+	std::stringstream ss;
+	ss << "version " << MANIFEST_VERSION << "\n";
+	for(auto &[identity, entry] : m_entries)
+		ss << identity << "\t" << entry.sourcePath << "\t" << entry.sourceSize << "\t" << entry.sourceTime << "\t" << entry.sourceHash << "\t" << entry.convertedPath << "\t" << entry.format << "\t" << entry.flags << "\n";
+	lock.unlock();
+
+	auto path = GetManifestPath();
+	std::error_code ec;
+	std::filesystem::create_directories(ufile::get_path_from_filename(path), ec);
+	// Write to a temporary file first, so an interrupted write doesn't leave a broken manifest behind
+	auto tmpPath = path + ".tmp";
+	{
+		std::ofstream f {tmpPath, std::ios::trunc};
+		if(!f)
+			return;
+		f << ss.str();
+	}
+	std::filesystem::rename(tmpPath, path, ec);
+}
+
+TextureConversionManifest::LookupResult TextureConversionManifest::Find(const std::string &identity, std::string &outConvertedPath, uint32_t *optOutFlags)
+{
+	std::unique_lock lock {m_mutex};
+	auto it = m_entries.find(identity);
+	if(it == m_entries.end())
+		return LookupResult::NotFound;
+	auto &entry = it->second;
+	if(entry.validated) {
+		outConvertedPath = entry.convertedPath;
+		if(optOutFlags)
+			*optOutFlags = entry.flags;
+		return LookupResult::Found;
+	}
+	auto convertedStats = get_file_stats(entry.convertedPath);
+	if(convertedStats.has_value() == false) {
+		// Converted file has been deleted
+		m_entries.erase(it);
+		m_dirty = true;
+		return LookupResult::NotFound;
+	}
+	if(entry.sourcePath != entry.convertedPath) {
+		auto sourceStats = get_file_stats(entry.sourcePath);
+		if(sourceStats.has_value() && (sourceStats->size != entry.sourceSize || sourceStats->time != entry.sourceTime)) {
+			// The file has been touched, only the content can tell whether it has actually changed.
+			// Without a recorded hash we have to assume that it has.
+			if(entry.sourceHash == 0) {
+				m_entries.erase(it);
+				m_dirty = true;
+				return LookupResult::Outdated;
+			}
+			// Hashing reads the entire file, which is left to the caller's worker thread (see Revalidate)
+			outConvertedPath = entry.convertedPath;
+			return LookupResult::NeedsRevalidation;
+		}
+		// If the source file doesn't exist anymore, the converted file is the only version left, so we'll keep using it
+	}
+	entry.validated = true;
+	outConvertedPath = entry.convertedPath;
+	if(optOutFlags)
+		*optOutFlags = entry.flags;
+	return LookupResult::Found;
+}
+
+bool TextureConversionManifest::Revalidate(const std::string &identity, std::string &outConvertedPath)
+{
+	std::unique_lock lock {m_mutex};
+	auto it = m_entries.find(identity);
+	if(it == m_entries.end())
+		return false;
+	auto entry = it->second;
+	lock.unlock();
+
+	// The lock is not held while hashing, the entry may have been replaced in the meantime
+	auto sourceStats = get_file_stats(entry.sourcePath);
+	auto hash = (entry.sourceHash != 0) ? calc_file_hash(entry.sourcePath) : std::optional<uint64_t> {};
+	if(sourceStats.has_value() == false || hash.has_value() == false || *hash != entry.sourceHash)
+		return false;
+
+	lock.lock();
+	it = m_entries.find(identity);
+	if(it == m_entries.end() || it->second.sourcePath != entry.sourcePath || it->second.sourceHash != entry.sourceHash)
+		return false;
+	it->second.sourceSize = sourceStats->size;
+	it->second.sourceTime = sourceStats->time;
+	it->second.validated = true;
+	m_dirty = true;
+	outConvertedPath = it->second.convertedPath;
+	return true;
+}
+
+void TextureConversionManifest::Update(const std::string &identity, const std::string &sourcePath, const std::string &convertedPath, const std::string &format, uint32_t flags, bool hashSource)
+{
+	Entry entry {};
+	entry.sourcePath = sourcePath;
+	entry.convertedPath = convertedPath;
+	entry.format = format;
+	entry.flags = flags;
+	entry.validated = true;
+	if(sourcePath != convertedPath) {
+		auto stats = get_file_stats(sourcePath);
+		if(stats.has_value()) {
+			entry.sourceSize = stats->size;
+			entry.sourceTime = stats->time;
+			if(hashSource)
+				entry.sourceHash = calc_file_hash(sourcePath).value_or(0);
+		}
+	}
+	std::unique_lock lock {m_mutex};
+	m_entries[identity] = std::move(entry);
+	m_dirty = true;
+}
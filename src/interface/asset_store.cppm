@@ -0,0 +1,58 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <cinttypes>
+#include <chrono>
+
+export module pragma.modules.scenekit:asset_store;
+
+export namespace pragma::modules::scenekit {
+	// Content-addressed store for data that is shared between render job files. Blobs are stored lz4-compressed
+	// under the hash of their uncompressed contents, so identical data is only written to disk once.
+	class AssetStore {
+	  public:
+		struct Hash {
+			uint64_t a = 0;
+			uint64_t b = 0;
+			bool operator==(const Hash &other) const = default;
+			std::string ToString() const;
+		};
+		struct ChunkRef {
+			Hash hash;
+			uint32_t size = 0;
+			uint32_t reserved = 0;
+		};
+		static Hash CalcHash(const void *data, size_t size);
+		// Splits the data into content-defined chunks. Chunk boundaries only depend on the surrounding bytes, so data that
+		// is identical between two files (e.g. static meshes) results in identical chunks even if it's located at a different offset.
+		static std::vector<std::pair<size_t, size_t>> SplitIntoChunks(const void *data, size_t size);
+
+		AssetStore(const std::string &absRootPath);
+		const std::string &GetRootPath() const { return m_rootPath; }
+		std::string GetBlobPath(const Hash &hash) const;
+		bool HasBlob(const Hash &hash) const;
+		// Writes the blob unless it already exists. Returns false if it had to be written, but writing failed.
+		bool PutBlob(const Hash &hash, const void *data, size_t size) const;
+		bool ReadBlob(const Hash &hash, void *outData, size_t size) const;
+		// Blobs are never removed when a render job file is deleted, since other files may still reference them.
+		// Removes all blobs that aren't in the list and haven't been modified within minAge, returns the number of removed blobs.
+		std::optional<uint32_t> RemoveUnreferencedBlobs(const std::vector<Hash> &referencedBlobs, std::chrono::seconds minAge, std::string &outErr) const;
+
+		// Stores the data as a sequence of chunks, returns nullopt if one of the chunks couldn't be written
+		std::optional<std::vector<ChunkRef>> Put(const void *data, size_t size) const;
+		std::optional<std::vector<uint8_t>> Get(const std::vector<ChunkRef> &chunks, std::string &outErr) const;
+	  private:
+		std::string m_rootPath;
+	};
+	// Asset stores are located next to the render job files that reference them
+	constexpr const char *RENDER_JOB_ASSET_STORE_DIRECTORY = "blobs/";
+};
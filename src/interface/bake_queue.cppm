@@ -0,0 +1,104 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include "definitions.hpp"
+#include <pragma/entities/baseentity_handle.h>
+#include <pragma/entities/baseentity.h>
+#include <sharedutils/util_parallel_job.hpp>
+#include <util_image_buffer.hpp>
+#include <functional>
+#include <future>
+#include <chrono>
+#include <deque>
+
+export module pragma.modules.scenekit:bake_queue;
+
+import pragma.scenekit;
+import :scene;
+
+export namespace pragma::modules::scenekit {
+	// Processes a large number of ambient occlusion bakes (e.g. for an entire model library) in the background.
+	// Jobs for different materials of the same model are merged into a single batch bake (see bake_ambient_occlusion),
+	// so the geometry of a model is only built once. This is a batching queue only: no renderer is kept alive between batches (or targets),
+	// each bake creates its own. Each batch uses a full renderer, so by default only one batch is baked at a time.
+	class AOBakeQueue {
+	  public:
+		using JobId = uint32_t;
+		enum class JobState : uint8_t { Pending = 0, Baking, Writing, Complete, Failed, Cancelled };
+		struct JobInfo {
+			// If no model is specified, the model will be loaded by name once the job is started
+			std::shared_ptr<Model> model = nullptr;
+			std::string modelName;
+			uint32_t materialIndex = 0;
+			// Output path relative to the program path. The image is written as PNG.
+			std::string outputPath;
+			uint32_t width = 512;
+			uint32_t height = 512;
+			uint32_t samples = 20;
+			pragma::scenekit::Scene::DeviceType deviceType = pragma::scenekit::Scene::DeviceType::CPU;
+			bool denoise = true;
+		};
+		using SceneFactory = std::function<std::shared_ptr<Scene>(const JobInfo &)>;
+
+		// If maxConcurrentBatches is 0, one batch is baked at a time
+		AOBakeQueue(const SceneFactory &sceneFactory, uint32_t maxConcurrentBatches = 0);
+		~AOBakeQueue();
+		AOBakeQueue(const AOBakeQueue &) = delete;
+		AOBakeQueue &operator=(const AOBakeQueue &) = delete;
+
+		JobId AddJob(const JobInfo &jobInfo);
+		void Cancel(JobId jobId);
+		void CancelAll();
+		// Called automatically every frame
+		void Update();
+
+		JobState GetJobState(JobId jobId) const;
+		float GetJobProgress(JobId jobId) const;
+		uint32_t GetPendingJobCount() const;
+		uint32_t GetActiveJobCount() const;
+		uint32_t GetCompletedJobCount() const;
+		uint32_t GetFailedJobCount() const;
+		bool IsComplete() const;
+		// Number of models with at least one successfully baked material per minute, only counting the time during which bakes were running
+		float GetThroughput() const;
+
+		void SetMaxConcurrentBatches(uint32_t maxConcurrentBatches);
+		uint32_t GetMaxConcurrentBatches() const;
+	  private:
+		struct Job {
+			JobInfo info;
+			JobState state = JobState::Pending;
+			float progress = 0.f;
+		};
+		struct Batch {
+			std::vector<JobId> jobs;
+			util::ParallelJob<uimg::ImageLayerSet> bakeJob {};
+			std::future<std::vector<bool>> writeResult;
+		};
+		Job *FindJob(JobId jobId);
+		const Job *FindJob(JobId jobId) const;
+		bool StartNextBatch();
+		void FinalizeBake(Batch &batch);
+		void FinalizeWrite(Batch &batch);
+		void SetJobState(Job &job, JobState state);
+
+		SceneFactory m_sceneFactory;
+		uint32_t m_maxConcurrentBatches = 1;
+		JobId m_nextJobId = 0;
+		std::unordered_map<JobId, Job> m_jobs;
+		std::deque<JobId> m_pendingJobs;
+		std::vector<std::unique_ptr<Batch>> m_batches;
+		uint32_t m_numCompleted = 0;
+		uint32_t m_numFailed = 0;
+		uint32_t m_numCompletedModels = 0;
+		std::chrono::steady_clock::duration m_activeTime {};
+		std::optional<std::chrono::steady_clock::time_point> m_lastUpdateTime {};
+		CallbackHandle m_cbThink {};
+	};
+};
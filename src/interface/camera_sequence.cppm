@@ -0,0 +1,95 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include "definitions.hpp"
+#include <sharedutils/util_parallel_job.hpp>
+#include <util_image_buffer.hpp>
+#include <sharedutils/functioncallback.h>
+#include <sharedutils/util_uuid.hpp>
+#include <mathutil/uvec.h>
+#include <mathutil/uquat.h>
+#include <functional>
+#include <optional>
+#include <future>
+#include <deque>
+
+export module pragma.modules.scenekit:camera_sequence;
+
+import pragma.scenekit;
+import :scene;
+
+export namespace pragma::modules::scenekit {
+	// Renders the same scene from a sequence of camera poses (e.g. turntables, flythroughs or light probe grids).
+	// The renderer is only created once, between frames only the camera is updated through the live editing interface,
+	// so the geometry, shaders and acceleration structure are re-used for all frames.
+	class CameraSequenceRenderer {
+	  public:
+		struct Frame {
+			Vector3 position {};
+			Quat rotation = uquat::identity();
+			// Field of view in degrees. If not set, the field of view of the previous frame is kept.
+			std::optional<float> fov {};
+		};
+		enum class State : uint8_t { Pending = 0, Rendering, Complete, Failed, Cancelled };
+		// Called on the main thread once a frame has been rendered
+		using FrameCallback = std::function<void(uint32_t, const uimg::ImageLayerSet &)>;
+
+		// The scene has to be finalized
+		static std::shared_ptr<CameraSequenceRenderer> Create(Scene &scene, const std::string &rendererIdentifier, std::vector<Frame> frames, std::string &outErr);
+		~CameraSequenceRenderer();
+		CameraSequenceRenderer(const CameraSequenceRenderer &) = delete;
+		CameraSequenceRenderer &operator=(const CameraSequenceRenderer &) = delete;
+
+		// Path relative to the program path. Every frame is written with the frame index as suffix, e.g. "render/turntable/frame.png" is
+		// written as "render/turntable/frame_0000.png", "render/turntable/frame_0001.png", etc.
+		void SetOutputPath(const std::string &outputPath);
+		void SetFrameCallback(const FrameCallback &callback);
+
+		bool Start();
+		void Cancel();
+		// Called automatically every frame
+		void Update();
+
+		State GetState() const { return m_state; }
+		bool IsComplete() const;
+		float GetProgress() const;
+		uint32_t GetFrameCount() const;
+		uint32_t GetCompletedFrameCount() const { return m_numCompleted; }
+		// Files written so far (relative to the program path)
+		const std::vector<std::string> &GetOutputFiles() const { return m_outputFiles; }
+		const std::string &GetErrorMessage() const { return m_errorMessage; }
+	  private:
+		struct FrameOutput {
+			bool success = false;
+			std::vector<std::string> files;
+			std::string errorMessage;
+		};
+		CameraSequenceRenderer() = default;
+		bool ApplyFrame(uint32_t frameIndex);
+		bool StartFrame(uint32_t frameIndex);
+		void FinalizeFrame();
+		void FinalizeOutputs();
+		void SetFailed(const std::string &err);
+
+		std::shared_ptr<Renderer> m_renderer = nullptr;
+		util::Uuid m_cameraUuid {};
+		std::vector<Frame> m_frames;
+		std::string m_outputPath;
+		FrameCallback m_frameCallback;
+
+		State m_state = State::Pending;
+		uint32_t m_currentFrame = 0;
+		uint32_t m_numCompleted = 0;
+		util::ParallelJob<uimg::ImageLayerSet> m_job {};
+		std::deque<std::future<FrameOutput>> m_pendingOutputs;
+		std::vector<std::string> m_outputFiles;
+		std::string m_errorMessage;
+		CallbackHandle m_cbThink {};
+	};
+};
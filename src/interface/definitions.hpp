@@ -24,6 +24,7 @@ namespace prosper {
 	class IImage;
 	class IPrimaryCommandBuffer;
 	class IFence;
+	class IBuffer;
 };
 class BaseEntity;
 
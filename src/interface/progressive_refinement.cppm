@@ -11,54 +11,155 @@ module;
 #include <pragma/entities/baseentity_handle.h>
 #include <pragma/entities/baseentity.h>
 #include <material.h>
+#include <chrono>
+#include <array>
+#include <unordered_map>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <queue>
+#include <optional>
 
 export module pragma.modules.scenekit:progressive_refinement;
 
 import pragma.scenekit;
 
 export namespace pragma::modules::scenekit {
+	// Denoises the image of a live renderer in the background while it's still rendering. Incoming tiles are composited into
+	// an input image by a worker thread, which denoises it whenever the configured interval has passed and publishes the result.
 	class DenoiseTexture {
 	  public:
 		enum class DenoisingState : uint8_t { Initial = 0, Denoising, Complete };
+		struct Settings {
+			// Denoise once the received tiles add up to this many full images, i.e. roughly every n samples. 0 disables the sample interval.
+			uint32_t sampleInterval = 0;
+			// Denoise once this many seconds have passed since the last denoise and new tiles have arrived. 0 disables the time interval.
+			float timeInterval = 2.f;
+		};
 		DenoiseTexture(uint32_t w, uint32_t h);
 		~DenoiseTexture();
 
+		void SetSettings(const Settings &settings);
+		Settings GetSettings() const;
+		// Requests a denoise of the current input image, regardless of the interval
 		void Denoise();
 		bool IsDenoising() const;
 		bool IsDenoisingComplete() const;
 		void AppendTile(pragma::scenekit::TileManager::TileData &&tileData);
+		// Returns the most recent denoised image, or nullptr if no image has been denoised yet. The image is never modified after it has been published.
 		std::shared_ptr<uimg::ImageBuffer> GetDenoisedImageData() const;
+		// Incremented every time a new denoised image is published
+		uint32_t GetDenoisedFrameIndex() const { return m_denoisedFrameIndex; }
 	  private:
-		void UpdatePendingTiles();
+		void RunWorker();
+		void CompositeTiles(std::queue<pragma::scenekit::TileManager::TileData> &tiles);
+		bool ShouldDenoise();
 		void RunDenoise();
 
-		std::mutex m_tileMutex;
+		mutable std::mutex m_tileMutex;
+		std::condition_variable m_tileCondition;
+		std::queue<pragma::scenekit::TileManager::TileData> m_pendingTiles;
+		Settings m_settings {};
+		bool m_running = false;
+		bool m_shouldDenoise = false;
+
+		// Only accessed by the worker thread
 		pragma::scenekit::denoise::Denoiser m_denoiser;
-		std::atomic<bool> m_running = false;
-		std::atomic<bool> m_shouldDenoise = false;
-		std::atomic<DenoisingState> m_denoisingState = DenoisingState::Initial;
 		std::shared_ptr<uimg::ImageBuffer> m_inputImage = nullptr;
 		std::shared_ptr<uimg::ImageBuffer> m_denoisedImage = nullptr;
+		bool m_hasNewInput = false;
+		// Number of pixels received since the last denoise
+		uint64_t m_receivedPixels = 0;
+		std::chrono::steady_clock::time_point m_lastDenoiseTime {};
+
+		mutable std::mutex m_outputMutex;
 		std::shared_ptr<uimg::ImageBuffer> m_outputImage = nullptr;
-		std::queue<pragma::scenekit::TileManager::TileData> m_pendingTiles;
+		std::atomic<uint32_t> m_denoisedFrameIndex = 0;
+		std::atomic<DenoisingState> m_denoisingState = DenoisingState::Initial;
 		std::thread m_thread;
 	};
 
+	// Uploads the tiles rendered by a live renderer to a texture. Uploads are asynchronous, the main thread never waits for the GPU.
+	// Up to UPLOAD_SET_COUNT uploads can be in flight, if all of them are busy the new tiles are merged into the next upload.
 	class ProgressiveTexture {
 	  public:
+		static constexpr uint32_t UPLOAD_SET_COUNT = 3;
 		~ProgressiveTexture();
 		void Initialize(pragma::scenekit::Renderer &renderer);
 		void Update();
 		std::shared_ptr<prosper::Texture> GetTexture() const;
+		// Time in milliseconds between a tile being retrieved from the renderer and the upload of the tile being complete on the GPU,
+		// smoothed over the last few uploads
+		float GetDisplayLatency() const { return m_displayLatency; }
+		// Number of updates that were merged into a later upload because all upload sets were in flight
+		uint32_t GetMergedUpdateCount() const { return m_mergedUpdateCount; }
+		// Feeds all rendered tiles into a DenoiseTexture, which denoises the image in the background
+		void SetDenoiseEnabled(bool enabled, const DenoiseTexture::Settings &settings = {});
+		DenoiseTexture *GetDenoiseTexture() { return m_denoiseTexture.get(); }
+
+		// With the preview enabled, the renderer switches to a reduced resolution whenever the scene is edited. The low resolution
+		// image is shown upscaled until the scene hasn't been edited for refineDelay seconds, at which point the renderer
+		// switches back to the full resolution.
+		struct PreviewSettings {
+			bool enabled = false;
+			// The preview is rendered at 1/downscaleFactor of the full resolution
+			uint32_t downscaleFactor = 4;
+			float refineDelay = 0.25f;
+		};
+		void SetPreviewSettings(const PreviewSettings &settings);
+		const PreviewSettings &GetPreviewSettings() const { return m_previewSettings; }
+		bool IsPreviewActive() const { return m_previewActive; }
+		// Has to be called whenever actors of the scene have been synchronized with the renderer
+		void NotifySceneEdited();
+		// Restarts the renderer. If the preview is enabled, the render restarts at the preview resolution.
+		void Restart();
 	  private:
-		std::shared_ptr<prosper::IImage> CreateImage(uint32_t width, uint32_t height, bool onDevice) const;
+		struct UploadSet {
+			std::shared_ptr<prosper::IPrimaryCommandBuffer> cmdBuffer = nullptr;
+			std::shared_ptr<prosper::IFence> fence = nullptr;
+			// Persistently mapped, only grows
+			std::shared_ptr<prosper::IBuffer> stagingBuffer = nullptr;
+			bool inFlight = false;
+			// Time at which the oldest tile of the upload was retrieved from the renderer
+			std::chrono::steady_clock::time_point oldestTileTime {};
+		};
+		struct PendingTile {
+			pragma::scenekit::TileManager::TileData data;
+			// If the tile is replaced by a newer result before it has been uploaded, this remains the time of the first result
+			std::chrono::steady_clock::time_point retrieveTime {};
+			// Render generation of the batch the tile was retrieved with
+			uint32_t generation = 0;
+		};
+		std::shared_ptr<prosper::IImage> CreateImage(uint32_t width, uint32_t height) const;
+		bool ReserveStagingBuffer(UploadSet &uploadSet, uint64_t size);
+		void RetireUploads();
+		bool SetRenderResolution(uint32_t width, uint32_t height);
+		void UpdatePreview();
+		// Discards all tiles the renderer has rendered so far
+		void DiscardRenderedTiles();
+
 		Vector2i m_tileSize;
-		std::shared_ptr<prosper::IPrimaryCommandBuffer> m_cmdBuffer = nullptr;
-		std::shared_ptr<prosper::IFence> m_fence = nullptr;
+		std::array<UploadSet, UPLOAD_SET_COUNT> m_uploadSets;
+		std::unordered_map<uint64_t, PendingTile> m_pendingTiles;
 		std::shared_ptr<prosper::Texture> m_texture = nullptr;
 		std::shared_ptr<prosper::IImage> m_image = nullptr;
-		std::vector<std::shared_ptr<prosper::IImage>> m_mipImages;
 		std::shared_ptr<pragma::scenekit::Renderer> m_renderer = nullptr;
+		float m_displayLatency = 0.f;
+		uint32_t m_mergedUpdateCount = 0;
+		std::unique_ptr<DenoiseTexture> m_denoiseTexture = nullptr;
+
+		PreviewSettings m_previewSettings {};
+		Vector2i m_fullResolution {};
+		// Tiles of the preview are uploaded to this image, which is then blitted to the full resolution image
+		std::shared_ptr<prosper::IImage> m_previewImage = nullptr;
+		bool m_previewActive = false;
+		bool m_previewRequested = false;
+		// Incremented whenever the render resolution changes. Tiles of a previous generation are never uploaded.
+		uint32_t m_renderGeneration = 0;
+		// Generation the contents of the preview image belong to
+		std::optional<uint32_t> m_previewImageGeneration {};
+		std::chrono::steady_clock::time_point m_lastEditTime {};
 		CallbackHandle m_cbThink {};
 	};
 };
@@ -0,0 +1,146 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <cinttypes>
+
+export module pragma.modules.scenekit:render_queue;
+
+import pragma.scenekit;
+
+export namespace pragma::modules::scenekit {
+	// The render queue is a spool directory that is shared between the client and any number of worker processes.
+	// Every job has its own sub-directory named after the job id, which contains the render job file, the job info, the
+	// job status and, once the job is complete, the rendered images. Workers claim jobs by locking the job directory,
+	// the lock is released by the OS if a worker dies, in which case the job is claimed by the next worker (see RENDER_QUEUE_MAX_JOB_ATTEMPTS).
+	enum class RenderQueueJobState : uint8_t {
+		// The render job file is still being written
+		Submitting = 0,
+		Queued,
+		Rendering,
+		Complete,
+		Failed,
+	};
+	struct RenderQueueJobInfo {
+		std::string name;
+		std::string renderer = "cycles";
+		// Relative to the job directory. Additional image layers are written next to it.
+		// Must be a plain file name, see is_valid_render_queue_output_file_name.
+		std::string outputFileName = "output.png";
+
+		// Split jobs aren't rendered themselves, instead they have one part job per region. The last worker to complete
+		// a part merges all parts into the output of the split job. Like checkpoints, this is only supported for equirectangular panoramas (see :split_render).
+		uint32_t splitCount = 0;
+		// Region retry: If greater than 1, the worker renders the frame as this many regions (strips, as with split jobs) one after
+		// another and keeps every completed region in the job directory as a checkpoint. If the job is interrupted, only the regions
+		// without a checkpoint are rendered again. This is not a resumable render: The renderer's sampling state can't be saved, so an
+		// interrupted region starts over, and the result is not bit-identical to rendering the frame in one piece (see :split_render).
+		uint32_t checkpointCount = 0;
+		// Only used by split and checkpointed jobs
+		float horizontalRange = 360.f;
+		bool denoise = true;
+		// Part jobs render a region of the render job file of their split job
+		std::string splitJobId;
+		uint32_t splitIndex = 0;
+	};
+	struct RenderQueueJobStatus {
+		RenderQueueJobState state = RenderQueueJobState::Submitting;
+		float progress = 0.f;
+		std::string message;
+		// Relative to the job directory
+		std::vector<std::string> outputFiles;
+		// Number of times the job has been claimed by a worker since it was queued
+		uint32_t attempts = 0;
+	};
+	// A job that is still marked as rendering after this many claims has repeatedly crashed its worker and is marked as failed
+	// instead of being claimed again
+	constexpr uint32_t RENDER_QUEUE_MAX_JOB_ATTEMPTS = 3;
+	constexpr const char *RENDER_QUEUE_JOB_FILE_NAME = "job.prt";
+	// Partial result of a part job, see write_image_layer_set
+	constexpr const char *RENDER_QUEUE_PART_FILE_NAME = "part.pls";
+	// Output files must be located in the job directory, so the file name may not contain path separators or "..".
+	bool is_valid_render_queue_output_file_name(const std::string &fileName);
+
+	// Exclusive lock on a file, held until the object is destroyed
+	class RenderQueueLock {
+	  public:
+		static std::unique_ptr<RenderQueueLock> TryAcquire(const std::string &absPath);
+		// Waits until the lock is available
+		static std::unique_ptr<RenderQueueLock> Acquire(const std::string &absPath);
+		~RenderQueueLock();
+	  private:
+		static std::unique_ptr<RenderQueueLock> Acquire(const std::string &absPath, bool wait);
+		RenderQueueLock() = default;
+#ifdef _WIN32
+		void *m_handle = nullptr;
+#else
+		int m_fd = -1;
+#endif
+	};
+
+	class RenderQueue {
+	  public:
+		struct ClaimedJob {
+			std::string jobId;
+			RenderQueueJobInfo info;
+			// The status that was written when the job was claimed
+			RenderQueueJobStatus status;
+			std::unique_ptr<RenderQueueLock> lock;
+		};
+		RenderQueue(const std::string &absSpoolPath);
+		const std::string &GetSpoolPath() const { return m_spoolPath; }
+		std::string GetJobPath(const std::string &jobId) const;
+		// Job ids start with the submission time, so sorting them by name sorts them by age
+		std::string CreateJobId() const;
+		std::string GetSplitPartJobId(const std::string &splitJobId, uint32_t index) const;
+		// Absolute path of the checkpoint for the given region of a checkpointed job, see write_image_layer_set
+		std::string GetCheckpointPath(const std::string &jobId, uint32_t index) const;
+		std::vector<std::string> GetJobIds() const;
+
+		bool WriteJobInfo(const std::string &jobId, const RenderQueueJobInfo &info) const;
+		std::optional<RenderQueueJobInfo> ReadJobInfo(const std::string &jobId) const;
+		bool WriteJobStatus(const std::string &jobId, const RenderQueueJobStatus &status) const;
+		std::optional<RenderQueueJobStatus> ReadJobStatus(const std::string &jobId) const;
+
+		// Claims the oldest job that is waiting to be rendered. Jobs that are marked as rendering, but aren't locked by anyone,
+		// belonged to a worker that has died and can be claimed again, unless they have reached RENDER_QUEUE_MAX_JOB_ATTEMPTS.
+		// Split jobs whose parts are all complete, but which haven't been merged (e.g. because the merging worker died), are merged by this call.
+		std::optional<ClaimedJob> ClaimNextJob() const;
+		// Removes the job directory, unless a worker is currently rendering the job. Removing a split job removes its parts as well.
+		bool RemoveJob(const std::string &jobId) const;
+		// Queues a failed job again. Checkpoints of the job are kept, so only the regions without a checkpoint are rendered again. Resuming a split job resumes its failed parts.
+		bool ResumeJob(const std::string &jobId) const;
+		// Called by workers once they've completed a part job. If all parts of the split job are complete, they are merged
+		// (and denoised) and the split job is marked as complete or failed. Returns true if the split job was completed by this call.
+		// If another worker is currently merging or checking the parts, this waits for it, so the last part is never missed.
+		bool TryCompleteSplitJob(const std::string &splitJobId) const;
+	  private:
+		// The lock of the split job has to be held
+		bool CompleteSplitJob(const std::string &splitJobId, const RenderQueueJobInfo &info) const;
+		std::string m_spoolPath;
+	};
+
+	// The functions below are only available in the module, not in the standalone worker
+	RenderQueue &get_render_queue();
+	// Writes the render job to the render queue in the background and returns the job id. The job is marked as queued once the file is complete.
+	// If info.splitCount is greater than 1, the frame is split into that many regions which are rendered as separate jobs (see :split_render).
+	std::optional<std::string> submit_render_queue_job(pragma::scenekit::Scene &scene, const RenderQueueJobInfo &info);
+	// Starts worker processes for the render queue. If processCount is 0, one process is started per NUMA node.
+	// The available cores are split evenly between the processes. Returns the number of started processes.
+	uint32_t start_render_queue_workers(uint32_t processCount = 0);
+	// Terminates all worker processes. Jobs they were rendering are picked up again by the next worker.
+	void stop_render_queue_workers();
+	// Forgets about the worker processes without terminating them, they keep working through the queue on their own
+	void detach_render_queue_workers();
+	uint32_t get_render_queue_worker_count();
+};
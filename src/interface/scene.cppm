@@ -13,6 +13,11 @@ module;
 #include <pragma/lua/luaobjectbase.h>
 #include <sharedutils/util_hair.hpp>
 #include <sharedutils/util_parallel_job.hpp>
+#include <util_image_buffer.hpp>
+#include <functional>
+#include <map>
+#include <sharedutils/util_uuid.hpp>
+#include <sharedutils/functioncallback.h>
 #include <material.h>
 
 export module pragma.modules.scenekit:scene;
@@ -21,7 +26,28 @@ import pragma.scenekit;
 
 export namespace pragma::modules::scenekit {
 	class Shader;
+	class Scene;
+	class ProgressiveTexture;
 	util::ParallelJob<std::shared_ptr<uimg::ImageBuffer>> denoise(uimg::ImageBuffer &imgBuffer);
+
+	// Adaptive sampling for bake render modes (opt-in). Texels start with minSamples and the renderer only keeps sampling texels whose
+	// noise estimate is still above noiseThreshold, up to the sample count of the scene (which acts as the cap).
+	struct AdaptiveBakeSettings {
+		uint32_t minSamples = 16;
+		float noiseThreshold = 0.01f;
+	};
+
+	// Either model or entity has to be set
+	struct AOBakeTarget {
+		std::shared_ptr<Model> model = nullptr;
+		EntityHandle entity {};
+		uint32_t materialIndex = 0;
+	};
+	// Bakes all targets in a single job. Geometry and shaders of each model are only built once and shared by all targets of that model.
+	// Each target still gets its own scene and renderer, which are only created once the job reaches it (createScene is called from the
+	// job's thread), so only one of them is alive at a time. The result contains one layer per target, named by get_ao_bake_batch_layer_name.
+	util::ParallelJob<uimg::ImageLayerSet> bake_ambient_occlusion(const std::vector<AOBakeTarget> &targets, const std::function<std::shared_ptr<Scene>()> &createScene, const std::string &renderer = "cycles");
+	std::string get_ao_bake_batch_layer_name(uint32_t targetIndex);
 	class Cache {
 	  public:
 		struct MeshData {
@@ -34,6 +60,14 @@ export namespace pragma::modules::scenekit {
 
 			pragma::scenekit::PShader shader = nullptr;
 		};
+		struct AOBakeMesh {
+			pragma::scenekit::PMesh mesh = nullptr;
+		};
+		struct AOBakeSubMesh {
+			ModelSubMesh *subMesh = nullptr;
+			pragma::scenekit::PShader shader = nullptr;
+			uint32_t materialIndex = 0;
+		};
 		Cache(pragma::scenekit::Scene::RenderMode renderMode);
 		void AddParticleSystem(pragma::CParticleSystemComponent &ptc, const Vector3 &camPos, const Mat4 &vp, float nearZ, float farZ);
 		pragma::scenekit::PObject AddEntity(BaseEntity &ent, std::vector<ModelSubMesh *> *optOutTargetMeshes = nullptr, const std::function<bool(ModelMesh &, const umath::ScaledTransform &)> &meshFilter = nullptr,
@@ -48,9 +82,18 @@ export namespace pragma::modules::scenekit {
 		pragma::scenekit::PMesh BuildMesh(const std::string &meshName, const std::vector<std::shared_ptr<MeshData>> &meshDatas, const std::optional<umath::ScaledTransform> &pose = {}) const;
 		void AddAOBakeTarget(BaseEntity &ent, uint32_t matIndex, std::shared_ptr<pragma::scenekit::Object> &oAo, std::shared_ptr<pragma::scenekit::Object> &oEnv);
 		void AddAOBakeTarget(Model &mdl, uint32_t matIndex, std::shared_ptr<pragma::scenekit::Object> &oAo, std::shared_ptr<pragma::scenekit::Object> &oEnv);
+		// Selects the sub-meshes for an ambient occlusion bake and creates their shaders. Has to be called on the main thread,
+		// the model has to be kept alive until the meshes have been built.
+		std::vector<AOBakeSubMesh> PrepareAOBakeMeshes(BaseEntity *optEnt, Model &mdl);
+		// Builds one mesh per material index of the model, which can be shared between multiple ambient occlusion bake scenes.
+		// Only reads the model's geometry, so it can be called from a worker thread.
+		std::unordered_map<uint32_t, AOBakeMesh> BuildAOBakeMeshes(Model &mdl, const std::vector<AOBakeSubMesh> &subMeshes);
 		pragma::scenekit::ModelCache &GetModelCache() const { return *m_mdlCache; }
 		pragma::scenekit::ShaderCache &GetShaderCache() const { return *m_shaderCache; }
 		std::unordered_map<pragma::scenekit::Shader *, std::shared_ptr<Shader>> &GetRTShaderToShaderTable() const { return m_rtShaderToShader; }
+		// Textures requested by shaders created through this cache are limited to this size, see set_max_texture_dimension
+		void SetMaxTextureDimension(uint32_t maxDimension) { m_maxTextureDimension = maxDimension; }
+		uint32_t GetMaxTextureDimension() const { return m_maxTextureDimension; }
 	  private:
 		void AddAOBakeTarget(BaseEntity *optEnt, Model &mdl, uint32_t matIndex, std::shared_ptr<pragma::scenekit::Object> &oAo, std::shared_ptr<pragma::scenekit::Object> &oEnv);
 		struct ModelCacheInstance {
@@ -83,6 +126,7 @@ export namespace pragma::modules::scenekit {
 		std::shared_ptr<pragma::scenekit::ShaderCache> m_shaderCache = nullptr;
 		mutable std::unordered_map<pragma::scenekit::Shader *, std::shared_ptr<Shader>> m_rtShaderToShader {};
 		pragma::scenekit::Scene::RenderMode m_renderMode = pragma::scenekit::Scene::RenderMode::RenderImage;
+		uint32_t m_maxTextureDimension = 0;
 	};
 
 	class Scene : public std::enable_shared_from_this<Scene> {
@@ -92,14 +136,25 @@ export namespace pragma::modules::scenekit {
 		void Add3DSkybox(pragma::CSceneComponent &gameScene, pragma::CSkyCameraComponent &skyCam, const Vector3 &camPos);
 		void SetAOBakeTarget(Model &mdl, uint32_t matIndex);
 		void SetAOBakeTarget(BaseEntity &ent, uint32_t matIndex);
+		// Uses a mesh pre-built by meshCache as bake target, see Cache::BuildAOBakeMeshes. The meshes are shared, only the objects are created per scene.
+		void SetAOBakeTarget(const Cache &meshCache, const Cache::AOBakeMesh &target, const std::vector<pragma::scenekit::PMesh> &occluders);
 		void AddLightmapBakeTarget(BaseEntity &ent);
 		void SetLightmapDataCache(LightmapDataCache *cache);
+		void SetAdaptiveBakeSettings(const AdaptiveBakeSettings &settings);
 		void Finalize();
+		bool IsFinalized() const { return m_finalized; }
 
 		pragma::scenekit::Object *FindObject(const std::string &name);
 		const pragma::scenekit::Object *FindObject(const std::string &name) const { return const_cast<Scene *>(this)->FindObject(name); }
 
 		Cache &GetCache();
+		// 0 means full resolution. Has to be set before any objects are added to the scene.
+		void SetMaxTextureDimension(uint32_t maxDimension);
+		uint32_t GetMaxTextureDimension() const;
+		// Preview scenes limit their textures to the output resolution (see calc_preview_max_texture_dimension).
+		// Has to be set after the resolution and before any objects are added to the scene.
+		void SetPreview(bool preview);
+		bool IsPreview() const { return m_preview; }
 
 		pragma::scenekit::Scene &operator*() { return *m_rtScene; };
 		const pragma::scenekit::Scene &operator*() const { return *m_rtScene; };
@@ -115,6 +170,7 @@ export namespace pragma::modules::scenekit {
 		std::shared_ptr<Cache> m_cache = nullptr;
 		std::shared_ptr<pragma::scenekit::Scene> m_rtScene = nullptr;
 		bool m_finalized = false;
+		bool m_preview = false;
 	};
 
 	class Renderer : public std::enable_shared_from_this<Renderer> {
@@ -122,6 +178,29 @@ export namespace pragma::modules::scenekit {
 		Renderer(Scene &scene, pragma::scenekit::Renderer &renderer);
 		void ReloadShaders();
 
+		// The progressive texture (if there is one) controls the preview resolution, so restarts and edits are routed through it
+		void SetProgressiveTexture(const std::shared_ptr<ProgressiveTexture> &texture);
+		void Restart();
+		void NotifySceneEdited();
+
+		// Batched live editing: Instead of synchronizing every changed entity individually, entities are marked as dirty and
+		// synchronized together once per frame, in a single scene edit. Watched entities are marked as dirty automatically
+		// whenever one of their components reports a change.
+		// The sync function updates the actor of the entity without committing it and returns false if the entity has no actor,
+		// SyncActors commits all staged actors afterwards. The watch function registers the given callback with every
+		// component change the sync function depends on and returns the callback handles.
+		using ActorSyncFunction = std::function<bool(pragma::scenekit::Renderer &, BaseEntity &)>;
+		using ActorWatchFunction = std::function<std::vector<CallbackHandle>(BaseEntity &, const std::function<void()> &)>;
+		void SetActorSyncFunctions(const ActorSyncFunction &syncFunction, const ActorWatchFunction &watchFunction);
+		void MarkActorDirty(BaseEntity &ent);
+		void WatchActor(BaseEntity &ent);
+		void UnwatchActor(BaseEntity &ent);
+		// Synchronizes the given entities in a single scene edit and returns the number of synchronized actors
+		uint32_t SyncActors(const std::vector<BaseEntity *> &ents);
+		// Called automatically once per frame while there are dirty entities
+		uint32_t SyncDirtyActors();
+		~Renderer();
+
 		Scene &GetScene() { return *m_scene; }
 		const Scene &GetScene() const { return const_cast<Renderer *>(this)->GetScene(); }
 
@@ -132,6 +211,14 @@ export namespace pragma::modules::scenekit {
 	  private:
 		std::shared_ptr<Scene> m_scene = nullptr;
 		std::shared_ptr<pragma::scenekit::Renderer> m_renderer = nullptr;
+		std::weak_ptr<ProgressiveTexture> m_progressiveTexture {};
+
+		void UpdateSyncCallback();
+		ActorSyncFunction m_actorSyncFunction {};
+		ActorWatchFunction m_actorWatchFunction {};
+		std::map<util::Uuid, EntityHandle> m_dirtyActors;
+		std::map<util::Uuid, std::vector<CallbackHandle>> m_watchedActors;
+		CallbackHandle m_cbSyncActors {};
 	};
 	pragma::scenekit::NodeManager &get_node_manager();
 };
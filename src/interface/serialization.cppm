@@ -0,0 +1,150 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <future>
+#include <fstream>
+#include <optional>
+#include <condition_variable>
+#include <sharedutils/datastream.h>
+
+export module pragma.modules.scenekit:serialization;
+
+import pragma.scenekit;
+
+export namespace pragma::modules::scenekit {
+	// Writes data to a file in fixed-size chunks, regardless of the size of the individual writes. With a background thread,
+	// Write only copies the data into the current chunk, the disk I/O happens on the writer thread. The data is written to a uniquely named temporary file next to the path and
+	// only moved to the actual path by Close, so readers never see a partially written file and concurrent writers of the same path don't interfere.
+	class StreamingFileWriter {
+	  public:
+		struct Settings {
+			size_t chunkSize = 4 * 1'024 * 1'024;
+			bool backgroundThread = false;
+			// Write blocks if this many chunks are waiting for the writer thread, which bounds the memory overhead
+			uint32_t maxQueuedChunks = 8;
+		};
+		static std::unique_ptr<StreamingFileWriter> Open(const std::string &absPath, const Settings &settings = {});
+		~StreamingFileWriter();
+		void Write(const void *data, size_t size);
+		// Overwrites data that has already been written, e.g. a header whose contents are only known at the end.
+		// Patches are applied by Close.
+		void Patch(uint64_t offset, const void *data, size_t size);
+		// Returns false if any of the data could not be written
+		bool Close();
+		uint64_t GetBytesWritten() const { return m_bytesWritten; }
+	  private:
+		StreamingFileWriter(const std::string &absPath, const Settings &settings);
+		void SubmitChunk();
+		void WriteChunk(const std::vector<uint8_t> &chunk);
+		void RunWriter();
+
+		std::string m_path;
+		std::string m_tmpPath;
+		Settings m_settings;
+		std::ofstream m_file;
+		std::vector<uint8_t> m_chunk;
+		struct PatchData {
+			uint64_t offset = 0;
+			std::vector<uint8_t> data;
+		};
+		std::vector<PatchData> m_patches;
+		std::atomic<uint64_t> m_bytesWritten = 0;
+		std::atomic<bool> m_failed = false;
+		bool m_closed = false;
+
+		std::thread m_thread;
+		std::queue<std::vector<uint8_t>> m_queue;
+		std::mutex m_queueMutex;
+		std::condition_variable m_queueCondition;
+		bool m_writerRunning = false;
+	};
+
+	// Render job files (.prt) are a versioned container around the serialized scene. The header and section table are always
+	// uncompressed, each section can either be compressed (lz4, in independent blocks) or stored uncompressed.
+	// Files written without the container are detected as legacy files.
+	constexpr uint32_t RENDER_JOB_FILE_VERSION = 1;
+	enum class RenderJobSectionType : uint32_t { Scene = 0 };
+	enum class RenderJobCompression : uint32_t {
+		None = 0,
+		Lz4,
+		// The section only contains references to chunks in the asset store next to the file
+		AssetStore,
+	};
+	struct RenderJobFileSettings {
+		// Writes the serialized scene without the container. The renderer's own render job loader only understands this format,
+		// so it remains the default: render jobs are not compressed unless this is disabled (only the render worker and
+		// read_render_job_file can read the container). The settings below only apply to the container.
+		bool legacyFormat = true;
+		RenderJobCompression compression = RenderJobCompression::Lz4;
+		// Uncompressed size of the blocks a section is compressed in
+		uint32_t blockSize = 4 * 1'024 * 1'024;
+		// Stores the sections in the shared asset store, so data that is identical between multiple render job files (e.g. the
+		// frames of an image sequence) is only written once
+		bool useAssetStore = false;
+	};
+	void set_render_job_file_settings(const RenderJobFileSettings &settings);
+	const RenderJobFileSettings &get_render_job_file_settings();
+
+	class RenderJobFile {
+	  public:
+		struct Section {
+			RenderJobSectionType type = RenderJobSectionType::Scene;
+			RenderJobCompression compression = RenderJobCompression::None;
+			uint64_t offset = 0;
+			uint64_t size = 0;
+			uint64_t uncompressedSize = 0;
+			uint32_t blockSize = 0;
+		};
+		static std::unique_ptr<RenderJobFile> Open(const std::string &absPath, std::string &outErr);
+		bool IsLegacy() const { return m_legacy; }
+		uint32_t GetVersion() const { return m_version; }
+		const std::vector<Section> &GetSections() const { return m_sections; }
+		const Section *FindSection(RenderJobSectionType type) const;
+		// Returns the uncompressed contents of the section
+		std::optional<DataStream> ReadSection(RenderJobSectionType type, std::string &outErr);
+		// Returns the section as it is stored in the file
+		std::optional<std::vector<uint8_t>> ReadSectionData(const Section &section, std::string &outErr);
+	  private:
+		RenderJobFile() = default;
+		std::string m_path;
+		std::ifstream m_file;
+		bool m_legacy = false;
+		uint32_t m_version = 0;
+		uint64_t m_fileSize = 0;
+		std::vector<Section> m_sections;
+	};
+	// Writes the data of a serialized scene as a render job file
+	bool write_render_job_file(const std::string &absPath, const void *sceneData, size_t sceneDataSize, const RenderJobFileSettings &settings, bool backgroundThread = false);
+	// Returns the serialized scene of a render job file, regardless of whether it's a legacy file or not
+	std::optional<DataStream> read_render_job_file(const std::string &absPath, std::string &outErr);
+	// Rewrites a legacy render job file in the container format, regardless of RenderJobFileSettings::legacyFormat. If outAbsPath is empty, the file is converted in place.
+	// Files that are already in the current format are left untouched.
+	bool convert_legacy_render_job(const std::string &absPath, std::string &outErr, const std::string &outAbsPath = {});
+	// Removes the blobs of the asset store in the directory that aren't referenced by any of the render job files in it anymore.
+	// Blobs that are younger than minAge are kept, since they may belong to a render job file that is still being written.
+	// Returns the number of removed blobs.
+	std::optional<uint32_t> collect_render_job_asset_store_garbage(const std::string &absDirectory, std::string &outErr, std::chrono::seconds minAge = std::chrono::hours {1});
+
+	// Serializes the scene to a render job file (.prt) at the given path (relative to the program directory).
+	// The renderer can only serialize a scene into memory, so the scene is always serialized in full on the calling thread first,
+	// only writing the file is streamed. If writeInBackground is set, writing happens on a separate thread and the returned
+	// future becomes ready once the file is complete.
+	std::shared_future<bool> save_render_job(pragma::scenekit::Scene &scene, const std::string &relPath, const std::string &fileName, bool writeInBackground = false);
+	// Blocks until all render job files that are being written in the background are complete.
+	// Returns false if any of the writes since the last call have failed.
+	bool wait_for_render_job_writes();
+};
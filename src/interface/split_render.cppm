@@ -0,0 +1,53 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <util_image_buffer.hpp>
+#include <string>
+#include <vector>
+#include <optional>
+#include <cinttypes>
+
+export module pragma.modules.scenekit:split_render;
+
+import pragma.scenekit;
+
+export namespace pragma::modules::scenekit {
+	// A frame can be split into vertical strips that are rendered by separate processes and merged afterwards.
+	// This is only supported for equirectangular panoramas: Every strip is rendered with the camera rotated towards the center
+	// of the strip and a horizontal range that only covers the strip, so every pixel covers the same direction as in the full image.
+	// The result is not bit-identical to a full render though, since the renderer seeds its samples by the pixel coordinates of
+	// the strip rather than of the full image. The noise differs, but it is the same kind of noise, so there are no visible seams.
+	struct SplitRenderRegion {
+		uint32_t index = 0;
+		uint32_t count = 1;
+		// Horizontal range of the full panorama in degrees
+		float horizontalRange = 360.f;
+	};
+	struct SplitRenderStrip {
+		uint32_t x = 0;
+		uint32_t width = 0;
+	};
+	SplitRenderStrip get_split_render_strip(uint32_t imageWidth, uint32_t index, uint32_t count);
+	// Returns false if the scene camera isn't an equirectangular panorama, the only projection a frame can be split for
+	bool is_split_render_supported(pragma::scenekit::Scene &scene, std::string &outErr);
+	// Changes the camera and resolution of the scene to only render the given region
+	bool apply_split_render_region(pragma::scenekit::Scene &scene, const SplitRenderRegion &region, std::string &outErr);
+
+	// Writes the color layer (or the only layer) to the output path, any other layers are written next to it with the layer name as suffix.
+	// The image format is determined by the extension of the output path (png, hdr, tga, bmp, jpg).
+	bool write_image_layers(const uimg::ImageLayerSet &layers, const std::string &outputPath, std::vector<std::string> &outFiles, std::string &outErr);
+	// Writes all layers of a partial render, uncompressed and at full precision
+	bool write_image_layer_set(const std::string &absPath, const uimg::ImageLayerSet &layers);
+	std::optional<uimg::ImageLayerSet> read_image_layer_set(const std::string &absPath, std::string &outErr);
+	// Stitches the strips back together. The parts have to be in order and contain the same layers.
+	std::optional<uimg::ImageLayerSet> merge_split_renders(const std::vector<uimg::ImageLayerSet> &parts, std::string &outErr);
+	// Denoises the color layer of the merged image, using the albedo and normal layers as guides if they exist.
+	// This has to happen after the merge, otherwise the denoiser would produce visible seams between the strips.
+	bool denoise_image_layer_set(uimg::ImageLayerSet &layers);
+};
@@ -9,9 +9,92 @@ module;
 
 #include <optional>
 #include <string>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <material.h>
 
 export module pragma.modules.scenekit:texture;
 
 export namespace pragma::modules::scenekit {
+	// Blocks until the texture is available in a format the renderer can use
 	std::optional<std::string> prepare_texture(const std::string &texPath, const std::optional<std::string> &defaultTexture = {}, bool translucent = false);
+
+
+	// Textures that have to be converted first are read back from the GPU on the next call to flush_texture_preparation,
+	// and then encoded to disk on a pool of worker threads. Requests for the same texture share the same future.
+	// Must be called from the main thread.
+	std::shared_future<std::optional<std::string>> prepare_texture_async(const std::string &texPath, const std::optional<std::string> &defaultTexture = {}, bool translucent = false);
+	// Reads back all pending textures in one go and hands them to the worker threads
+	void flush_texture_preparation();
+	// Requests all textures used by the material, so they can be converted in parallel before the shaders need them
+	void prefetch_material_textures(Material &mat);
+	// Waits for all pending conversions and stops the worker threads
+	void close_texture_preparation();
+
+	// Textures that are larger than the max dimension are downscaled (by powers of two) before they are handed to the renderer.
+	// The downscaled variants are cached next to the full resolution conversion, with a "_max<dimension>" suffix. 0 means no limit.
+	void set_max_texture_dimension(uint32_t maxDimension);
+	uint32_t get_max_texture_dimension();
+	class MaxTextureDimensionScope {
+	  public:
+		MaxTextureDimensionScope(uint32_t maxDimension);
+		~MaxTextureDimensionScope();
+	  private:
+		uint32_t m_prevMaxDimension;
+	};
+	// Texture limit for previews: the larger dimension of the output image. Textures that are magnified in close-ups lose detail,
+	// which is acceptable for a preview, but textures that are minified (the common case) don't.
+	uint32_t calc_preview_max_texture_dimension(uint32_t width, uint32_t height);
+
+	// Estimated memory the renderer needs for a converted texture
+	struct TextureMemoryInfo {
+		std::string name;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		uint64_t size = 0;
+	};
+	std::vector<TextureMemoryInfo> get_texture_memory_report();
+	void print_texture_memory_report();
+
+	// Keeps track of which textures have already been converted (or can be used as is), so they don't have to be searched for
+	// in all mounted addons every time. Entries are keyed by the converted texture path (e.g. "materials/x/y.dds").
+	// The manifest is stored in addons/converted/ and loaded once per session.
+	class TextureConversionManifest {
+	  public:
+		enum class LookupResult : uint8_t { NotFound = 0, Found, Outdated, NeedsRevalidation };
+		struct Entry {
+			std::string sourcePath;
+			uint64_t sourceSize = 0;
+			int64_t sourceTime = 0;
+			// 0 if the source hasn't been hashed, in which case only the file stats are compared
+			uint64_t sourceHash = 0;
+			std::string convertedPath;
+			std::string format;
+			uint32_t flags = 0;
+			// Set once the files have been checked this session (not stored in the manifest)
+			bool validated = false;
+		};
+		static TextureConversionManifest &GetInstance();
+		static std::string GetIdentity(const std::string &texPath);
+
+		// If the source texture has changed since the conversion, the entry is removed and LookupResult::Outdated is returned.
+		// The files of an entry are only checked on the first lookup of a session. Find never reads file contents: if the source
+		// has been touched and a hash was recorded, LookupResult::NeedsRevalidation is returned and Revalidate has to be called.
+		LookupResult Find(const std::string &identity, std::string &outConvertedPath, uint32_t *optOutFlags = nullptr);
+		// Hashes the source file and compares it with the recorded hash. Returns true (and marks the entry as validated) if the
+		// content hasn't changed. Reads the entire source file, so it should only be called from worker threads.
+		bool Revalidate(const std::string &identity, std::string &outConvertedPath);
+		// Hashing reads the entire source file, so it should only be requested from worker threads
+		void Update(const std::string &identity, const std::string &sourcePath, const std::string &convertedPath, const std::string &format, uint32_t flags, bool hashSource = false);
+		void Save();
+	  private:
+		TextureConversionManifest();
+		void Load();
+		std::string GetManifestPath() const;
+		std::mutex m_mutex;
+		std::unordered_map<std::string, Entry> m_entries;
+		bool m_dirty = false;
+	};
 };
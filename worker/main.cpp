@@ -0,0 +1,10 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+int pr_unirender_run_worker(int argc, char *argv[]);
+
+int main(int argc, char *argv[]) { return pr_unirender_run_worker(argc, argv); }
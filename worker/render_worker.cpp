@@ -0,0 +1,389 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+module;
+
+#include <sharedutils/datastream.h>
+#include <sharedutils/util.h>
+#include <sharedutils/util_path.hpp>
+#include <sharedutils/util_file.h>
+#include <sharedutils/util_string.h>
+#include <util_image_buffer.hpp>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <optional>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <fstream>
+#include <future>
+#include <filesystem>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <sched.h>
+#endif
+#ifdef PR_UNIRENDER_WORKER_WITH_TBB
+#include <tbb/global_control.h>
+#endif
+
+module pragma.modules.scenekit;
+
+import pragma.scenekit;
+import :serialization;
+import :render_queue;
+import :split_render;
+
+using namespace pragma::modules::scenekit;
+
+namespace {
+	struct WorkerArgs {
+		std::string jobPath;
+		std::string outputPath;
+		std::string renderer = "cycles";
+		uint32_t threadCount = 0;
+		// Render queue mode
+		std::string queuePath;
+		std::optional<uint32_t> numaNode {};
+		bool exitWhenIdle = false;
+	};
+};
+
+static void print_usage()
+{
+	std::cout << "Usage: pr_unirender_worker <job.prt> -o <output> [-t <threads>] [-r <renderer>]" << std::endl;
+	std::cout << "       pr_unirender_worker --queue <spool directory> [-t <threads>] [--numa-node <node>] [--once]" << std::endl;
+	std::cout << "  -o, --output    Output image, the format is determined by the extension (png, hdr, tga, bmp, jpg)" << std::endl;
+	std::cout << "  -t, --threads   Number of render threads, 0 uses all available cores (default)" << std::endl;
+	std::cout << "  -r, --renderer  Renderer to use (default: cycles)" << std::endl;
+	std::cout << "  --queue         Renders the jobs of a render queue until the process is terminated" << std::endl;
+	std::cout << "  --numa-node     Restricts the process to the cores of a NUMA node" << std::endl;
+	std::cout << "  --once          Exits once the render queue is empty" << std::endl;
+}
+
+static std::optional<WorkerArgs> parse_args(int argc, char *argv[])
+{
+	WorkerArgs args {};
+	for(auto i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto next = [&]() -> const char * { return (i + 1 < argc) ? argv[++i] : nullptr; };
+		const char *value = nullptr;
+		if(arg == "-o" || arg == "--output") {
+			if(!(value = next()))
+				return {};
+			args.outputPath = value;
+		}
+		else if(arg == "-t" || arg == "--threads") {
+			if(!(value = next()))
+				return {};
+			args.threadCount = static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+		}
+		else if(arg == "-r" || arg == "--renderer") {
+			if(!(value = next()))
+				return {};
+			args.renderer = value;
+		}
+		else if(arg == "--queue") {
+			if(!(value = next()))
+				return {};
+			args.queuePath = value;
+		}
+		else if(arg == "--numa-node") {
+			if(!(value = next()))
+				return {};
+			args.numaNode = static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+		}
+		else if(arg == "--once")
+			args.exitWhenIdle = true;
+		else if(arg.empty() == false && arg.front() != '-' && args.jobPath.empty())
+			args.jobPath = arg;
+		else
+			return {};
+	}
+	if(args.queuePath.empty() == false)
+		return args.jobPath.empty() ? std::optional<WorkerArgs> {args} : std::optional<WorkerArgs> {};
+	if(args.jobPath.empty() || args.outputPath.empty())
+		return {};
+	return args;
+}
+
+static bool set_numa_affinity(uint32_t node)
+{
+#ifdef _WIN32
+	ULONGLONG mask = 0;
+	if(GetNumaNodeProcessorMask(static_cast<UCHAR>(node), &mask) == FALSE || mask == 0)
+		return false;
+	return SetProcessAffinityMask(GetCurrentProcess(), static_cast<DWORD_PTR>(mask)) != FALSE;
+#else
+	// Format is a list of ranges, e.g. "0-15,32-47"
+	std::ifstream f {"/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"};
+	std::string cpuList;
+	if(!f || !std::getline(f, cpuList))
+		return false;
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	std::vector<std::string> ranges;
+	ustring::explode(cpuList, ",", ranges);
+	for(auto &range : ranges) {
+		auto sep = range.find('-');
+		auto first = std::strtoul(range.c_str(), nullptr, 10);
+		auto last = (sep != std::string::npos) ? std::strtoul(range.c_str() + sep + 1, nullptr, 10) : first;
+		for(auto cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+			CPU_SET(cpu, &cpuSet);
+	}
+	// Threads created afterwards inherit the affinity, so this has to happen before the renderer is initialized
+	return sched_setaffinity(0, sizeof(cpuSet), &cpuSet) == 0;
+#endif
+}
+
+static std::optional<uimg::ImageLayerSet> render_job(const std::string &jobPath, const std::string &rendererIdentifier, const std::optional<SplitRenderRegion> &region, const std::function<void(float)> &onProgress, std::string &outErr)
+{
+	auto ds = read_render_job_file(jobPath, outErr);
+	if(ds.has_value() == false) {
+		outErr = "Unable to load render job '" + jobPath + "': " + outErr;
+		return {};
+	}
+	auto nodeManager = pragma::scenekit::NodeManager::Create();
+	// Paths in the render job are relative to the directory it was saved to
+	auto scene = pragma::scenekit::Scene::Create(*nodeManager, *ds, ufile::get_path_from_filename(jobPath));
+	if(scene == nullptr) {
+		outErr = "Unable to load scene from render job '" + jobPath + "'";
+		return {};
+	}
+	if(region.has_value() && apply_split_render_region(*scene, *region, outErr) == false)
+		return {};
+	std::string err;
+	auto renderer = pragma::scenekit::Renderer::Create(*scene, rendererIdentifier, err, pragma::scenekit::Renderer::Flags::None);
+	if(renderer == nullptr) {
+		outErr = "Unable to create renderer '" + rendererIdentifier + "': " + err;
+		return {};
+	}
+
+	auto job = renderer->StartRender();
+	if(job.IsValid() == false) {
+		outErr = "Unable to start render";
+		return {};
+	}
+	job.Start();
+	while(job.IsComplete() == false) {
+		onProgress(job.GetProgress());
+		std::this_thread::sleep_for(std::chrono::milliseconds {100});
+	}
+	if(job.IsSuccessful() == false) {
+		outErr = "Render failed: " + job.GetResultMessage();
+		return {};
+	}
+	onProgress(1.f);
+	return job.GetResult();
+}
+
+static int run_single_job(const WorkerArgs &args)
+{
+	auto lastProgress = -1;
+	std::vector<std::string> files;
+	std::string err;
+	auto result = render_job(
+	  args.jobPath, args.renderer, {},
+	  [&lastProgress](float progress) {
+		  auto percent = static_cast<int32_t>(std::floor(progress * 100.f));
+		  if(percent == lastProgress)
+			  return;
+		  std::cout << "progress " << percent << std::endl;
+		  lastProgress = percent;
+	  },
+	  err);
+	if(result.has_value() == false || write_image_layers(*result, args.outputPath, files, err) == false) {
+		std::cout << "error " << err << std::endl;
+		return 1;
+	}
+	for(auto &f : files)
+		std::cout << "done " << f << std::endl;
+	return 0;
+}
+
+// Renders the job region by region, so an interruption only loses the region that was rendering. Every completed region is written
+// to the job directory while the next one is rendering, regions that already have a checkpoint from a previous (interrupted) attempt
+// are loaded instead of being rendered again. An interrupted region is rendered from scratch.
+static std::optional<uimg::ImageLayerSet> render_job_with_region_retry(const RenderQueue &queue, const RenderQueue::ClaimedJob &job, const std::function<void(float)> &onProgress, std::string &outErr)
+{
+	auto jobFilePath = queue.GetJobPath(job.jobId) + RENDER_QUEUE_JOB_FILE_NAME;
+	auto count = job.info.checkpointCount;
+	std::vector<uimg::ImageLayerSet> regions;
+	regions.reserve(count);
+	std::future<bool> checkpointWrite;
+	auto waitForCheckpointWrite = [&checkpointWrite, &job]() {
+		// A checkpoint that couldn't be written only means the region has to be rendered again if the job is interrupted
+		if(checkpointWrite.valid() && checkpointWrite.get() == false)
+			std::cout << "warning " << job.jobId << " Unable to write checkpoint" << std::endl;
+	};
+	for(auto i = decltype(count) {0u}; i < count; ++i) {
+		auto checkpointPath = queue.GetCheckpointPath(job.jobId, i);
+		std::error_code ec;
+		if(std::filesystem::exists(checkpointPath, ec)) {
+			std::string err;
+			auto region = read_image_layer_set(checkpointPath, err);
+			if(region.has_value()) {
+				std::cout << "resumed " << job.jobId << " " << i << std::endl;
+				regions.push_back(std::move(*region));
+				continue;
+			}
+			// The checkpoint is unusable, the region has to be rendered again
+		}
+
+		// render_job rejects the region if the camera isn't an equirectangular panorama (see apply_split_render_region),
+		// which fails the job instead of merging strips that don't line up
+		SplitRenderRegion region {};
+		region.index = i;
+		region.count = count;
+		region.horizontalRange = job.info.horizontalRange;
+		auto result = render_job(jobFilePath, job.info.renderer, region, [&onProgress, i, count](float progress) { onProgress((i + progress) / static_cast<float>(count)); }, outErr);
+		if(result.has_value() == false) {
+			waitForCheckpointWrite();
+			return {};
+		}
+		waitForCheckpointWrite();
+		checkpointWrite = std::async(std::launch::async, [checkpointPath, layers = *result]() { return write_image_layer_set(checkpointPath, layers); });
+		regions.push_back(std::move(*result));
+	}
+	waitForCheckpointWrite();
+
+	auto merged = merge_split_renders(regions, outErr);
+	if(merged.has_value() == false)
+		return {};
+	regions.clear();
+	if(job.info.denoise && denoise_image_layer_set(*merged) == false) {
+		outErr = "Denoising failed";
+		return {};
+	}
+	return merged;
+}
+
+static bool render_queue_job(const RenderQueue &queue, const RenderQueue::ClaimedJob &job, RenderQueueJobStatus &status, std::string &outErr)
+{
+	auto jobPath = queue.GetJobPath(job.jobId);
+	// The status file is polled by the client, there's no point in updating it more often than that
+	auto lastUpdate = std::chrono::steady_clock::now();
+	auto onProgress = [&](float progress) {
+		auto t = std::chrono::steady_clock::now();
+		if(t - lastUpdate < std::chrono::milliseconds {500})
+			return;
+		lastUpdate = t;
+		status.progress = progress;
+		queue.WriteJobStatus(job.jobId, status);
+	};
+	if(job.info.splitJobId.empty()) {
+		auto checkpointed = (job.info.checkpointCount > 1);
+		auto result = checkpointed ? render_job_with_region_retry(queue, job, onProgress, outErr) : render_job(jobPath + RENDER_QUEUE_JOB_FILE_NAME, job.info.renderer, {}, onProgress, outErr);
+		std::vector<std::string> files;
+		if(result.has_value() == false || write_image_layers(*result, jobPath + job.info.outputFileName, files, outErr) == false)
+			return false;
+		for(auto &f : files)
+			status.outputFiles.push_back(f.substr(jobPath.size()));
+		if(checkpointed) {
+			// The checkpoints are no longer needed once the output exists
+			for(auto i = decltype(job.info.checkpointCount) {0u}; i < job.info.checkpointCount; ++i) {
+				std::error_code ec;
+				std::filesystem::remove(queue.GetCheckpointPath(job.jobId, i), ec);
+			}
+		}
+		return true;
+	}
+
+	// Part of a split job, the result is only merged once all parts are complete
+	auto splitInfo = queue.ReadJobInfo(job.info.splitJobId);
+	if(splitInfo.has_value() == false) {
+		outErr = "Split job '" + job.info.splitJobId + "' doesn't exist";
+		return false;
+	}
+	SplitRenderRegion region {};
+	region.index = job.info.splitIndex;
+	region.count = splitInfo->splitCount;
+	region.horizontalRange = splitInfo->horizontalRange;
+	auto result = render_job(queue.GetJobPath(job.info.splitJobId) + RENDER_QUEUE_JOB_FILE_NAME, job.info.renderer, region, onProgress, outErr);
+	if(result.has_value() == false)
+		return false;
+	if(write_image_layer_set(jobPath + RENDER_QUEUE_PART_FILE_NAME, *result) == false) {
+		outErr = "Unable to write partial render";
+		return false;
+	}
+	status.outputFiles.push_back(RENDER_QUEUE_PART_FILE_NAME);
+	return true;
+}
+
+static int run_render_queue(const WorkerArgs &args)
+{
+	RenderQueue queue {args.queuePath};
+	for(;;) {
+		auto job = queue.ClaimNextJob();
+		if(job.has_value() == false) {
+			if(args.exitWhenIdle)
+				return 0;
+			std::this_thread::sleep_for(std::chrono::seconds {1});
+			continue;
+		}
+		std::cout << "claimed " << job->jobId << std::endl;
+		// The status has already been marked as rendering by the claim
+		auto status = job->status;
+
+		std::string err;
+		if(render_queue_job(queue, *job, status, err)) {
+			status.state = RenderQueueJobState::Complete;
+			status.progress = 1.f;
+			std::cout << "done " << job->jobId << std::endl;
+		}
+		else {
+			status.state = RenderQueueJobState::Failed;
+			status.message = err;
+			status.outputFiles.clear();
+			std::cout << "error " << job->jobId << " " << err << std::endl;
+		}
+		queue.WriteJobStatus(job->jobId, status);
+		if(job->info.splitJobId.empty() == false) {
+			// Release the part before merging, the merge checks the state of all parts
+			auto splitJobId = job->info.splitJobId;
+			job = {};
+			if(queue.TryCompleteSplitJob(splitJobId))
+				std::cout << "done " << splitJobId << std::endl;
+		}
+	}
+}
+
+// The worker has no engine and no GPU requirements. It prints one status line per event, so a caller can parse the output:
+// "progress <0-100>", "done <path>" for every written image and "error <message>" if the render failed.
+// In render queue mode, the lines are "claimed <job id>", "resumed <job id> <region>" for every region loaded from a checkpoint,
+// "done <job id>" and "error <job id> <message>".
+extern "C++" int pr_unirender_run_worker(int argc, char *argv[])
+{
+	auto args = parse_args(argc, argv);
+	if(args.has_value() == false) {
+		print_usage();
+		return 1;
+	}
+	if(args->numaNode.has_value() && set_numa_affinity(*args->numaNode) == false)
+		std::cout << "warning Unable to restrict process to NUMA node " << *args->numaNode << std::endl;
+#ifdef PR_UNIRENDER_WORKER_WITH_TBB
+	// Cycles schedules its work through tbb, which respects the lowest active parallelism limit in the process
+	std::optional<tbb::global_control> threadLimit {};
+	if(args->threadCount > 0)
+		threadLimit.emplace(tbb::global_control::max_allowed_parallelism, args->threadCount);
+#else
+	if(args->threadCount > 0)
+		std::cout << "warning Thread count is not supported by this build and will be ignored" << std::endl;
+#endif
+	// The worker is installed in "modules/unirender/" and the renderer modules are located in sub-directories next to it.
+	// The lookup location can't be relative to the working directory, since the worker may be launched from anywhere.
+	auto modulePath = util::Path::CreatePath(util::get_program_path()).GetString();
+	pragma::scenekit::set_module_lookup_location(modulePath);
+	if(args->queuePath.empty() == false)
+		return run_render_queue(*args);
+	return run_single_job(*args);
+}